@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "filesystem.h"
+#include "alloc.h"
+#include "journal.h"
+#include "fat.h"
+#include "stats.h"
+#include "log.h"
+
+// Free-space index for the data area.
+//
+// One bit per data cluster, packed into 64-bit words, with a set bit meaning
+// the cluster is free. Searches start at a rotating hint (the word after the
+// last allocation), skip full words 64 clusters at a time and pick the lowest
+// free bit with a count-trailing-zeros, so filling a volume costs O(1)
+// amortized per allocation instead of a FAT scan from index 0.
+//
+// The bitmap is rebuilt from the FAT at mount time; alloc_block, alloc_run
+// and alloc_free keep it, the FAT entries and superblock.free_clusters_count in
+// step under alloc_lock, which also serializes every FAT entry change made
+// on behalf of the allocator.
+//
+// When the superblock's free count and hint can be trusted (a lazily loaded
+// FAT on a cleanly unmounted volume), alloc_init reads nothing: the bits of
+// each FAT block's clusters are filled in the first time a search or a free
+// reaches them, and `loaded` records which FAT blocks that has happened for.
+//
+// Clusters shared by clones carry a reference count (see fat.c). alloc_ref
+// and alloc_release change the counts under alloc_lock too, and a cluster
+// only returns to the free pool when its last reference goes.
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *bitmap = NULL;
+static uint32_t nwords = 0;
+static uint32_t hint = 0;
+static uint64_t *loaded = NULL;     // one bit per FAT block whose clusters are in the bitmap
+
+static int is_free(uint32_t c) {
+    return (bitmap[c / 64] >> (c % 64)) & 1;
+}
+
+static void mark_used(uint32_t c) {
+    bitmap[c / 64] &= ~(1ULL << (c % 64));
+}
+
+static void mark_free(uint32_t c) {
+    bitmap[c / 64] |= 1ULL << (c % 64);
+}
+
+// Fill in the bitmap for the clusters of the FAT block holding cluster `c`
+// the first time it is needed. If the block cannot be read its clusters stay
+// marked used until the next visit. Called with alloc_lock held, or by
+// alloc_init.
+static int load_bits(uint32_t c) {
+    uint32_t block = c / FAT_ENTRIES_PER_BLOCK;
+    if ((loaded[block / 64] >> (block % 64)) & 1) {
+        return 0;
+    }
+
+    uint32_t entries[FAT_ENTRIES_PER_BLOCK];
+    if (fat_read_block(block, entries) < 0) {
+        return -1;
+    }
+    uint32_t first = block * FAT_ENTRIES_PER_BLOCK;
+    for (uint32_t i = 0; i < FAT_ENTRIES_PER_BLOCK && first + i < superblock.data_clusters_count; i++) {
+        if (entries[i] == FAT_FREE) {
+            mark_free(first + i);
+        }
+    }
+    loaded[block / 64] |= 1ULL << (block % 64);
+    return 0;
+}
+
+// Build the free-space index. With `trust_summary`, take the free count and
+// hint from the superblock and load the bitmap on demand; otherwise read the
+// whole FAT and recount.
+int alloc_init(int trust_summary) {
+    uint32_t fat_blocks = (superblock.data_clusters_count + FAT_ENTRIES_PER_BLOCK - 1) / FAT_ENTRIES_PER_BLOCK;
+    nwords = (superblock.data_clusters_count + 63) / 64;
+    bitmap = (uint64_t *)calloc(nwords, sizeof(uint64_t));
+    loaded = (uint64_t *)calloc((fat_blocks + 63) / 64, sizeof(uint64_t));
+    if (!bitmap || !loaded) {
+        log_error(FS_ENOMEM, "alloc_init: failed to allocate free-space bitmap");
+        alloc_destroy();
+        return -1;
+    }
+
+    if (trust_summary && superblock.free_clusters_count <= superblock.data_clusters_count) {
+        hint = (superblock.alloc_hint < superblock.data_clusters_count) ? superblock.alloc_hint / 64 : 0;
+        return 0;
+    }
+
+    uint32_t free_count = 0;
+    for (uint32_t c = 0; c < superblock.data_clusters_count; c += FAT_ENTRIES_PER_BLOCK) {
+        if (load_bits(c) < 0) {
+            alloc_destroy();
+            return -1;
+        }
+    }
+    for (uint32_t w = 0; w < nwords; w++) {
+        free_count += (uint32_t)__builtin_popcountll(bitmap[w]);
+    }
+
+    superblock.free_clusters_count = free_count;
+    hint = 0;
+    return 0;
+}
+
+void alloc_destroy() {
+    free(bitmap);
+    free(loaded);
+    bitmap = NULL;
+    loaded = NULL;
+    nwords = 0;
+}
+
+// Return the lowest free cluster at or after the hint, wrapping once.
+static uint32_t scan_free() {
+    if (superblock.free_clusters_count == 0) {
+        return ALLOC_NONE;
+    }
+    for (uint32_t n = 0; n < nwords; n++) {
+        uint32_t w = (hint + n) % nwords;
+        load_bits(w * 64);
+        if (bitmap[w]) {
+            stats_add(STAT_ALLOC_SCAN, n + 1);
+            hint = w;
+            return w * 64 + (uint32_t)__builtin_ctzll(bitmap[w]);
+        }
+    }
+    stats_add(STAT_ALLOC_SCAN, nwords);
+    return ALLOC_NONE;
+}
+
+// Return a free cluster without allocating it.
+uint32_t alloc_find() {
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t c = scan_free();
+    pthread_mutex_unlock(&alloc_lock);
+    return c;
+}
+
+// Allocate one cluster and mark it as the end of a chain.
+uint32_t alloc_block() {
+    stats_add(STAT_ALLOC_CALLS, 1);
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t c = scan_free();
+    if (c != ALLOC_NONE && journal_fat(c, FAT_EOF) < 0) {
+        c = ALLOC_NONE;
+    } else if (c != ALLOC_NONE) {
+        mark_used(c);
+        superblock.free_clusters_count--;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    log_trace(TRACE_ALLOC, c, 1);
+    return c;
+}
+
+// Claim the `count` free clusters from `first` on and link them into a
+// chain. If a FAT entry cannot be set, those linked so far are freed again,
+// or stay claimed (leaked) if even that fails. Called with alloc_lock held.
+static int link_run(uint32_t first, uint32_t count) {
+    uint32_t i = 0;
+    while (i < count && journal_fat(first + i, (i == count - 1) ? FAT_EOF : first + i + 1) == 0) {
+        i++;
+    }
+    if (i < count) {
+        while (i-- > 0) {
+            if (journal_fat(first + i, FAT_FREE) < 0) {
+                mark_used(first + i);
+                superblock.free_clusters_count--;
+            }
+        }
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        mark_used(first + i);
+    }
+    return 0;
+}
+
+// Find, claim and link a contiguous run. Called with alloc_lock held.
+static uint32_t run_locked(uint32_t count) {
+    if (count == 0 || count > superblock.free_clusters_count) {
+        return ALLOC_NONE;
+    }
+
+    uint32_t total = superblock.data_clusters_count;
+    uint32_t start = (hint * 64 < total) ? hint * 64 : 0;
+    uint32_t scanned = 0;
+    uint32_t steps = 0;
+    uint32_t run = 0;
+
+    // Walk clusters from the hint, wrapping once; a run cannot span the wrap
+    for (uint32_t c = start; scanned < total; scanned++, steps++) {
+        if (c % 64 == 0) {
+            load_bits(c);
+        }
+        if (c % 64 == 0 && run == 0 && bitmap[c / 64] == 0) {
+            // Whole word is in use, skip it
+            scanned += 63;
+            c += 64;
+        } else if (is_free(c)) {
+            if (++run == count) {
+                uint32_t first = c + 1 - count;
+                if (link_run(first, count) < 0) {
+                    return ALLOC_NONE;
+                }
+                superblock.free_clusters_count -= count;
+                hint = c / 64;
+                stats_add(STAT_ALLOC_SCAN, steps + 1);
+                return first;
+            }
+            c++;
+        } else {
+            run = 0;
+            c++;
+        }
+
+        if (c >= total) {
+            c = 0;
+            run = 0;
+        }
+    }
+
+    stats_add(STAT_ALLOC_SCAN, steps);
+    return ALLOC_NONE;
+}
+
+// Allocate `count` physically contiguous clusters, already linked into a
+// chain that ends with FAT_EOF. Returns the first cluster.
+uint32_t alloc_run(uint32_t count) {
+    if (count == 1) {
+        return alloc_block();
+    }
+
+    stats_add(STAT_ALLOC_CALLS, 1);
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t first = run_locked(count);
+    pthread_mutex_unlock(&alloc_lock);
+    log_trace(TRACE_ALLOC, first, count);
+    return first;
+}
+
+// Mark a cluster free in the FAT and the bitmap. Called with alloc_lock held.
+static int free_locked(uint32_t cluster) {
+    load_bits(cluster);
+    if (journal_fat(cluster, FAT_FREE) < 0) {
+        return -1;
+    }
+    if (!is_free(cluster)) {
+        mark_free(cluster);
+        superblock.free_clusters_count++;
+    }
+    return 0;
+}
+
+// Return a cluster to the free pool. On failure it stays allocated.
+int alloc_free(uint32_t cluster) {
+    pthread_mutex_lock(&alloc_lock);
+    int result = free_locked(cluster);
+    pthread_mutex_unlock(&alloc_lock);
+    return result;
+}
+
+// Add a reference to `cluster`, which a new entry or FAT entry is about to
+// point at. Returns 1 without logging on a volume that keeps no reference
+// counts or when the cluster already has ALLOC_MAX_REFS, and -1 if the count
+// cannot be read or changed.
+int alloc_ref(uint32_t cluster) {
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t refs = fat_refs(cluster);
+    int result;
+    if (refs == FAT_ERROR) {
+        result = -1;
+    } else if (superblock.ref_blocks == 0 || refs >= ALLOC_MAX_REFS) {
+        result = 1;
+    } else {
+        result = journal_refs(cluster, refs);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return result;
+}
+
+// Drop a reference to the chain starting at `cluster`. Clusters are freed
+// along the chain while nothing else refers to them; the first one shared
+// with another chain loses a reference and the rest of the chain is left to
+// its other owners. The clusters visited count as FAT steps. If the FAT or a
+// reference count cannot be read or changed, the rest of the chain is left
+// allocated (a leak, never a cluster freed while in use) and -1 is returned.
+int alloc_release(uint32_t cluster) {
+    uint32_t steps = 0;
+    int result = 0;
+    while (cluster < superblock.data_clusters_count && result == 0) {
+        pthread_mutex_lock(&alloc_lock);
+        uint32_t refs = fat_refs(cluster);
+        uint32_t next = FAT_EOF;
+        if (refs == FAT_ERROR) {
+            result = -1;
+        } else if (refs > 1) {
+            result = journal_refs(cluster, refs - 2);
+        } else {
+            next = fat_get(cluster);
+            if (next == FAT_ERROR || free_locked(cluster) < 0) {
+                result = -1;
+            }
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        cluster = next;
+        steps++;
+    }
+    stats_add(STAT_FAT_STEPS, steps);
+    return result;
+}
+
+// Copy the superblock with its free cluster count and hint taken under the
+// allocator lock, for writing it to disk while other threads allocate.
+void alloc_superblock(superblock_t *out) {
+    pthread_mutex_lock(&alloc_lock);
+    superblock.alloc_hint = hint * 64;
+    memcpy(out, &superblock, sizeof(superblock_t));
+    pthread_mutex_unlock(&alloc_lock);
+}
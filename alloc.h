@@ -0,0 +1,23 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+#include "filesystem.h"
+
+// Constants
+#define ALLOC_NONE ((uint32_t)-1)   // Returned when no (contiguous) free space is available
+#define ALLOC_MAX_REFS 256          // References a cluster can have (the count beyond the first is a byte)
+
+// Function prototypes
+int alloc_init(int trust_summary);
+void alloc_destroy();
+
+uint32_t alloc_find();
+uint32_t alloc_block();
+uint32_t alloc_run(uint32_t count);
+int alloc_free(uint32_t cluster);
+int alloc_ref(uint32_t cluster);
+int alloc_release(uint32_t cluster);
+void alloc_superblock(superblock_t *out);
+
+#endif
@@ -0,0 +1,687 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "cache.h"
+#include "disk.h"
+#include "log.h"
+
+// Write-back buffer cache for disk blocks.
+//
+// Every entry owns one BLOCK_SIZE page in a single pool. Entries are found
+// through a chained hash table keyed by block number and are recycled with
+// the CLOCK algorithm: a hit sets the reference bit, the hand clears it, and
+// the first unpinned entry found with the bit already clear is evicted
+// (written back first if dirty). Pinned entries (cache_get without a
+// matching cache_put) are never evicted.
+//
+// The cache is split into CACHE_SHARDS independent shards selected by block
+// number, each with its own lock, entries, hash table and CLOCK hand, so
+// threads working on different blocks rarely contend. A shard lock is held
+// for lookups and for the disk I/O of a miss or write-back, never while the
+// caller copies data in or out of a pinned page.
+//
+// When the disk is memory-mapped (DISK_BACKEND_MMAP) the mapping already is
+// the cache: cache_get hands out pointers into it and no pages are copied.
+//
+// The page pool is registered with the disk (register_disk_buffers), so with
+// the io_uring backend misses and write-backs use fixed buffers.
+//
+// cache_prefetch loads blocks in the background for readahead: it claims an
+// entry for each block, marks it loading and queues it for a worker thread,
+// which reads the queued blocks with one batch. cache_get on a loading entry
+// waits for the worker; a direct write to a loading block marks it stale and
+// the entry is dropped when the load completes instead of being published.
+//
+// Pages dirtied with cache_mark_logged carry the LSN of the journal record
+// describing the change and are not written back until the journal reports
+// that record durable (write-ahead logging); CLOCK passes over them. When a
+// shard has nothing else to evict, cache_get has the journal commit up to
+// the oldest such record and tries again, so asynchronous commits cannot
+// leave a shard full of dirty pages.
+
+typedef struct {
+    int block;          // disk block held by this entry, -1 if empty
+    int next;           // next entry in the same hash chain, -1 terminates
+    int pins;           // outstanding cache_get references
+    uint8_t referenced; // CLOCK reference bit
+    uint8_t dirty;      // page differs from the disk copy
+    uint8_t loading;    // queued for or under a prefetch read, pinned by the worker
+    uint8_t stale;      // written directly while loading; drop when the load ends
+    uint64_t lsn;       // journal record that must be durable before write-back, 0 if none
+} cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int first;          // index of the shard's first entry in entries[]
+    int *buckets;       // hash chains of entry indexes
+    int clock_hand;     // next entry (relative to first) examined by CLOCK
+    pthread_cond_t loaded; // signalled when a prefetch of the shard completes
+    cache_stats_t stats;
+} cache_shard_t;
+
+// Prefetch queue: entry indexes waiting for the worker, FIFO
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int *items;         // nentries slots, enough for every entry at once
+    int head, count;
+    int stop;
+    pthread_t thread;
+} prefetch_queue_t;
+
+static cache_entry_t *entries = NULL;
+static char *pool = NULL;
+static int *bucket_pool = NULL;
+static int nentries = 0;        // total entries, shard_entries per shard
+static int shard_entries = 0;
+static int nbuckets = 0;        // hash buckets per shard
+static cache_shard_t shards[CACHE_SHARDS];
+static uint64_t mapped_hits = 0;
+static cache_wal_fn wal = NULL;
+static cache_commit_fn wal_commit = NULL;
+static prefetch_queue_t prefetch;
+
+static uint32_t hash_block(int block) {
+    return (uint32_t)block * 2654435761u;
+}
+
+static cache_shard_t *shard_of(int block) {
+    return &shards[(hash_block(block) >> 16) % CACHE_SHARDS];
+}
+
+static int *bucket_of(cache_shard_t *shard, int block) {
+    return &shard->buckets[hash_block(block) & (uint32_t)(nbuckets - 1)];
+}
+
+static char *page_of(int i) {
+    return pool + (size_t)i * BLOCK_SIZE;
+}
+
+static int lookup(cache_shard_t *shard, int block) {
+    for (int i = *bucket_of(shard, block); i != -1; i = entries[i].next) {
+        if (entries[i].block == block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void unlink_entry(cache_shard_t *shard, int i) {
+    int *link = bucket_of(shard, entries[i].block);
+    while (*link != i) {
+        link = &entries[*link].next;
+    }
+    *link = entries[i].next;
+    entries[i].next = -1;
+    entries[i].block = -1;
+}
+
+// Check whether a dirty page may be written back under write-ahead logging.
+static int wal_allows(int i) {
+    return entries[i].lsn == 0 || !wal || wal(entries[i].lsn);
+}
+
+static int write_back(cache_shard_t *shard, int i) {
+    if (block_write(entries[i].block, page_of(i)) < 0) {
+        log_error(FS_EIO, "cache: failed to write back block %d", entries[i].block);
+        return -1;
+    }
+    entries[i].dirty = 0;
+    entries[i].lsn = 0;
+    shard->stats.writebacks++;
+    return 0;
+}
+
+// Find a reusable entry in the shard with the CLOCK hand. Two full sweeps
+// are enough to clear every reference bit; after that only pinned entries
+// and pages waiting for the journal remain. In the latter case, with
+// `wait_lsn`, the lowest record they wait for is stored there and -1 is
+// returned without logging. A fully pinned shard is an error for
+// cache_get; with `quiet` (a prefetch, which just skips the block) -1 is
+// returned without logging it. Called with the shard lock held.
+static int evict(cache_shard_t *shard, uint64_t *wait_lsn, int quiet) {
+    uint64_t held = 0;
+    for (int scanned = 0; scanned < 2 * shard_entries; scanned++) {
+        int i = shard->first + shard->clock_hand;
+        shard->clock_hand = (shard->clock_hand + 1) % shard_entries;
+
+        cache_entry_t *e = &entries[i];
+        if (e->pins > 0) {
+            continue;
+        }
+        if (e->block == -1) {
+            return i;
+        }
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        if (e->dirty && !wal_allows(i)) {
+            if (held == 0 || e->lsn < held) {
+                held = e->lsn;  // its journal record is not on disk yet
+            }
+            continue;
+        }
+
+        if (e->dirty && write_back(shard, i) < 0) {
+            return -1;
+        }
+        unlink_entry(shard, i);
+        shard->stats.evictions++;
+        return i;
+    }
+
+    if (held != 0 && wait_lsn) {
+        *wait_lsn = held;
+        return -1;
+    }
+    if (quiet) {
+        return -1;
+    }
+    log_error(FS_EBUSY, "cache: all %d entries of a shard are pinned", shard_entries);
+    return -1;
+}
+
+// Background reader for cache_prefetch: takes up to PREFETCH_BATCH queued
+// entries, reads them with one batch and publishes or drops them.
+static void *prefetch_worker(void *arg) {
+    disk_io_t io[PREFETCH_BATCH];
+    int batch[PREFETCH_BATCH];
+    (void)arg;
+
+    pthread_mutex_lock(&prefetch.lock);
+    for (;;) {
+        while (prefetch.count == 0 && !prefetch.stop) {
+            pthread_cond_wait(&prefetch.wake, &prefetch.lock);
+        }
+        if (prefetch.count == 0) {
+            break;
+        }
+
+        int n = 0;
+        while (prefetch.count > 0 && n < PREFETCH_BATCH) {
+            batch[n] = prefetch.items[prefetch.head];
+            io[n] = (disk_io_t){ entries[batch[n]].block, 1, page_of(batch[n]) };
+            prefetch.head = (prefetch.head + 1) % nentries;
+            prefetch.count--;
+            n++;
+        }
+        pthread_mutex_unlock(&prefetch.lock);
+
+        int failed = block_read_batch(io, n) < 0;
+        for (int k = 0; k < n; k++) {
+            int i = batch[k];
+            cache_shard_t *shard = &shards[i / shard_entries];
+            pthread_mutex_lock(&shard->lock);
+            entries[i].loading = 0;
+            entries[i].pins--;
+            if (failed || entries[i].stale) {
+                // Waiters find the block missing and read it themselves
+                entries[i].stale = 0;
+                unlink_entry(shard, i);
+            }
+            pthread_cond_broadcast(&shard->loaded);
+            pthread_mutex_unlock(&shard->lock);
+        }
+
+        pthread_mutex_lock(&prefetch.lock);
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+    return NULL;
+}
+
+int cache_init(int nblocks) {
+    if (nblocks <= 0) {
+        nblocks = CACHE_DEFAULT_BLOCKS;
+    }
+
+    shard_entries = (nblocks + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    nentries = shard_entries * CACHE_SHARDS;
+    nbuckets = 1;
+    while (nbuckets < 2 * shard_entries) {
+        nbuckets <<= 1;
+    }
+
+    entries = (cache_entry_t *)malloc(nentries * sizeof(cache_entry_t));
+    pool = (char *)malloc((size_t)nentries * BLOCK_SIZE);
+    bucket_pool = (int *)malloc((size_t)nbuckets * CACHE_SHARDS * sizeof(int));
+    prefetch.items = (int *)malloc(nentries * sizeof(int));
+    if (!entries || !pool || !bucket_pool || !prefetch.items) {
+        log_error(FS_ENOMEM, "cache_init: failed to allocate %d cache blocks", nentries);
+        free(entries);
+        free(pool);
+        free(bucket_pool);
+        free(prefetch.items);
+        entries = NULL;
+        pool = NULL;
+        bucket_pool = NULL;
+        prefetch.items = NULL;
+        nentries = 0;
+        return -1;
+    }
+
+    for (int i = 0; i < nentries; i++) {
+        entries[i].block = -1;
+        entries[i].next = -1;
+        entries[i].pins = 0;
+        entries[i].referenced = 0;
+        entries[i].dirty = 0;
+        entries[i].loading = 0;
+        entries[i].stale = 0;
+        entries[i].lsn = 0;
+    }
+    for (int i = 0; i < nbuckets * CACHE_SHARDS; i++) {
+        bucket_pool[i] = -1;
+    }
+
+    register_disk_buffers(pool, (size_t)nentries * BLOCK_SIZE);
+
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_mutex_init(&shards[s].lock, NULL);
+        pthread_cond_init(&shards[s].loaded, NULL);
+        shards[s].first = s * shard_entries;
+        shards[s].buckets = bucket_pool + (size_t)s * nbuckets;
+        shards[s].clock_hand = 0;
+        memset(&shards[s].stats, 0, sizeof(cache_stats_t));
+    }
+    mapped_hits = 0;
+
+    pthread_mutex_init(&prefetch.lock, NULL);
+    pthread_cond_init(&prefetch.wake, NULL);
+    prefetch.head = prefetch.count = prefetch.stop = 0;
+    if (pthread_create(&prefetch.thread, NULL, prefetch_worker, NULL) != 0) {
+        log_error(FS_EIO, "cache_init: failed to start the prefetch thread");
+        prefetch.stop = 1;  // cache_prefetch becomes a no-op
+    }
+    return 0;
+}
+
+int cache_destroy() {
+    if (!entries) {
+        return 0;
+    }
+
+    // Let the worker finish the queued prefetches and exit
+    pthread_mutex_lock(&prefetch.lock);
+    int running = !prefetch.stop;
+    prefetch.stop = 1;
+    pthread_cond_signal(&prefetch.wake);
+    pthread_mutex_unlock(&prefetch.lock);
+    if (running) {
+        pthread_join(prefetch.thread, NULL);
+    }
+    pthread_mutex_destroy(&prefetch.lock);
+    pthread_cond_destroy(&prefetch.wake);
+    free(prefetch.items);
+    prefetch.items = NULL;
+
+    int result = cache_flush();
+
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_mutex_destroy(&shards[s].lock);
+        pthread_cond_destroy(&shards[s].loaded);
+    }
+    register_disk_buffers(NULL, 0);
+    free(entries);
+    free(pool);
+    free(bucket_pool);
+    entries = NULL;
+    pool = NULL;
+    bucket_pool = NULL;
+    nentries = shard_entries = nbuckets = 0;
+    return result;
+}
+
+// Return a pinned pointer to the cached copy of `block`, loading it from disk
+// on a miss unless CACHE_NOREAD is given. The page stays valid until the
+// matching cache_put.
+char *cache_get(int block, int flags) {
+    char *mapped = block_ptr(block);
+    if (mapped) {
+        __atomic_fetch_add(&mapped_hits, 1, __ATOMIC_RELAXED);
+        return mapped;
+    }
+
+    if (!entries) {
+        log_error(FS_ENODEV, "cache_get: cache not initialized");
+        return NULL;
+    }
+
+    cache_shard_t *shard = shard_of(block);
+    pthread_mutex_lock(&shard->lock);
+
+    int i, hit;
+    for (;;) {
+        while ((i = lookup(shard, block)) != -1 && entries[i].loading) {
+            pthread_cond_wait(&shard->loaded, &shard->lock);
+        }
+        hit = (i != -1);
+        uint64_t wait_lsn = 0;
+        if (hit || (i = evict(shard, wal_commit ? &wait_lsn : NULL, 0)) != -1 || wait_lsn == 0) {
+            break;
+        }
+
+        // Only pages waiting for the journal are left: commit it and look again
+        pthread_mutex_unlock(&shard->lock);
+        int result = wal_commit(wait_lsn);
+        pthread_mutex_lock(&shard->lock);
+        if (result < 0) {
+            break;
+        }
+    }
+
+    if (hit) {
+        shard->stats.hits++;
+    } else {
+        shard->stats.misses++;
+        if (i == -1) {
+            pthread_mutex_unlock(&shard->lock);
+            return NULL;
+        }
+
+        if (!(flags & CACHE_NOREAD) && block_read(block, page_of(i)) < 0) {
+            pthread_mutex_unlock(&shard->lock);
+            return NULL;
+        }
+
+        int *b = bucket_of(shard, block);
+        entries[i].block = block;
+        entries[i].next = *b;
+        entries[i].dirty = 0;
+        entries[i].lsn = 0;
+        *b = i;
+    }
+
+    entries[i].pins++;
+    entries[i].referenced = 1;
+    pthread_mutex_unlock(&shard->lock);
+    return page_of(i);
+}
+
+// Release a page returned by cache_get, marking it dirty if it was modified.
+void cache_put(char *data, int dirty) {
+    if (data < pool || data >= pool + (size_t)nentries * BLOCK_SIZE) {
+        return;  // pointer into the mapped disk, nothing to release
+    }
+
+    int i = (int)((data - pool) / BLOCK_SIZE);
+    cache_shard_t *shard = &shards[i / shard_entries];
+
+    pthread_mutex_lock(&shard->lock);
+    if (dirty) {
+        entries[i].dirty = 1;
+    }
+    entries[i].pins--;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Mark a pinned page dirty with a change logged as journal record `lsn`;
+// the page is not written back before that record is durable.
+void cache_mark_logged(char *data, uint64_t lsn) {
+    if (data < pool || data >= pool + (size_t)nentries * BLOCK_SIZE) {
+        return;
+    }
+
+    int i = (int)((data - pool) / BLOCK_SIZE);
+    cache_shard_t *shard = &shards[i / shard_entries];
+
+    pthread_mutex_lock(&shard->lock);
+    entries[i].dirty = 1;
+    if (lsn > entries[i].lsn) {
+        entries[i].lsn = lsn;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Install the journal's durability check used before logged pages are
+// written back, and the commit eviction falls back on. `commit` is called
+// without any cache lock held and must not be reached with journal_lock held.
+void cache_set_wal(cache_wal_fn durable, cache_commit_fn commit) {
+    wal = durable;
+    wal_commit = commit;
+}
+
+int cache_read(int block, char *buf) {
+    char *page = cache_get(block, 0);
+    if (!page) {
+        return -1;
+    }
+    memcpy(buf, page, BLOCK_SIZE);
+    cache_put(page, 0);
+    return 0;
+}
+
+int cache_write(int block, const char *buf) {
+    char *page = cache_get(block, CACHE_NOREAD);
+    if (!page) {
+        return -1;
+    }
+    memcpy(page, buf, BLOCK_SIZE);
+    cache_put(page, 1);
+    return 0;
+}
+
+// Write back the dirty cached copies of `count` consecutive blocks. Entries
+// stay cached and clean.
+int cache_flush_range(int block, int count) {
+    for (int b = block; entries && b < block + count; b++) {
+        cache_shard_t *shard = shard_of(b);
+        pthread_mutex_lock(&shard->lock);
+        int i = lookup(shard, b);
+        int result = (i != -1 && entries[i].dirty && wal_allows(i)) ? write_back(shard, i) : 0;
+        pthread_mutex_unlock(&shard->lock);
+        if (result < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read `count` consecutive blocks straight from disk into the caller's buffer
+// with one vectored read. Dirty cached copies in the range are written back
+// first so the disk holds the latest data.
+int cache_read_direct(int block, int count, char *buf) {
+    disk_io_t io = { block, count, buf };
+    return cache_read_batch(&io, 1);
+}
+
+// Read several block ranges straight from disk, submitted together, after
+// writing back their dirty cached copies.
+int cache_read_batch(const disk_io_t *io, int n) {
+    for (int i = 0; i < n; i++) {
+        if (cache_flush_range(io[i].block, io[i].count) < 0) {
+            return -1;
+        }
+    }
+    return block_read_batch(io, n);
+}
+
+// Refresh the cached copies of blocks in a direct-write range. With `failed`,
+// the write did not reach the disk, so the copies are left dirty instead.
+static void refresh_range(int block, int count, const char *buf, int failed) {
+    for (int b = block; entries && b < block + count; b++) {
+        cache_shard_t *shard = shard_of(b);
+        pthread_mutex_lock(&shard->lock);
+        int i = lookup(shard, b);
+        if (i != -1 && entries[i].loading) {
+            entries[i].stale = 1;  // the load in flight may return the old data
+        } else if (i != -1) {
+            if (!failed) {
+                memcpy(page_of(i), buf + (size_t)(b - block) * BLOCK_SIZE, BLOCK_SIZE);
+            }
+            entries[i].dirty = failed;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Write `count` consecutive blocks straight from the caller's buffer to disk
+// with one vectored write. Cached copies in the range are refreshed and
+// marked clean instead of being written later.
+int cache_write_direct(int block, int count, const char *buf) {
+    disk_io_t io = { block, count, (char *)buf };
+    return cache_write_batch(&io, 1);
+}
+
+// Write several block ranges straight to disk, submitted together, refreshing
+// their cached copies as cache_write_direct does.
+int cache_write_batch(const disk_io_t *io, int n) {
+    for (int i = 0; i < n; i++) {
+        refresh_range(io[i].block, io[i].count, io[i].buf, 0);
+    }
+
+    if (block_write_batch(io, n) < 0) {
+        // The cached copies now hold data the disk may not; keep them dirty
+        for (int i = 0; i < n; i++) {
+            refresh_range(io[i].block, io[i].count, io[i].buf, 1);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Copy `count` consecutive blocks from `from` to `to` inside the disk
+// (block_copy), without bringing them into memory. Dirty cached copies of
+// the source are written back first; cached copies of the destination are
+// dropped, or reloaded if pinned.
+int cache_copy_direct(int from, int to, int count) {
+    if (cache_flush_range(from, count) < 0 || block_copy(from, to, count) < 0) {
+        return -1;
+    }
+
+    int result = 0;
+    for (int b = to; entries && b < to + count; b++) {
+        cache_shard_t *shard = shard_of(b);
+        pthread_mutex_lock(&shard->lock);
+        int i = lookup(shard, b);
+        if (i != -1 && entries[i].loading) {
+            entries[i].stale = 1;  // the load in flight may return the old data
+        } else if (i != -1 && entries[i].pins > 0) {
+            if (block_read(b, page_of(i)) < 0) {
+                result = -1;
+            } else {
+                entries[i].dirty = 0;
+            }
+        } else if (i != -1) {
+            unlink_entry(shard, i);
+            entries[i].dirty = 0;
+            entries[i].lsn = 0;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return result;
+}
+
+// Start loading up to PREFETCH_BATCH blocks into the cache in the background
+// and return without waiting. Blocks already cached are skipped, and
+// prefetching stops early when a shard has no entry to spare. Returns the
+// number of blocks queued.
+int cache_prefetch(const int *blocks, int n) {
+    int batch[PREFETCH_BATCH];
+    int queued = 0;
+
+    // The mapping needs no prefetch, and without the worker nothing would load
+    if (!entries || block_ptr(0) || prefetch.stop) {
+        return 0;
+    }
+
+    for (int k = 0; k < n && queued < PREFETCH_BATCH; k++) {
+        cache_shard_t *shard = shard_of(blocks[k]);
+        pthread_mutex_lock(&shard->lock);
+        if (lookup(shard, blocks[k]) != -1) {
+            pthread_mutex_unlock(&shard->lock);
+            continue;
+        }
+        uint64_t wait_lsn = 0;
+        int i = evict(shard, &wait_lsn, 1);  // never commits for a prefetch
+        if (i == -1) {
+            pthread_mutex_unlock(&shard->lock);
+            break;
+        }
+
+        // Referenced, so CLOCK passes over it once before the reader gets there
+        int *b = bucket_of(shard, blocks[k]);
+        entries[i].block = blocks[k];
+        entries[i].next = *b;
+        entries[i].dirty = 0;
+        entries[i].lsn = 0;
+        entries[i].referenced = 1;
+        entries[i].loading = 1;
+        entries[i].pins = 1;
+        *b = i;
+        shard->stats.prefetches++;
+        pthread_mutex_unlock(&shard->lock);
+        batch[queued++] = i;
+    }
+
+    if (queued > 0) {
+        pthread_mutex_lock(&prefetch.lock);
+        for (int k = 0; k < queued; k++) {
+            prefetch.items[(prefetch.head + prefetch.count++) % nentries] = batch[k];
+        }
+        pthread_cond_signal(&prefetch.wake);
+        pthread_mutex_unlock(&prefetch.lock);
+    }
+    return queued;
+}
+
+// Write every dirty block back to disk. Entries stay cached and clean.
+// Fails if a logged block is ahead of the journal; commit it first.
+// A shard's dirty blocks are written FLUSH_BATCH at a time with one batch.
+int cache_flush() {
+    disk_io_t io[FLUSH_BATCH];
+    int batch[FLUSH_BATCH];
+    int result = 0;
+
+    for (int s = 0; entries && s < CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+        int n = 0;
+        for (int i = shard->first; i < shard->first + shard_entries; i++) {
+            if (entries[i].block != -1 && entries[i].dirty) {
+                if (!wal_allows(i)) {
+                    log_error(FS_ECORRUPT, "cache_flush: block %d is ahead of the journal", entries[i].block);
+                    result = -1;
+                } else {
+                    io[n] = (disk_io_t){ entries[i].block, 1, page_of(i) };
+                    batch[n++] = i;
+                }
+            }
+            if (n == FLUSH_BATCH || (n > 0 && i == shard->first + shard_entries - 1)) {
+                if (block_write_batch(io, n) < 0) {
+                    log_error(FS_EIO, "cache_flush: failed to write back %d blocks", n);
+                    result = -1;
+                } else {
+                    for (int k = 0; k < n; k++) {
+                        entries[batch[k]].dirty = 0;
+                        entries[batch[k]].lsn = 0;
+                    }
+                    shard->stats.writebacks += n;
+                }
+                n = 0;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return result;
+}
+
+void cache_get_stats(cache_stats_t *out) {
+    if (!out) {
+        return;
+    }
+
+    memset(out, 0, sizeof(cache_stats_t));
+    out->hits = __atomic_load_n(&mapped_hits, __ATOMIC_RELAXED);
+    for (int s = 0; entries && s < CACHE_SHARDS; s++) {
+        pthread_mutex_lock(&shards[s].lock);
+        out->hits += shards[s].stats.hits;
+        out->misses += shards[s].stats.misses;
+        out->evictions += shards[s].stats.evictions;
+        out->writebacks += shards[s].stats.writebacks;
+        out->prefetches += shards[s].stats.prefetches;
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "disk.h"
+
+// Constants
+#define CACHE_DEFAULT_BLOCKS 256   // Default cache size in blocks (1 MB)
+#define CACHE_SHARDS 16            // Independently locked partitions of the cache
+#define CACHE_MIN_BLOCKS (CACHE_SHARDS * 4) // Smallest cache mount_fs accepts, 4 blocks per shard
+#define CACHE_NOREAD 0x1           // cache_get flag: caller overwrites the block, skip the disk read
+#define FLUSH_BATCH 64             // Dirty blocks cache_flush writes back with one batch
+#define PREFETCH_BATCH 64          // Blocks per cache_prefetch call and per background read
+
+// Structures
+typedef struct {
+    uint64_t hits;          // lookups served from memory
+    uint64_t misses;        // lookups that had to read the disk
+    uint64_t evictions;     // blocks dropped to make room
+    uint64_t writebacks;    // dirty blocks written back to disk
+    uint64_t prefetches;    // blocks loaded in the background by cache_prefetch
+} cache_stats_t;
+
+typedef int (*cache_wal_fn)(uint64_t lsn);     // nonzero once journal record lsn is durable
+typedef int (*cache_commit_fn)(uint64_t lsn);  // make journal record lsn durable, 0 or -1
+
+// Function prototypes
+int cache_init(int nblocks);
+int cache_destroy();
+
+char *cache_get(int block, int flags);
+void cache_put(char *data, int dirty);
+void cache_mark_logged(char *data, uint64_t lsn);
+void cache_set_wal(cache_wal_fn durable, cache_commit_fn commit);
+
+int cache_read(int block, char *buf);
+int cache_write(int block, const char *buf);
+int cache_read_direct(int block, int count, char *buf);
+int cache_write_direct(int block, int count, const char *buf);
+int cache_read_batch(const disk_io_t *io, int n);
+int cache_write_batch(const disk_io_t *io, int n);
+int cache_copy_direct(int from, int to, int count);
+int cache_prefetch(const int *blocks, int n);
+int cache_flush();
+int cache_flush_range(int block, int count);
+
+void cache_get_stats(cache_stats_t *stats);
+
+#endif
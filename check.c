@@ -0,0 +1,761 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "check.h"
+#include "disk.h"
+#include "fat.h"
+#include "journal.h"
+#include "stats.h"
+#include "log.h"
+
+// Consistency check of an unmounted volume.
+//
+// fs_check reads the disk image directly, in three passes that are each
+// split across worker threads:
+//
+// 1. FAT: each worker reads a range of FAT1 into memory together with the
+//    same range of FAT2, and counts entries that differ or hold a value no
+//    entry can have.
+// 2. Chains: starting from the root directory, workers take directory
+//    entries from a shared stack, follow each directory's chain and push
+//    the entries it holds; file entries are set aside. Then the file
+//    entries are split among the workers. Following a chain claims every
+//    cluster in `owner` with a compare-and-swap. A cluster already claimed
+//    by the same chain closes a cycle, one claimed by another chain or where
+//    another entry's chain starts is a cross-link; either way the chain
+//    ends before it. An inline file has no chain: its data slots are
+//    checked with the directory that holds them, and slots no file refers
+//    to are stray. Every starting cluster is known before the first file
+//    chain is followed, so when a chain has run into another file's chain
+//    it is the one that gets cut. Clones share clusters (see fat.c), so
+//    running into a claimed cluster is a cross-link only once the chains
+//    reaching it outnumber its reference count; up to that a chain joins
+//    the other's, counts the rest of it for its size and leaves checking
+//    it to the chain that claimed it.
+// 3. Free space: each worker scans a range of clusters for allocated ones
+//    that no chain claimed (leaked), counts the free ones and compares each
+//    cluster's reference count with the chains that reached it.
+//
+// With repair set, fixes are made as problems are found: FAT entries in the
+// in-memory FAT1, directory entries read, patched and written back under
+// fix_lock. At the end the changed FAT blocks are written to both FATs and
+// the superblock gets the recounted free clusters, and the reference counts
+// are set to the chains found. FAT1 is the copy mount_fs reads, so it wins
+// over FAT2.
+
+typedef struct {
+    uint32_t block;             // block holding the entry
+    uint32_t index;             // slot of the entry within the block
+    dir_entry_t entry;
+} check_item_t;
+
+static check_report_t *found = NULL;
+static int repair = 0;
+static int nthreads = 1;
+static int failed = 0;              // a read or write failed, the result is incomplete
+
+static uint32_t *fat = NULL;        // FAT1, fixed in place by the repair
+static uint32_t *owner = NULL;      // id of the chain that claimed each cluster, 0 if none
+static uint64_t *fat_changed = NULL; // one bit per FAT block to write to both FATs
+static uint8_t *refs = NULL;        // reference counts beyond the first, NULL if the volume has none
+static uint16_t *claims = NULL;     // chains found reaching each cluster
+static uint64_t *refs_changed = NULL; // one bit per reference count block to write
+static uint32_t last_chain = 0;     // chain ids handed out so far
+
+static pthread_mutex_t fix_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stack_cond = PTHREAD_COND_INITIALIZER;
+static check_item_t *stack = NULL;  // directory entries waiting to be checked
+static uint32_t stack_len = 0;
+static uint32_t stack_cap = 0;
+static int busy = 0;                // workers checking an entry, which may push more
+static check_item_t *files = NULL;  // file entries, checked after every directory
+static uint32_t files_len = 0;
+static uint32_t files_cap = 0;
+static uint64_t *starts = NULL;     // one bit per cluster where an entry's chain starts
+
+#define COUNT(field, n) __atomic_add_fetch(&found->field, (n), __ATOMIC_RELAXED)
+
+static void fail(const char *what, uint32_t block) {
+    log_error(FS_EIO, "fs_check: failed to %s block %u", what, block);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void set_fat(uint32_t cluster, uint32_t value) {
+    uint32_t block = cluster / FAT_ENTRIES_PER_BLOCK;
+    __atomic_store_n(&fat[cluster], value, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&fat_changed[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+}
+
+static uint32_t refs_of(uint32_t cluster) {
+    return refs ? refs[cluster] : 0;
+}
+
+static void set_refs(uint32_t cluster, uint32_t extra) {
+    uint32_t block = cluster / BLOCK_SIZE;
+    if (refs) {
+        refs[cluster] = (uint8_t)extra;
+        __atomic_fetch_or(&refs_changed[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+    }
+}
+
+// Split `total` items evenly; worker t gets [*first, *end).
+static void range_of(int t, uint32_t total, uint32_t *first, uint32_t *end) {
+    uint32_t share = (uint32_t)(((uint64_t)total + nthreads - 1) / nthreads);
+    uint64_t a = (uint64_t)t * share;
+    uint64_t b = a + share;
+    *first = (uint32_t)(a < total ? a : total);
+    *end = (uint32_t)(b < total ? b : total);
+}
+
+// Run `fn` on nthreads threads, passing each its index.
+static int run_workers(void *(*fn)(void *)) {
+    pthread_t threads[CHECK_MAX_THREADS];
+    int started = 0;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, fn, (void *)(intptr_t)started) != 0) {
+            log_error(FS_ENOMEM, "fs_check: failed to start worker thread");
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return failed ? -1 : 0;
+}
+
+// Read the superblock and check that the layout it describes fits the disk.
+static int read_superblock() {
+    char buf[BLOCK_SIZE];
+    if (block_read(0, buf) < 0) {
+        return log_error(FS_EIO, "fs_check: failed to read superblock");
+    }
+    memcpy(&superblock, buf, sizeof(superblock_t));
+
+    const superblock_t *sb = &superblock;
+    if (sb->magic != MAGIC_NUMBER) {
+        return log_error(FS_ECORRUPT, "fs_check: invalid magic number in superblock");
+    }
+    if (sb->version != FS_VERSION && sb->version != FS_VERSION_NOINLINE && sb->version != FS_VERSION_NOREFS) {
+        return log_error(FS_EVERSION, "fs_check: unsupported file system version %u", sb->version);
+    }
+    if (sb->version == FS_VERSION_NOREFS) {
+        superblock.ref_blocks = 0;
+    }
+    if (sb->block_size != BLOCK_SIZE || sb->cluster_blocks == 0 || sb->cluster_blocks > MAX_CLUSTER_BLOCKS ||
+        sb->total_blocks > (uint32_t)disk_blocks() || sb->fat1_start_block == 0 ||
+        sb->fat2_start_block != sb->fat1_start_block + sb->fat_blocks_count ||
+        sb->root_dir_block != sb->fat2_start_block + sb->fat_blocks_count || sb->root_dir_blocks != 1 ||
+        (sb->journal_blocks && sb->journal_start_block != sb->root_dir_block + sb->root_dir_blocks) ||
+        sb->data_start_block < sb->root_dir_block + sb->root_dir_blocks + sb->journal_blocks ||
+        sb->data_start_block % sb->cluster_blocks != 0 ||
+        sb->data_start_block + (uint64_t)sb->data_clusters_count * sb->cluster_blocks > sb->total_blocks ||
+        (uint64_t)sb->data_clusters_count > (uint64_t)sb->fat_blocks_count * FAT_ENTRIES_PER_BLOCK ||
+        (sb->ref_blocks && ((uint64_t)sb->ref_blocks * BLOCK_SIZE < sb->data_clusters_count ||
+                            sb->ref_start_block < sb->root_dir_block + sb->root_dir_blocks + sb->journal_blocks ||
+                            sb->ref_start_block + (uint64_t)sb->ref_blocks > sb->data_start_block))) {
+        return log_error(FS_ECORRUPT, "fs_check: invalid geometry in superblock");
+    }
+    return 0;
+}
+
+// Pass 1: read worker `arg`'s range of FAT1 and FAT2 and check its entries.
+static void *check_fat_range(void *arg) {
+    uint32_t first, end;
+    range_of((int)(intptr_t)arg, superblock.fat_blocks_count, &first, &end);
+
+    uint32_t *fat2 = (uint32_t *)malloc((size_t)CHECK_IO_BLOCKS * BLOCK_SIZE);
+    if (!fat2) {
+        log_error(FS_ENOMEM, "fs_check: failed to allocate FAT buffer");
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    uint32_t mismatches = 0;
+    uint32_t bad = 0;
+    for (uint32_t b = first; b < end; b += CHECK_IO_BLOCKS) {
+        uint32_t count = (end - b < CHECK_IO_BLOCKS) ? end - b : CHECK_IO_BLOCKS;
+        disk_io_t io[2] = {
+            { (int)(superblock.fat1_start_block + b), (int)count, (char *)(fat + (size_t)b * FAT_ENTRIES_PER_BLOCK) },
+            { (int)(superblock.fat2_start_block + b), (int)count, (char *)fat2 },
+        };
+        if (block_read_batch(io, 2) < 0) {
+            fail("read FAT", b);
+            break;
+        }
+
+        for (uint32_t i = 0; i < count * FAT_ENTRIES_PER_BLOCK; i++) {
+            uint32_t c = b * FAT_ENTRIES_PER_BLOCK + i;
+            uint32_t value = fat[c];
+            if (value != fat2[i]) {
+                mismatches++;
+                __atomic_fetch_or(&fat_changed[(c / FAT_ENTRIES_PER_BLOCK) / 64],
+                                  1ULL << ((c / FAT_ENTRIES_PER_BLOCK) % 64), __ATOMIC_RELAXED);
+            }
+
+            // Entries past the data area stay free
+            int data = c < superblock.data_clusters_count;
+            int valid = data ? (value == FAT_FREE || value == FAT_EOF || value < superblock.data_clusters_count)
+                             : value == FAT_FREE;
+            if (!valid) {
+                bad++;
+                if (repair) {
+                    set_fat(c, data ? FAT_EOF : FAT_FREE);
+                }
+            }
+        }
+    }
+
+    COUNT(fat_mismatches, mismatches);
+    COUNT(bad_entries, bad);
+    free(fat2);
+    return NULL;
+}
+
+static int is_start(uint32_t c) {
+    return (__atomic_load_n(&starts[c / 64], __ATOMIC_RELAXED) >> (c % 64)) & 1;
+}
+
+// Append `item` to a growable array. Called with stack_lock held.
+static int append_item(check_item_t **items, uint32_t *len, uint32_t *cap, const check_item_t *item) {
+    if (*len == *cap) {
+        uint32_t grown_cap = *cap ? *cap * 2 : 256;
+        check_item_t *grown = (check_item_t *)realloc(*items, grown_cap * sizeof(check_item_t));
+        if (!grown) {
+            log_error(FS_ENOMEM, "fs_check: failed to grow the list of entries");
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        *items = grown;
+        *cap = grown_cap;
+    }
+    (*items)[(*len)++] = *item;
+    return 0;
+}
+
+// Queue an entry found in a directory and note where its chain starts.
+static void push_entry(uint32_t block, uint32_t index, const dir_entry_t *entry) {
+    check_item_t item = { block, index, *entry };
+    if (entry->starting_cluster < superblock.data_clusters_count) {
+        __atomic_fetch_or(&starts[entry->starting_cluster / 64], 1ULL << (entry->starting_cluster % 64),
+                          __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&stack_lock);
+    if (entry->attribute & ATTR_DIRECTORY) {
+        if (append_item(&stack, &stack_len, &stack_cap, &item) == 0) {
+            pthread_cond_signal(&stack_cond);
+        }
+    } else {
+        append_item(&files, &files_len, &files_cap, &item);
+    }
+    pthread_mutex_unlock(&stack_lock);
+}
+
+// Write the fixed copy of an entry back to its directory block.
+static void write_entry(const check_item_t *item) {
+    char buf[BLOCK_SIZE];
+    pthread_mutex_lock(&fix_lock);
+    if (block_read(item->block, buf) < 0) {
+        fail("read directory", item->block);
+    } else {
+        memcpy(buf + item->index * sizeof(dir_entry_t), &item->entry, sizeof(dir_entry_t));
+        if (block_write(item->block, buf) < 0) {
+            fail("write directory", item->block);
+        } else {
+            COUNT(repaired, 1);
+        }
+    }
+    pthread_mutex_unlock(&fix_lock);
+}
+
+// Check the inline file in `item` against the directory in `slots` (all of
+// it, `nslots` entries): a data slot for every INLINE_SLOT_BYTES of its size,
+// each marked and used by no other file, which `used` records. A file whose
+// slots run out is cut to the bytes they hold.
+static void check_inline(check_item_t *item, const char *slots, uint32_t nslots, uint8_t *used) {
+    dir_entry_t *entry = &item->entry;
+    uint64_t size = (entry->file_size < INLINE_MAX) ? entry->file_size : INLINE_MAX;
+    uint32_t need = (uint32_t)((size + INLINE_SLOT_BYTES - 1) / INLINE_SLOT_BYTES);
+    uint32_t i = 0;
+    for (; i < need; i++) {
+        uint32_t slot = entry->inline_slots[i];
+        if (slot >= nslots || (uint8_t)slots[(size_t)slot * sizeof(dir_entry_t)] != INLINE_MARK || used[slot]) {
+            break;
+        }
+        used[slot] = 1;
+    }
+    if (i < need || entry->file_size > INLINE_MAX || entry->starting_cluster != FAT_FREE) {
+        COUNT(bad_inline, 1);
+        if (repair) {
+            entry->file_size = (i < need) ? (uint64_t)i * INLINE_SLOT_BYTES : size;
+            entry->starting_cluster = FAT_FREE;
+            write_entry(item);
+        }
+    }
+}
+
+// Push the entries in use of the directory made of `nblocks` blocks and
+// check its inline files. Data slots no inline file refers to are cleared
+// by the repair.
+static void push_dir(const uint32_t *blocks, uint32_t nblocks) {
+    uint32_t per_block = BLOCK_SIZE / sizeof(dir_entry_t);
+    uint32_t nslots = nblocks * per_block;
+    char *buf = (char *)malloc((size_t)nblocks * BLOCK_SIZE);
+    uint8_t *used = (uint8_t *)calloc(nslots, 1);
+    if (!buf || !used) {
+        log_error(FS_ENOMEM, "fs_check: failed to allocate directory buffer");
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        free(buf);
+        free(used);
+        return;
+    }
+    for (uint32_t b = 0; b < nblocks; b++) {
+        if (block_read(blocks[b], buf + (size_t)b * BLOCK_SIZE) < 0) {
+            fail("read directory", blocks[b]);
+            free(buf);
+            free(used);
+            return;
+        }
+    }
+
+    for (uint32_t slot = 0; slot < nslots; slot++) {
+        dir_entry_t entry;
+        memcpy(&entry, buf + (size_t)slot * sizeof(dir_entry_t), sizeof(dir_entry_t));
+        check_item_t item = { blocks[slot / per_block], slot % per_block, entry };
+        if (item.entry.filename[0] == '\0' || (uint8_t)item.entry.filename[0] == INLINE_MARK) {
+            continue;
+        }
+        if (!(item.entry.attribute & ATTR_DIRECTORY) && (item.entry.attribute & ATTR_INLINE)) {
+            check_inline(&item, buf, nslots, used);
+        }
+        push_entry(item.block, item.index, &item.entry);
+    }
+    for (uint32_t slot = 0; slot < nslots; slot++) {
+        if ((uint8_t)buf[(size_t)slot * sizeof(dir_entry_t)] == INLINE_MARK && !used[slot]) {
+            COUNT(bad_inline, 1);
+            if (repair) {
+                dir_entry_t empty;
+                memset(&empty, 0, sizeof(dir_entry_t));
+                check_item_t item = { blocks[slot / per_block], slot % per_block, empty };
+                write_entry(&item);
+            }
+        }
+    }
+    free(buf);
+    free(used);
+}
+
+// Pass 2, for one directory entry: claim its chain, compare the chain with
+// the entry's size and queue a directory's own entries.
+static void check_entry(check_item_t *item) {
+    dir_entry_t *entry = &item->entry;
+    int is_dir = (entry->attribute & ATTR_DIRECTORY) != 0;
+    uint32_t start = entry->starting_cluster;
+    int no_chain = !is_dir && start == FAT_FREE && (entry->file_size == 0 || (entry->attribute & ATTR_INLINE));
+
+    if (!memchr(entry->filename, '\0', MAX_FILENAME_LENGTH) ||
+        (!no_chain && (start >= superblock.data_clusters_count || fat[start] == FAT_FREE))) {
+        COUNT(bad_dir_entries, 1);
+        if (repair) {
+            memset(entry, 0, sizeof(dir_entry_t));
+            write_entry(item);
+        }
+        return;
+    }
+    if (is_dir) {
+        COUNT(directories, 1);
+    } else {
+        COUNT(files, 1);
+    }
+    if (no_chain) {
+        return;
+    }
+
+    // Clusters the size calls for; a file keeps its first cluster at size 0
+    uint64_t keep = (entry->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    keep = keep ? keep : 1;
+
+    uint32_t id = __atomic_add_fetch(&last_chain, 1, __ATOMIC_RELAXED);
+    uint32_t *clusters = NULL;      // a directory's chain, to read its entries
+    uint32_t n = 0;
+    uint32_t prev = FAT_EOF;
+    uint32_t last_kept = FAT_EOF;
+    uint32_t c = start;
+    int joined = 0;                 // the chain runs on in a chain claimed before
+    int kept_joined = 0;            // last_kept lies in that shared part
+    while (c != FAT_EOF) {
+        if (c >= superblock.data_clusters_count || __atomic_load_n(&fat[c], __ATOMIC_RELAXED) == FAT_FREE) {
+            if (!joined) {
+                COUNT(bad_chains, 1);
+            }
+            break;
+        }
+        if (joined) {
+            // Only counted for the size; a loop or a start here is the
+            // claiming chain's problem
+            if (n > superblock.data_clusters_count || (c != start && is_start(c))) {
+                break;
+            }
+            if (++n == keep) {
+                last_kept = c;
+                kept_joined = 1;
+            }
+            c = __atomic_load_n(&fat[c], __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint32_t other = 0;
+        if ((c != start && is_start(c)) ||
+            !__atomic_compare_exchange_n(&owner[c], &other, id, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            if (other == id) {
+                COUNT(cycles, 1);
+            } else if (other != 0 && __atomic_add_fetch(&claims[c], 1, __ATOMIC_RELAXED) <= 1 + refs_of(c)) {
+                // A clone sharing the rest of another chain
+                joined = 1;
+                continue;
+            } else {
+                if (other != 0) {
+                    __atomic_sub_fetch(&claims[c], 1, __ATOMIC_RELAXED);
+                }
+                COUNT(cross_linked, 1);
+            }
+            break;
+        }
+        __atomic_add_fetch(&claims[c], 1, __ATOMIC_RELAXED);
+        if (is_dir && (n & (n - 1)) == 0) {
+            uint32_t *grown = (uint32_t *)realloc(clusters, (n ? 2 * n : 1) * sizeof(uint32_t));
+            if (!grown) {
+                log_error(FS_ENOMEM, "fs_check: failed to allocate directory chain");
+                __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+                free(clusters);
+                return;
+            }
+            clusters = grown;
+        }
+        if (is_dir) {
+            clusters[n] = c;
+        }
+        if (++n == keep) {
+            last_kept = c;
+        }
+        prev = c;
+        c = fat[c];
+    }
+
+    // The chain was cut short: end it at its last good cluster, or drop an
+    // entry left without any cluster
+    if (c != FAT_EOF && !joined && repair) {
+        if (n == 0) {
+            memset(entry, 0, sizeof(dir_entry_t));
+            write_entry(item);
+            return;
+        }
+        set_fat(prev, FAT_EOF);
+    }
+
+    uint64_t chain_bytes = (uint64_t)n * CLUSTER_SIZE;
+    int fix = 0;
+    if (is_dir ? entry->file_size != chain_bytes : n < keep) {
+        // A directory spans its whole chain; a file cannot be longer than it
+        COUNT(size_mismatches, 1);
+        entry->file_size = chain_bytes;
+        fix = repair && n > 0;
+    } else if (!is_dir && n > keep) {
+        // Clusters past the end of the file, e.g. from a crash before its
+        // entry was written: return them to the free pool, up to where a
+        // clone shares them
+        COUNT(size_mismatches, 1);
+        if (repair && !kept_joined) {
+            uint32_t x = fat[last_kept];
+            set_fat(last_kept, FAT_EOF);
+            while (x != FAT_EOF && x < superblock.data_clusters_count && owner[x] == id && refs_of(x) == 0) {
+                uint32_t next = fat[x];
+                set_fat(x, FAT_FREE);
+                owner[x] = 0;
+                __atomic_store_n(&claims[x], 0, __ATOMIC_RELAXED);
+                x = next;
+            }
+            if (x < superblock.data_clusters_count) {
+                __atomic_sub_fetch(&claims[x], 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (fix) {
+        write_entry(item);
+    }
+
+    // Then the entries of a directory, read from its whole chain
+    uint32_t nblocks = is_dir ? n * superblock.cluster_blocks : 0;
+    uint32_t *blocks = nblocks ? (uint32_t *)malloc((size_t)nblocks * sizeof(uint32_t)) : NULL;
+    if (nblocks && !blocks) {
+        log_error(FS_ENOMEM, "fs_check: failed to allocate directory blocks");
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+    } else if (nblocks) {
+        for (uint32_t b = 0; b < nblocks; b++) {
+            blocks[b] = CLUSTER_BLOCK(clusters[b / superblock.cluster_blocks]) + b % superblock.cluster_blocks;
+        }
+        push_dir(blocks, nblocks);
+    }
+    free(blocks);
+    free(clusters);
+}
+
+// Pass 2 worker for directories: check directory entries until the stack is
+// empty and no other worker can push more.
+static void *check_tree(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&stack_lock);
+    for (;;) {
+        while (stack_len == 0 && busy > 0) {
+            pthread_cond_wait(&stack_cond, &stack_lock);
+        }
+        if (stack_len == 0) {
+            break;
+        }
+        check_item_t item = stack[--stack_len];
+        busy++;
+        pthread_mutex_unlock(&stack_lock);
+
+        check_entry(&item);
+
+        pthread_mutex_lock(&stack_lock);
+        busy--;
+        if (busy == 0 && stack_len == 0) {
+            pthread_cond_broadcast(&stack_cond);
+        }
+    }
+    pthread_mutex_unlock(&stack_lock);
+    return NULL;
+}
+
+// Pass 2 worker for files: check worker `arg`'s share of the file entries.
+static void *check_files(void *arg) {
+    uint32_t first, end;
+    range_of((int)(intptr_t)arg, files_len, &first, &end);
+    for (uint32_t i = first; i < end; i++) {
+        check_entry(&files[i]);
+    }
+    return NULL;
+}
+
+// Pass 3: count worker `arg`'s range of clusters as used, free or leaked.
+static void *check_free_range(void *arg) {
+    uint32_t first, end;
+    range_of((int)(intptr_t)arg, superblock.data_clusters_count, &first, &end);
+
+    uint32_t used = 0;
+    uint32_t free_count = 0;
+    uint32_t leaked = 0;
+    uint32_t bad_refs = 0;
+    for (uint32_t c = first; c < end; c++) {
+        // Every chain reaching a cluster holds one of its references
+        uint32_t found_refs = owner[c] ? claims[c] - 1 : 0;
+        found_refs = (found_refs < 255) ? found_refs : 255;
+        if (owner[c]) {
+            used++;
+        } else if (fat[c] == FAT_FREE) {
+            free_count++;
+        } else {
+            leaked++;
+            if (repair) {
+                set_fat(c, FAT_FREE);
+                free_count++;
+            }
+        }
+        if (refs_of(c) != found_refs) {
+            bad_refs += owner[c] || fat[c] == FAT_FREE;
+            if (repair) {
+                set_refs(c, found_refs);
+            }
+        }
+    }
+
+    COUNT(used_clusters, used);
+    COUNT(free_clusters, free_count);
+    COUNT(leaked, leaked);
+    COUNT(bad_refs, bad_refs);
+    return NULL;
+}
+
+// Write the blocks of `data` whose bit is set in `changed` to the region
+// at `first_block` and, unless it is 0, its copy at `copy_block`, a run of
+// consecutive blocks per request.
+static int write_changed(const uint64_t *changed, uint32_t nblocks, char *data, uint32_t first_block,
+                         uint32_t copy_block) {
+    for (uint32_t b = 0; b < nblocks;) {
+        if (!((changed[b / 64] >> (b % 64)) & 1)) {
+            b++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (b + run < nblocks && run < CHECK_IO_BLOCKS && ((changed[(b + run) / 64] >> ((b + run) % 64)) & 1)) {
+            run++;
+        }
+        disk_io_t io[2] = {
+            { (int)(first_block + b), (int)run, data + (size_t)b * BLOCK_SIZE },
+            { (int)(copy_block + b), (int)run, data + (size_t)b * BLOCK_SIZE },
+        };
+        if (block_write_batch(io, copy_block ? 2 : 1) < 0) {
+            return log_error(FS_EIO, "fs_check: failed to write blocks %u-%u", first_block + b,
+                             first_block + b + run - 1);
+        }
+        found->repaired += run;
+        b += run;
+    }
+    return 0;
+}
+
+// Write the changed FAT blocks to FAT1 and FAT2 and the changed reference
+// count blocks, then the superblock with the recounted free clusters.
+static int write_fixes(int superblock_stale) {
+    if (write_changed(fat_changed, superblock.fat_blocks_count, (char *)fat, superblock.fat1_start_block,
+                      superblock.fat2_start_block) < 0 ||
+        (refs && write_changed(refs_changed, superblock.ref_blocks, (char *)refs, superblock.ref_start_block, 0) < 0)) {
+        return -1;
+    }
+
+    // The FAT and the free count now agree, so the volume is as good as
+    // cleanly unmounted
+    if (superblock_stale || superblock.clean != FS_CLEAN) {
+        char buf[BLOCK_SIZE];
+        superblock.free_clusters_count = found->free_clusters;
+        superblock.clean = FS_CLEAN;
+        memset(buf, 0, BLOCK_SIZE);
+        memcpy(buf, &superblock, sizeof(superblock_t));
+        if (block_write(0, buf) < 0) {
+            return log_error(FS_EIO, "fs_check: failed to write superblock");
+        }
+        found->repaired++;
+    }
+    return sync_disk();
+}
+
+// Read the reference counts, one byte per cluster, in a few large requests.
+static int read_refs() {
+    for (uint32_t b = 0; b < superblock.ref_blocks; b += CHECK_IO_BLOCKS) {
+        uint32_t count = (superblock.ref_blocks - b < CHECK_IO_BLOCKS) ? superblock.ref_blocks - b : CHECK_IO_BLOCKS;
+        disk_io_t io = { (int)(superblock.ref_start_block + b), (int)count, (char *)refs + (size_t)b * BLOCK_SIZE };
+        if (block_read_batch(&io, 1) < 0) {
+            return log_error(FS_EIO, "fs_check: failed to read reference count blocks");
+        }
+    }
+    return 0;
+}
+
+static void release() {
+    free(fat);
+    free(owner);
+    free(fat_changed);
+    free(refs);
+    free(claims);
+    free(refs_changed);
+    refs = NULL;
+    claims = NULL;
+    refs_changed = NULL;
+    free(starts);
+    free(stack);
+    free(files);
+    fat = owner = NULL;
+    fat_changed = starts = NULL;
+    stack = files = NULL;
+    stack_len = stack_cap = files_len = files_cap = 0;
+}
+
+// Check the volume in `disk_name`, which must not be mounted, and with
+// opts->repair fix what is found. A journal with commits still to replay is
+// replayed first when repairing; otherwise the check sees the volume as it
+// is on disk and reports journal_pending. Returns the number of problems
+// found (0 for a consistent volume), or -1 if the volume could not be
+// checked.
+int fs_check(char *disk_name, const check_opts_t *opts, check_report_t *report) {
+    uint64_t start = stats_now();
+    memset(report, 0, sizeof(check_report_t));
+    found = report;
+    failed = 0;
+    last_chain = 0;
+    busy = 0;
+    repair = opts && opts->repair;
+    nthreads = (opts && opts->threads > 0) ? opts->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (nthreads < 1) ? 1 : (nthreads > CHECK_MAX_THREADS) ? CHECK_MAX_THREADS : nthreads;
+
+    if (open_disk(disk_name) < 0) {
+        return -1;
+    }
+    if (read_superblock() < 0) {
+        close_disk();
+        return -1;
+    }
+    report->journal_pending = journal_pending();
+    if (report->journal_pending && repair) {
+        // Let mount_fs replay the journal into place, then check the result
+        log_info("fs_check: replaying the journal");
+        close_disk();
+        if (mount_fs(disk_name) < 0 || umount_fs() < 0) {
+            return log_error(FS_EIO, "fs_check: failed to replay the journal");
+        }
+        if (open_disk(disk_name) < 0) {
+            return -1;
+        }
+        if (read_superblock() < 0) {
+            close_disk();
+            return -1;
+        }
+    }
+    report->free_recorded = superblock.free_clusters_count;
+
+    fat = (uint32_t *)malloc((size_t)superblock.fat_blocks_count * BLOCK_SIZE);
+    owner = (uint32_t *)calloc((size_t)superblock.data_clusters_count + 1, sizeof(uint32_t));
+    fat_changed = (uint64_t *)calloc((superblock.fat_blocks_count + 63) / 64, sizeof(uint64_t));
+    starts = (uint64_t *)calloc(superblock.data_clusters_count / 64 + 1, sizeof(uint64_t));
+    claims = (uint16_t *)calloc((size_t)superblock.data_clusters_count + 1, sizeof(uint16_t));
+    if (superblock.ref_blocks) {
+        refs = (uint8_t *)malloc((size_t)superblock.ref_blocks * BLOCK_SIZE);
+        refs_changed = (uint64_t *)calloc((superblock.ref_blocks + 63) / 64, sizeof(uint64_t));
+    }
+    if (!fat || !owner || !fat_changed || !starts || !claims ||
+        (superblock.ref_blocks && (!refs || !refs_changed))) {
+        log_error(FS_ENOMEM, "fs_check: failed to allocate memory for the FAT");
+        release();
+        close_disk();
+        return -1;
+    }
+
+    // Pass 1, then pass 2 from the root directory's entries, then pass 3
+    int result = refs ? read_refs() : 0;
+    if (result == 0) {
+        result = run_workers(check_fat_range);
+    }
+    if (result == 0) {
+        uint32_t root = superblock.root_dir_block;
+        push_dir(&root, 1);
+        result = run_workers(check_tree);
+    }
+    if (result == 0) {
+        result = run_workers(check_files);
+    }
+    if (result == 0) {
+        result = run_workers(check_free_range);
+    }
+
+    int problems = 0;
+    if (result == 0) {
+        int stale = report->free_clusters != report->free_recorded;
+        problems = (int)(report->fat_mismatches + report->bad_entries + report->bad_dir_entries +
+                         report->cross_linked + report->cycles + report->bad_chains +
+                         report->size_mismatches + report->leaked + report->bad_refs + report->bad_inline);
+        // Only a cleanly unmounted volume promises an exact free count
+        problems += (stale && superblock.clean == FS_CLEAN) ? 1 : 0;
+        if (repair && (problems > 0 || stale)) {
+            result = write_fixes(stale);
+        }
+    }
+
+    release();
+    close_disk();
+    report->seconds = (double)(stats_now() - start) / 1e9;
+    return (result < 0) ? -1 : problems;
+}
@@ -0,0 +1,44 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdint.h>
+#include "filesystem.h"
+
+// Constants
+#define CHECK_MAX_THREADS 16        // Worker threads fs_check uses at most
+#define CHECK_IO_BLOCKS 256         // FAT blocks a worker reads per request (1 MB)
+
+// Structures
+typedef struct {
+    int threads;                // Worker threads (0 selects one per CPU, up to CHECK_MAX_THREADS)
+    int repair;                 // Write the fixes instead of only reporting the problems
+} check_opts_t;
+
+typedef struct {
+    uint32_t files;             // File entries reached from the root directory
+    uint32_t directories;       // Directory entries reached from the root directory
+    uint32_t used_clusters;     // Clusters owned by a file or directory
+
+    // Problems found
+    uint32_t fat_mismatches;    // FAT1 entries that differ from FAT2
+    uint32_t bad_entries;       // FAT entries that are neither free, FAT_EOF nor a data cluster
+    uint32_t bad_dir_entries;   // Entries with an unusable name or starting cluster
+    uint32_t cross_linked;      // Chains running into a cluster another chain owns
+    uint32_t cycles;            // Chains looping back on themselves
+    uint32_t bad_chains;        // Chains running into a free or out-of-range cluster
+    uint32_t size_mismatches;   // Entries whose size does not match their chain
+    uint32_t leaked;            // Allocated clusters no chain reaches
+    uint32_t bad_refs;          // Clusters whose reference count differs from the chains reaching them
+    uint32_t bad_inline;        // Inline files with missing or shared data slots, and data slots no file uses
+    uint32_t free_clusters;     // Free clusters counted in FAT1 (after repairs)
+    uint32_t free_recorded;     // free_clusters_count in the superblock
+    int journal_pending;        // The journal holds commits mount_fs would replay
+
+    uint32_t repaired;          // FAT blocks, entries and superblocks written by the repair
+    double seconds;
+} check_report_t;
+
+// Function prototypes
+int fs_check(char *disk_name, const check_opts_t *opts, check_report_t *report);
+
+#endif
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include "disk.h"
 #include "filesystem.h"
+#include "fat.h"
 
 int make_fs(char *disk_name);
 int mount_fs(char *disk_name);
@@ -16,7 +17,7 @@ int fs_write(int fd, const void *buf, size_t count);
 int fs_read(int fd, void *buf, size_t count);
 int fs_close(int fd);
 int fs_delete(const char *filename);
-int fs_get_filesize(int fd);
+int64_t fs_get_filesize(int fd);
 int fs_lseek(int fd, size_t offset);
 int fs_trunc(int fd, size_t size);
 
@@ -25,34 +26,30 @@ void print_directory() {
 
     for (int i = 0; i < MAX_FILES; i++) {
         dir_entry_t *entry = &root_directory.entries[i];
-        if (entry->filename[0] != '\0') {
-            printf("  File: '%s', Size: %u bytes, Starting Cluster: %u\n",
-                   entry->filename, entry->file_size, entry->starting_cluster);
+        // Data slots of inline files start with INLINE_MARK and are not files
+        if (entry->filename[0] != '\0' && (uint8_t)entry->filename[0] != INLINE_MARK) {
+            printf("  File: '%s', Size: %llu bytes, Starting Cluster: %u\n",
+                   entry->filename, (unsigned long long)entry->file_size, entry->starting_cluster);
         }
     }
 }
 
 void print_fat() {
     printf("FAT Summary:\n");
-    if (fat == NULL) {
-        printf("  FAT is not loaded in memory.\n");
-        return;
-    }
-
     int free_blocks = 0;
     int used_blocks = 0;
 
-    for (uint32_t i = 0; i < superblock.data_blocks_count; i++) {
-        if (fat[i] == FAT_FREE) {
+    for (uint32_t i = 0; i < superblock.data_clusters_count; i++) {
+        if (fat_get(i) == FAT_FREE) {
             free_blocks++;
         } else {
             used_blocks++;
         }
     }
 
-    printf("  Total Blocks: %d\n", superblock.data_blocks_count);
-    printf("  Free Blocks: %d\n", free_blocks);
-    printf("  Used Blocks: %d\n", used_blocks);
+    printf("  Total Clusters: %u\n", superblock.data_clusters_count);
+    printf("  Free Clusters: %d\n", free_blocks);
+    printf("  Used Clusters: %d\n", used_blocks);
 }
 
 void *read_file_thread(void *arg) {
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "directory.h"
+#include "cache.h"
+#include "alloc.h"
+#include "journal.h"
+#include "fat.h"
+#include "log.h"
+
+// Directory tree.
+//
+// The root directory keeps its fixed block and lives in memory as
+// root_directory. Every other directory is a file in the data area with
+// ATTR_DIRECTORY set, holding an array of dir_entry_t (DIR_ENTRIES_PER_BLOCK
+// per block of each cluster) that is read and written through the block
+// cache. A directory grows one cluster at a time when its free slots run out.
+//
+// The first time a path walks through a directory it is loaded into a dir_t:
+// its FAT chain is flattened into an array and every name goes into a hash
+// index, so later lookups cost O(1) however many entries the directory has.
+// Loaded directories stay in memory until they are removed or the file
+// system is unmounted. A direct-mapped dentry cache maps recently resolved
+// directory paths to their dir_t, so most resolutions skip the walk.
+//
+// Callers hold dir_lock from filesystem.c: shared to look up, read or update
+// entries, exclusive to add or remove them. Directories are loaded under the
+// shared lock, so the table of loaded directories and the dentry cache are
+// protected by table_lock.
+//
+// Free slots of subdirectories also hold the data of inline files (see
+// filesystem.c): a data slot starts with INLINE_MARK, which no name does,
+// and is neither indexed nor free. Inline files store their data when they
+// are closed or synced, under the shared lock, so claiming and releasing
+// data slots takes slot_lock.
+
+#define DIR_TABLE_BUCKETS 256
+
+typedef struct {
+    char path[MAX_PATH_LENGTH]; // directory path without leading '/', empty if unused
+    dir_t *dir;
+} dcache_entry_t;
+
+static dir_t root_dir;
+static dir_t *table[DIR_TABLE_BUCKETS];
+static dcache_entry_t dcache[DCACHE_SIZE];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_path(const char *path, size_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static dir_t **bucket_of(uint32_t id) {
+    return &table[(id * 2654435761u) >> 24];
+}
+
+static int append_cluster(dir_t *dir, uint32_t cluster) {
+    if ((dir->nclusters & (dir->nclusters - 1)) == 0) {
+        uint32_t capacity = dir->nclusters ? dir->nclusters * 2 : 1;
+        uint32_t *clusters = (uint32_t *)realloc(dir->clusters, capacity * sizeof(uint32_t));
+        if (!clusters) {
+            log_error(FS_ENOMEM, "dir: failed to grow cluster list");
+            return -1;
+        }
+        dir->clusters = clusters;
+    }
+    dir->clusters[dir->nclusters++] = cluster;
+    return 0;
+}
+
+// Disk block of the directory's `b`th block, counting across its clusters.
+static int dir_block(const dir_t *dir, uint32_t b) {
+    return CLUSTER_BLOCK(dir->clusters[b / superblock.cluster_blocks]) + b % superblock.cluster_blocks;
+}
+
+// Block and byte offset of an entry slot in a subdirectory.
+static int slot_block(const dir_t *dir, uint32_t slot) {
+    return dir_block(dir, slot / DIR_ENTRIES_PER_BLOCK);
+}
+
+static size_t slot_offset(uint32_t slot) {
+    return (slot % DIR_ENTRIES_PER_BLOCK) * sizeof(dir_entry_t);
+}
+
+static void free_dir(dir_t *dir) {
+    name_index_destroy(&dir->index);
+    free(dir->clusters);
+    free(dir);
+}
+
+// Index one slot of a directory being loaded: its name, or the slot as free
+// if it is empty. A data slot is neither.
+static int index_slot(dir_t *dir, const dir_entry_t *entry, uint32_t slot) {
+    if (entry->filename[0] == '\0') {
+        return name_index_push_free(&dir->index, slot);
+    }
+    if ((uint8_t)entry->filename[0] == INLINE_MARK) {
+        return 0;
+    }
+    return name_index_insert(&dir->index, entry->filename, slot);
+}
+
+// Build the dir_t of the subdirectory whose entry is parent's `slot`.
+static dir_t *load_dir(dir_t *parent, uint32_t slot, const dir_entry_t *entry) {
+    dir_t *dir = (dir_t *)calloc(1, sizeof(dir_t));
+    if (!dir) {
+        log_error(FS_ENOMEM, "dir: failed to allocate directory");
+        return NULL;
+    }
+    dir->id = entry->starting_cluster;
+    dir->parent = parent;
+    dir->parent_slot = slot;
+
+    // Flatten the FAT chain
+    for (uint32_t c = entry->starting_cluster; c != FAT_EOF; c = fat_get(c)) {
+        if (c == FAT_ERROR) {
+            free_dir(dir);
+            return NULL;
+        }
+        if (c >= superblock.data_clusters_count || dir->nclusters == superblock.data_clusters_count) {
+            log_error(FS_ECORRUPT, "dir: corrupted FAT chain in directory '%s'", entry->filename);
+            free_dir(dir);
+            return NULL;
+        }
+        if (append_cluster(dir, c) < 0) {
+            free_dir(dir);
+            return NULL;
+        }
+    }
+    uint32_t nblocks = dir->nclusters * superblock.cluster_blocks;
+    dir->nslots = nblocks * DIR_ENTRIES_PER_BLOCK;
+
+    // Index the names; free slots are pushed highest first so the lowest is reused first
+    if (name_index_init(&dir->index, dir->nslots) < 0) {
+        free_dir(dir);
+        return NULL;
+    }
+    for (int b = (int)nblocks - 1; b >= 0; b--) {
+        char *page = cache_get(dir_block(dir, b), 0);
+        if (!page) {
+            free_dir(dir);
+            return NULL;
+        }
+
+        int result = 0;
+        for (int e = DIR_ENTRIES_PER_BLOCK - 1; e >= 0 && result == 0; e--) {
+            const dir_entry_t *child = (const dir_entry_t *)(page + e * sizeof(dir_entry_t));
+            result = index_slot(dir, child, b * DIR_ENTRIES_PER_BLOCK + e);
+        }
+        cache_put(page, 0);
+        if (result < 0) {
+            free_dir(dir);
+            return NULL;
+        }
+    }
+    return dir;
+}
+
+int dir_init() {
+    memset(&root_dir, 0, sizeof(dir_t));
+    memset(table, 0, sizeof(table));
+    memset(dcache, 0, sizeof(dcache));
+
+    root_dir.id = DIR_ROOT;
+    root_dir.nslots = MAX_FILES;
+    if (name_index_init(&root_dir.index, MAX_FILES) < 0) {
+        return -1;
+    }
+    for (int i = MAX_FILES - 1; i >= 0; i--) {
+        if (index_slot(&root_dir, &root_directory.entries[i], i) < 0) {
+            name_index_destroy(&root_dir.index);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void dir_destroy() {
+    for (int i = 0; i < DIR_TABLE_BUCKETS; i++) {
+        while (table[i]) {
+            dir_t *next = table[i]->hash_next;
+            free_dir(table[i]);
+            table[i] = next;
+        }
+    }
+    name_index_destroy(&root_dir.index);
+    memset(dcache, 0, sizeof(dcache));
+}
+
+// Return the loaded directory whose entry is dir's `slot`, loading it on
+// first use. Fails if the entry is not a directory.
+dir_t *dir_open_child(dir_t *dir, uint32_t slot) {
+    dir_entry_t entry;
+    if (dir_read_entry(dir, slot, &entry) < 0) {
+        return NULL;
+    }
+    if (!(entry.attribute & ATTR_DIRECTORY)) {
+        log_error(FS_ENOTDIR, "dir: '%s' is not a directory", entry.filename);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&table_lock);
+    dir_t **bucket = bucket_of(entry.starting_cluster);
+    dir_t *child = *bucket;
+    while (child && child->id != entry.starting_cluster) {
+        child = child->hash_next;
+    }
+    if (!child) {
+        child = load_dir(dir, slot, &entry);
+        if (child) {
+            child->hash_next = *bucket;
+            *bucket = child;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    return child;
+}
+
+static dir_t *dcache_lookup(const char *path, size_t len) {
+    dcache_entry_t *e = &dcache[hash_path(path, len) % DCACHE_SIZE];
+    pthread_mutex_lock(&table_lock);
+    dir_t *dir = (strncmp(e->path, path, len) == 0 && e->path[len] == '\0') ? e->dir : NULL;
+    pthread_mutex_unlock(&table_lock);
+    return dir;
+}
+
+static void dcache_insert(const char *path, size_t len, dir_t *dir) {
+    dcache_entry_t *e = &dcache[hash_path(path, len) % DCACHE_SIZE];
+    pthread_mutex_lock(&table_lock);
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    e->dir = dir;
+    pthread_mutex_unlock(&table_lock);
+}
+
+// Resolve `path` ("a/b/name" or "/a/b/name") to the directory that holds its
+// last component, which is copied to `name`. Every intermediate component
+// must be an existing directory. The last component need not exist.
+dir_t *dir_resolve(const char *path, char *name) {
+    if (!path) {
+        log_error(FS_EINVAL, "dir_resolve: invalid path");
+        return NULL;
+    }
+    while (*path == '/') {
+        path++;
+    }
+
+    size_t len = strlen(path);
+    const char *last = strrchr(path, '/');
+    const char *base = last ? last + 1 : path;
+    size_t parent_len = last ? (size_t)(last - path) : 0;
+
+    if (len >= MAX_PATH_LENGTH || *base == '\0' || (uint8_t)*base == INLINE_MARK ||
+        strlen(base) >= MAX_FILENAME_LENGTH) {
+        log_error(FS_EINVAL, "dir_resolve: invalid path '%s'", path);
+        return NULL;
+    }
+    strcpy(name, base);
+
+    if (parent_len == 0) {
+        return &root_dir;
+    }
+
+    dir_t *dir = dcache_lookup(path, parent_len);
+    if (dir) {
+        return dir;
+    }
+
+    // Walk the components from the root
+    dir = &root_dir;
+    for (const char *p = path; p < path + parent_len;) {
+        const char *end = memchr(p, '/', path + parent_len - p);
+        if (!end) {
+            end = path + parent_len;
+        }
+
+        char component[MAX_FILENAME_LENGTH];
+        size_t n = (size_t)(end - p);
+        if (n == 0 || n >= MAX_FILENAME_LENGTH) {
+            log_error(FS_EINVAL, "dir_resolve: invalid path '%s'", path);
+            return NULL;
+        }
+        memcpy(component, p, n);
+        component[n] = '\0';
+
+        int slot = name_index_find(&dir->index, component);
+        if (slot == -1) {
+            log_error(FS_ENOENT, "dir_resolve: directory '%s' not found", component);
+            return NULL;
+        }
+        dir = dir_open_child(dir, slot);
+        if (!dir) {
+            return NULL;
+        }
+        p = end + 1;
+    }
+
+    dcache_insert(path, parent_len, dir);
+    return dir;
+}
+
+int dir_lookup(dir_t *dir, const char *name) {
+    return name_index_find(&dir->index, name);
+}
+
+int dir_read_entry(dir_t *dir, uint32_t slot, dir_entry_t *entry) {
+    if (dir == &root_dir) {
+        memcpy(entry, &root_directory.entries[slot], sizeof(dir_entry_t));
+        return 0;
+    }
+
+    char *page = cache_get(slot_block(dir, slot), 0);
+    if (!page) {
+        log_error(FS_EIO, "dir_read_entry: failed to read directory block");
+        return -1;
+    }
+    memcpy(entry, page + slot_offset(slot), sizeof(dir_entry_t));
+    cache_put(page, 0);
+    return 0;
+}
+
+// Store an entry and log the change in the journal.
+int dir_write_entry(dir_t *dir, uint32_t slot, const dir_entry_t *entry) {
+    if (dir == &root_dir) {
+        return journal_entry(superblock.root_dir_block, slot * sizeof(dir_entry_t), entry, NULL);
+    }
+
+    int block = slot_block(dir, slot);
+    char *page = cache_get(block, 0);
+    if (!page) {
+        log_error(FS_EIO, "dir_write_entry: failed to read directory block");
+        return -1;
+    }
+    int result = journal_entry(block, slot_offset(slot), entry, page);
+    cache_put(page, 0);
+    return result;
+}
+
+// Append a zeroed cluster to a subdirectory and make its slots available.
+static int grow_dir(dir_t *dir) {
+    uint32_t cluster = alloc_block();
+    if (cluster == ALLOC_NONE) {
+        log_error(FS_ENOSPC, "dir: no free clusters to grow directory");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < superblock.cluster_blocks; i++) {
+        int block = CLUSTER_BLOCK(cluster) + i;
+        char *page = cache_get(block, CACHE_NOREAD);
+        int result = page ? journal_zero(block, page) : -1;
+        if (page) {
+            cache_put(page, 0);
+        }
+        if (result < 0) {
+            alloc_free(cluster);
+            return -1;
+        }
+    }
+    if (append_cluster(dir, cluster) < 0) {
+        alloc_free(cluster);
+        return -1;
+    }
+    if (journal_fat(dir->clusters[dir->nclusters - 2], cluster) < 0) {
+        dir->nclusters--;
+        alloc_free(cluster);
+        return -1;
+    }
+
+    uint32_t first = dir->nslots;
+    dir->nslots += superblock.cluster_blocks * DIR_ENTRIES_PER_BLOCK;
+    for (uint32_t slot = dir->nslots; slot > first; slot--) {
+        if (name_index_push_free(&dir->index, slot - 1) < 0) {
+            return -1;
+        }
+    }
+
+    // Record the new size in the directory's own entry
+    dir_entry_t entry;
+    if (dir_read_entry(dir->parent, dir->parent_slot, &entry) < 0) {
+        return -1;
+    }
+    entry.file_size = dir->nclusters * CLUSTER_SIZE;
+    return dir_write_entry(dir->parent, dir->parent_slot, &entry);
+}
+
+// Store `entry` in a free slot of `dir`, growing the directory if it is
+// full, and index its name. Returns the slot or -1.
+int dir_add_entry(dir_t *dir, const dir_entry_t *entry) {
+    int slot = name_index_pop_free(&dir->index);
+    if (slot == -1 && dir != &root_dir) {
+        if (grow_dir(dir) < 0) {
+            return -1;
+        }
+        slot = name_index_pop_free(&dir->index);
+    }
+    if (slot == -1) {
+        log_error(FS_ENOSPC, "dir_add_entry: No free directory entries available");
+        return -1;
+    }
+
+    if (name_index_insert(&dir->index, entry->filename, slot) < 0) {
+        name_index_push_free(&dir->index, slot);
+        return -1;
+    }
+    if (dir_write_entry(dir, slot, entry) < 0) {
+        name_index_remove(&dir->index, entry->filename);
+        name_index_push_free(&dir->index, slot);
+        return -1;
+    }
+    return slot;
+}
+
+// Clear the entry in `slot` and return the slot to the free list.
+int dir_remove_entry(dir_t *dir, uint32_t slot, const char *name) {
+    dir_entry_t empty;
+    memset(&empty, 0, sizeof(dir_entry_t));
+    if (dir_write_entry(dir, slot, &empty) < 0) {
+        return -1;
+    }
+    name_index_remove(&dir->index, name);
+    return name_index_push_free(&dir->index, slot);
+}
+
+// Take a free slot of `dir` for an inline file's data. With `grow`, which
+// needs dir_lock held exclusive, a full subdirectory grows as for a new
+// entry. The root, whose size is fixed, keeps all of its slots for names.
+// Without a slot -1 is returned and the caller stores the data elsewhere.
+int dir_claim_slot(dir_t *dir, int grow) {
+    if (dir == &root_dir) {
+        return -1;
+    }
+    pthread_mutex_lock(&slot_lock);
+    int slot = name_index_pop_free(&dir->index);
+    if (slot == -1 && grow && grow_dir(dir) == 0) {
+        slot = name_index_pop_free(&dir->index);
+    }
+    pthread_mutex_unlock(&slot_lock);
+    return slot;
+}
+
+// Clear a data slot and return it to the free list.
+int dir_release_slot(dir_t *dir, uint32_t slot) {
+    dir_entry_t empty;
+    memset(&empty, 0, sizeof(dir_entry_t));
+    if (dir_write_entry(dir, slot, &empty) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&slot_lock);
+    int result = name_index_push_free(&dir->index, slot);
+    pthread_mutex_unlock(&slot_lock);
+    return result;
+}
+
+// Drop an empty subdirectory that is being removed from the loaded table and
+// the dentry cache. Its clusters must be freed by the caller first.
+void dir_forget(dir_t *dir) {
+    pthread_mutex_lock(&table_lock);
+    dir_t **link = bucket_of(dir->id);
+    while (*link && *link != dir) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = dir->hash_next;
+    }
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        if (dcache[i].dir == dir) {
+            dcache[i].path[0] = '\0';
+            dcache[i].dir = NULL;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    free_dir(dir);
+}
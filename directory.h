@@ -0,0 +1,41 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+#include "filesystem.h"
+#include "disk.h"
+#include "dirindex.h"
+
+// Constants
+#define DIR_ROOT ((uint32_t)-1)     // Directory id of the root directory
+#define DCACHE_SIZE 256             // Slots in the path-to-directory cache
+#define DIR_ENTRIES_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(dir_entry_t)))  // Entries per subdirectory block
+
+// Structures
+typedef struct dir_s {
+    uint32_t id;             // starting cluster of the directory file, DIR_ROOT for the root
+    struct dir_s *parent;    // directory holding this directory's entry, NULL for the root
+    uint32_t parent_slot;    // slot of this directory's entry in parent
+    uint32_t *clusters;      // the directory file's FAT chain as an array
+    uint32_t nclusters;
+    uint32_t nslots;         // entry slots available (MAX_FILES for the root)
+    name_index_t index;      // name -> slot, plus the free slots
+    struct dir_s *hash_next; // next loaded directory in the same table bucket
+} dir_t;
+
+// Function prototypes
+int dir_init();
+void dir_destroy();
+
+dir_t *dir_resolve(const char *path, char *name);
+int dir_lookup(dir_t *dir, const char *name);
+dir_t *dir_open_child(dir_t *dir, uint32_t slot);
+int dir_read_entry(dir_t *dir, uint32_t slot, dir_entry_t *entry);
+int dir_write_entry(dir_t *dir, uint32_t slot, const dir_entry_t *entry);
+int dir_add_entry(dir_t *dir, const dir_entry_t *entry);
+int dir_remove_entry(dir_t *dir, uint32_t slot, const char *name);
+int dir_claim_slot(dir_t *dir, int grow);
+int dir_release_slot(dir_t *dir, uint32_t slot);
+void dir_forget(dir_t *dir);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "dirindex.h"
+#include "log.h"
+
+// In-memory hash index from file name to directory slot.
+//
+// Names live in an open-addressing table with linear probing. Removed names
+// leave tombstones so probe sequences stay intact; the table is rebuilt
+// (and grown if needed) once live names plus tombstones pass 70% of the
+// buckets. Unused directory slots are kept on a stack so a new entry gets a
+// slot without scanning the directory.
+
+static uint32_t hash_name(const char *name) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int alloc_buckets(name_index_t *index, uint32_t capacity) {
+    index->buckets = (name_bucket_t *)calloc(capacity, sizeof(name_bucket_t));
+    if (!index->buckets) {
+        log_error(FS_ENOMEM, "name_index: failed to allocate %u buckets", capacity);
+        return -1;
+    }
+    index->capacity = capacity;
+    index->count = 0;
+    index->used = 0;
+    return 0;
+}
+
+int name_index_init(name_index_t *index, uint32_t expected) {
+    uint32_t capacity = 16;
+    while (capacity < expected * 2) {
+        capacity <<= 1;
+    }
+
+    memset(index, 0, sizeof(name_index_t));
+    return alloc_buckets(index, capacity);
+}
+
+void name_index_destroy(name_index_t *index) {
+    free(index->buckets);
+    free(index->free_slots);
+    memset(index, 0, sizeof(name_index_t));
+}
+
+// Return the bucket holding `name`, or -1.
+static int find_bucket(const name_index_t *index, const char *name, uint32_t hash) {
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        const name_bucket_t *b = &index->buckets[i];
+        if (b->name[0] == '\0' && !b->tombstone) {
+            return -1;
+        }
+        if (!b->tombstone && b->hash == hash && strncmp(b->name, name, MAX_FILENAME_LENGTH) == 0) {
+            return (int)i;
+        }
+    }
+}
+
+int name_index_find(const name_index_t *index, const char *name) {
+    if (!index->buckets) {
+        return -1;
+    }
+    int i = find_bucket(index, name, hash_name(name));
+    return (i == -1) ? -1 : (int)index->buckets[i].slot;
+}
+
+static void place(name_index_t *index, const char *name, uint32_t hash, uint32_t slot) {
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash & mask;
+    while (index->buckets[i].name[0] != '\0') {
+        i = (i + 1) & mask;
+    }
+
+    name_bucket_t *b = &index->buckets[i];
+    if (!b->tombstone) {
+        index->used++;
+    }
+    strncpy(b->name, name, MAX_FILENAME_LENGTH - 1);
+    b->name[MAX_FILENAME_LENGTH - 1] = '\0';
+    b->tombstone = 0;
+    b->hash = hash;
+    b->slot = slot;
+    index->count++;
+}
+
+// Rehash live names into a table sized for them, dropping tombstones.
+static int rebuild(name_index_t *index) {
+    name_index_t old = *index;
+    uint32_t capacity = 16;
+    while (capacity < (old.count + 1) * 2) {
+        capacity <<= 1;
+    }
+
+    if (alloc_buckets(index, capacity) < 0) {
+        *index = old;
+        return -1;
+    }
+    for (uint32_t i = 0; i < old.capacity; i++) {
+        if (old.buckets[i].name[0] != '\0') {
+            place(index, old.buckets[i].name, old.buckets[i].hash, old.buckets[i].slot);
+        }
+    }
+    free(old.buckets);
+    return 0;
+}
+
+int name_index_insert(name_index_t *index, const char *name, uint32_t slot) {
+    if ((index->used + 1) * 10 > index->capacity * 7 && rebuild(index) < 0) {
+        return -1;
+    }
+    place(index, name, hash_name(name), slot);
+    return 0;
+}
+
+int name_index_remove(name_index_t *index, const char *name) {
+    int i = index->buckets ? find_bucket(index, name, hash_name(name)) : -1;
+    if (i == -1) {
+        return -1;
+    }
+
+    index->buckets[i].name[0] = '\0';
+    index->buckets[i].tombstone = 1;
+    index->count--;
+    return 0;
+}
+
+int name_index_push_free(name_index_t *index, uint32_t slot) {
+    if (index->free_count == index->free_capacity) {
+        uint32_t capacity = index->free_capacity ? index->free_capacity * 2 : 16;
+        uint32_t *slots = (uint32_t *)realloc(index->free_slots, capacity * sizeof(uint32_t));
+        if (!slots) {
+            log_error(FS_ENOMEM, "name_index: failed to grow free slot list");
+            return -1;
+        }
+        index->free_slots = slots;
+        index->free_capacity = capacity;
+    }
+    index->free_slots[index->free_count++] = slot;
+    return 0;
+}
+
+// Take an unused slot, or -1 if the directory is full.
+int name_index_pop_free(name_index_t *index) {
+    return index->free_count ? (int)index->free_slots[--index->free_count] : -1;
+}
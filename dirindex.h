@@ -0,0 +1,37 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <stdint.h>
+#include "filesystem.h"
+
+// Structures
+typedef struct {
+    char name[MAX_FILENAME_LENGTH]; // file name, empty if the bucket is unused
+    uint8_t tombstone;              // bucket held a removed name; keep probing past it
+    uint32_t hash;                  // cached hash of name
+    uint32_t slot;                  // directory slot holding the entry
+} name_bucket_t;
+
+typedef struct {
+    name_bucket_t *buckets;   // open-addressing table, capacity is a power of two
+    uint32_t capacity;        // number of buckets
+    uint32_t count;           // live names
+    uint32_t used;            // live names plus tombstones
+
+    uint32_t *free_slots;     // stack of unused directory slots, lowest on top
+    uint32_t free_count;
+    uint32_t free_capacity;
+} name_index_t;
+
+// Function prototypes
+int name_index_init(name_index_t *index, uint32_t expected);
+void name_index_destroy(name_index_t *index);
+
+int name_index_find(const name_index_t *index, const char *name);
+int name_index_insert(name_index_t *index, const char *name, uint32_t slot);
+int name_index_remove(name_index_t *index, const char *name);
+
+int name_index_push_free(name_index_t *index, uint32_t slot);
+int name_index_pop_free(name_index_t *index);
+
+#endif
@@ -1,34 +1,66 @@
+#define _GNU_SOURCE               /* copy_file_range */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "disk.h"
+#include "uring.h"
+#include "stats.h"
+#include "log.h"
 
 /******************************************************************************/
 static int active = 0;  /* is the virtual disk open (active) */
 static int handle;      /* file handle to virtual disk       */
+static char *mapping;   /* disk contents in DISK_BACKEND_MMAP mode, else NULL */
+static int uring;       /* transfers go through io_uring (DISK_BACKEND_URING) */
+static int nblocks;     /* size of the open disk in blocks   */
+
+#define COPY_CHUNK_BLOCKS 256   /* bounce buffer of block_copy without copy_file_range */
 
 /******************************************************************************/
 int make_disk(char *name)
 { 
-  int f, cnt;
-  char buf[BLOCK_SIZE];
+  return make_disk_size(name, DISK_BLOCKS, 0);
+}
+
+int make_disk_size(char *name, int blocks, int preallocate)
+{
+  int f, err;
 
   if (!name) {
-    fprintf(stderr, "make_disk: invalid file name\n");
+    log_error(FS_EINVAL, "make_disk: invalid file name");
+    return -1;
+  }
+
+  if (blocks <= 0) {
+    log_error(FS_EINVAL, "make_disk: invalid disk size %d", blocks);
     return -1;
   }
 
   if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
-    perror("make_disk: cannot open file");
+    log_error(FS_EIO, "make_disk: cannot open file: %s", strerror(errno));
+    return -1;
+  }
+
+  /* a sparse file reads as zeros and takes no space until written; */
+  /* preallocated space reads as zeros too, without writing them     */
+  if (ftruncate(f, (off_t)blocks * BLOCK_SIZE) < 0) {
+    log_error(FS_EIO, "make_disk: cannot size file: %s", strerror(errno));
+    close(f);
     return -1;
   }
 
-  memset(buf, 0, BLOCK_SIZE);
-  for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
-    write(f, buf, BLOCK_SIZE);
+  if (preallocate && (err = posix_fallocate(f, 0, (off_t)blocks * BLOCK_SIZE)) != 0) {
+    log_error(FS_ENOSPC, "make_disk: cannot preallocate file: %s", strerror(err));
+    close(f);
+    return -1;
+  }
 
   close(f);
 
@@ -36,21 +68,56 @@ int make_disk(char *name)
 }
 
 int open_disk(char *name)
+{
+  return open_disk_backend(name, DISK_BACKEND_FILE);
+}
+
+int open_disk_backend(char *name, int backend)
 {
   int f;
+  struct stat st;
 
   if (!name) {
-    fprintf(stderr, "open_disk: invalid file name\n");
+    log_error(FS_EINVAL, "open_disk: invalid file name");
     return -1;
   }  
   
   if (active) {
-    fprintf(stderr, "open_disk: disk is already open\n");
+    log_error(FS_EBUSY, "open_disk: disk is already open");
     return -1;
   }
   
   if ((f = open(name, O_RDWR, 0644)) < 0) {
-    perror("open_disk: cannot open file");
+    log_error(FS_EIO, "open_disk: cannot open file: %s", strerror(errno));
+    return -1;
+  }
+
+  /* the disk is as large as its file, in whole blocks */
+  if ((fstat(f, &st) < 0) || (st.st_size < BLOCK_SIZE) ||
+      (st.st_size / BLOCK_SIZE > 0x7fffffff)) {
+    log_error(FS_EINVAL, "open_disk: disk file size is not supported");
+    close(f);
+    return -1;
+  }
+  nblocks = (int)(st.st_size / BLOCK_SIZE);
+
+  if (backend == DISK_BACKEND_MMAP) {
+    mapping = mmap(NULL, (size_t)nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (mapping == MAP_FAILED) {
+      log_error(FS_EIO, "open_disk: cannot map file: %s", strerror(errno));
+      mapping = NULL;
+      close(f);
+      return -1;
+    }
+  } else if (backend == DISK_BACKEND_URING) {
+    if (uring_open(f) < 0) {
+      log_warn("open_disk: io_uring unavailable, using synchronous I/O: %s", strerror(errno));
+    } else {
+      uring = 1;
+    }
+  } else if (backend != DISK_BACKEND_FILE) {
+    log_error(FS_EINVAL, "open_disk: unknown backend %d", backend);
+    close(f);
     return -1;
   }
 
@@ -63,36 +130,104 @@ int open_disk(char *name)
 int close_disk()
 {
   if (!active) {
-    fprintf(stderr, "close_disk: no open disk\n");
+    log_error(FS_ENODEV, "close_disk: no open disk");
     return -1;
   }
   
+  if (mapping) {
+    if (msync(mapping, (size_t)nblocks * BLOCK_SIZE, MS_SYNC) < 0)
+      log_error(FS_EIO, "close_disk: failed to msync: %s", strerror(errno));
+    munmap(mapping, (size_t)nblocks * BLOCK_SIZE);
+    mapping = NULL;
+  }
+
+  if (uring) {
+    uring_close();
+    uring = 0;
+  }
+
   close(handle);
 
-  active = handle = 0;
+  active = handle = nblocks = 0;
 
   return 0;
 }
 
-int block_write(int block, char *buf)
+int sync_disk()
 {
   if (!active) {
-    fprintf(stderr, "block_write: disk not active\n");
+    log_error(FS_ENODEV, "sync_disk: no open disk");
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_write: block index out of bounds\n");
+  if (mapping) {
+    if (msync(mapping, (size_t)nblocks * BLOCK_SIZE, MS_SYNC) < 0) {
+      log_error(FS_EIO, "sync_disk: failed to msync: %s", strerror(errno));
+      return -1;
+    }
+  } else if (fsync(handle) < 0) {
+    log_error(FS_EIO, "sync_disk: failed to fsync: %s", strerror(errno));
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_write: failed to lseek");
+  return 0;
+}
+
+int register_disk_buffers(char *base, size_t len)
+{
+  if (!active) {
+    log_error(FS_ENODEV, "register_disk_buffers: no open disk");
     return -1;
   }
 
-  if (write(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_write: failed to write");
+  /* only io_uring benefits from knowing the buffers in advance */
+  return uring ? uring_register_buffers(base, len) : 0;
+}
+
+int disk_blocks()
+{
+  return active ? nblocks : 0;
+}
+
+char *block_ptr(int block)
+{
+  if (!active || !mapping || (block < 0) || (block >= nblocks))
+    return NULL;
+
+  return mapping + (size_t)block * BLOCK_SIZE;
+}
+
+int block_write(int block, const char *buf)
+{
+  disk_io_t io;
+
+  if (!active) {
+    log_error(FS_ENODEV, "block_write: disk not active");
+    return -1;
+  }
+
+  if ((block < 0) || (block >= nblocks)) {
+    log_error(FS_EINVAL, "block_write: block index out of bounds");
+    return -1;
+  }
+
+  stats_add(STAT_DISK_WRITES, 1);
+  stats_add(STAT_BLOCK_WRITES, 1);
+
+  if (mapping) {
+    memcpy(mapping + (size_t)block * BLOCK_SIZE, buf, BLOCK_SIZE);
+    return 0;
+  }
+
+  if (uring) {
+    io.block = block;
+    io.count = 1;
+    io.buf = (char *)buf;
+    return uring_rw(&io, 1, 1);
+  }
+
+  if (pwrite(handle, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) != BLOCK_SIZE) {
+    log_error(FS_EIO, "block_write: failed to write: %s", strerror(errno));
     return -1;
   }
 
@@ -101,25 +236,270 @@ int block_write(int block, char *buf)
 
 int block_read(int block, char *buf)
 {
+  disk_io_t io;
+
+  if (!active) {
+    log_error(FS_ENODEV, "block_read: disk not active");
+    return -1;
+  }
+
+  if ((block < 0) || (block >= nblocks)) {
+    log_error(FS_EINVAL, "block_read: block index out of bounds");
+    return -1;
+  }
+
+  stats_add(STAT_DISK_READS, 1);
+  stats_add(STAT_BLOCK_READS, 1);
+
+  if (mapping) {
+    memcpy(buf, mapping + (size_t)block * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+  }
+
+  if (uring) {
+    io.block = block;
+    io.count = 1;
+    io.buf = buf;
+    return uring_rw(&io, 1, 0);
+  }
+
+  if (pread(handle, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) != BLOCK_SIZE) {
+    log_error(FS_EIO, "block_read: failed to read: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* check a block range for block_readv/block_writev, return its block count */
+static int check_range(const char *who, int block, const struct iovec *iov, int iovcnt)
+{
+  size_t len = 0;
+  int i;
+
+  if (!active) {
+    log_error(FS_ENODEV, "%s: disk not active", who);
+    return -1;
+  }
+
+  for (i = 0; i < iovcnt; ++i)
+    len += iov[i].iov_len;
+
+  if ((iovcnt <= 0) || (len == 0) || (len % BLOCK_SIZE)) {
+    log_error(FS_EINVAL, "%s: length is not a multiple of the block size", who);
+    return -1;
+  }
+
+  if ((block < 0) || ((size_t)block + len / BLOCK_SIZE > (size_t)nblocks)) {
+    log_error(FS_EINVAL, "%s: block range out of bounds", who);
+    return -1;
+  }
+
+  return (int)(len / BLOCK_SIZE);
+}
+
+int block_writev(int block, const struct iovec *iov, int iovcnt)
+{
+  int count, i;
+  char *p;
+
+  if ((count = check_range("block_writev", block, iov, iovcnt)) < 0)
+    return -1;
+
+  stats_add(STAT_DISK_WRITES, 1);
+  stats_add(STAT_BLOCK_WRITES, count);
+
+  if (mapping) {
+    p = mapping + (size_t)block * BLOCK_SIZE;
+    for (i = 0; i < iovcnt; p += iov[i].iov_len, ++i)
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    return 0;
+  }
+
+  if (uring)
+    return uring_rwv(block, iov, iovcnt, 1);
+
+  if (pwritev(handle, iov, iovcnt, (off_t)block * BLOCK_SIZE) != (ssize_t)count * BLOCK_SIZE) {
+    log_error(FS_EIO, "block_writev: failed to write: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int block_readv(int block, const struct iovec *iov, int iovcnt)
+{
+  int count, i;
+  char *p;
+
+  if ((count = check_range("block_readv", block, iov, iovcnt)) < 0)
+    return -1;
+
+  stats_add(STAT_DISK_READS, 1);
+  stats_add(STAT_BLOCK_READS, count);
+
+  if (mapping) {
+    p = mapping + (size_t)block * BLOCK_SIZE;
+    for (i = 0; i < iovcnt; p += iov[i].iov_len, ++i)
+      memcpy(iov[i].iov_base, p, iov[i].iov_len);
+    return 0;
+  }
+
+  if (uring)
+    return uring_rwv(block, iov, iovcnt, 0);
+
+  if (preadv(handle, iov, iovcnt, (off_t)block * BLOCK_SIZE) != (ssize_t)count * BLOCK_SIZE) {
+    log_error(FS_EIO, "block_readv: failed to read: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* check the ranges of block_read_batch/block_write_batch, return their total blocks */
+static int check_batch(const char *who, const disk_io_t *io, int n)
+{
+  int i, blocks = 0;
+
   if (!active) {
-    fprintf(stderr, "block_read: disk not active\n");
+    log_error(FS_ENODEV, "%s: disk not active", who);
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_read: block index out of bounds\n");
+  for (i = 0; i < n; ++i) {
+    if ((io[i].count <= 0) || (io[i].block < 0) ||
+        ((size_t)io[i].block + io[i].count > (size_t)nblocks)) {
+      log_error(FS_EINVAL, "%s: block range out of bounds", who);
+      return -1;
+    }
+    blocks += io[i].count;
+  }
+
+  return blocks;
+}
+
+int block_write_batch(const disk_io_t *io, int n)
+{
+  int i, blocks;
+
+  if ((blocks = check_batch("block_write_batch", io, n)) < 0)
     return -1;
+
+  stats_add(STAT_DISK_WRITES, n);
+  stats_add(STAT_BLOCK_WRITES, blocks);
+
+  if (uring)
+    return uring_rw(io, n, 1);
+
+  /* without io_uring the ranges are written one after another */
+  for (i = 0; i < n; ++i) {
+    if (mapping) {
+      memcpy(mapping + (size_t)io[i].block * BLOCK_SIZE, io[i].buf, (size_t)io[i].count * BLOCK_SIZE);
+    } else if (pwrite(handle, io[i].buf, (size_t)io[i].count * BLOCK_SIZE, (off_t)io[i].block * BLOCK_SIZE)
+               != (ssize_t)io[i].count * BLOCK_SIZE) {
+      log_error(FS_EIO, "block_write_batch: failed to write: %s", strerror(errno));
+      return -1;
+    }
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_read: failed to lseek");
+  return 0;
+}
+
+int block_read_batch(const disk_io_t *io, int n)
+{
+  int i, blocks;
+
+  if ((blocks = check_batch("block_read_batch", io, n)) < 0)
     return -1;
+
+  stats_add(STAT_DISK_READS, n);
+  stats_add(STAT_BLOCK_READS, blocks);
+
+  if (uring)
+    return uring_rw(io, n, 0);
+
+  /* without io_uring the ranges are read one after another */
+  for (i = 0; i < n; ++i) {
+    if (mapping) {
+      memcpy(io[i].buf, mapping + (size_t)io[i].block * BLOCK_SIZE, (size_t)io[i].count * BLOCK_SIZE);
+    } else if (pread(handle, io[i].buf, (size_t)io[i].count * BLOCK_SIZE, (off_t)io[i].block * BLOCK_SIZE)
+               != (ssize_t)io[i].count * BLOCK_SIZE) {
+      log_error(FS_EIO, "block_read_batch: failed to read: %s", strerror(errno));
+      return -1;
+    }
   }
 
-  if (read(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_read: failed to read");
+  return 0;
+}
+
+/* copy len bytes of the disk file through a bounce buffer, for kernels */
+/* and file systems without copy_file_range                              */
+static int copy_through_buffer(off_t in, off_t out, off_t len)
+{
+  size_t chunk = (len < (off_t)COPY_CHUNK_BLOCKS * BLOCK_SIZE) ? (size_t)len : (size_t)COPY_CHUNK_BLOCKS * BLOCK_SIZE;
+  char *buf = malloc(chunk);
+  size_t n;
+
+  if (!buf) {
+    log_error(FS_ENOMEM, "block_copy: cannot allocate copy buffer");
     return -1;
   }
 
+  for (; len > 0; in += n, out += n, len -= n) {
+    n = (len < (off_t)chunk) ? (size_t)len : chunk;
+    if ((pread(handle, buf, n, in) != (ssize_t)n) || (pwrite(handle, buf, n, out) != (ssize_t)n)) {
+      log_error(FS_EIO, "block_copy: failed to copy: %s", strerror(errno));
+      free(buf);
+      return -1;
+    }
+  }
+
+  free(buf);
+  return 0;
+}
+
+int block_copy(int from, int to, int count)
+{
+  off_t in, out, end;
+  ssize_t n;
+
+  if (!active) {
+    log_error(FS_ENODEV, "block_copy: disk not active");
+    return -1;
+  }
+
+  if ((count <= 0) || (from < 0) || (to < 0) ||
+      ((size_t)from + count > (size_t)nblocks) || ((size_t)to + count > (size_t)nblocks) ||
+      ((from < to + count) && (to < from + count))) {
+    log_error(FS_EINVAL, "block_copy: block ranges out of bounds or overlapping");
+    return -1;
+  }
+
+  stats_add(STAT_DISK_READS, 1);
+  stats_add(STAT_BLOCK_READS, count);
+  stats_add(STAT_DISK_WRITES, 1);
+  stats_add(STAT_BLOCK_WRITES, count);
+
+  if (mapping) {
+    memcpy(mapping + (size_t)to * BLOCK_SIZE, mapping + (size_t)from * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+    return 0;
+  }
+
+  /* the data stays in the kernel, which may also share the extents of */
+  /* the image file; the uring backend copies through the same handle   */
+  in = (off_t)from * BLOCK_SIZE;
+  out = (off_t)to * BLOCK_SIZE;
+  end = in + (off_t)count * BLOCK_SIZE;
+  while (in < end) {
+    n = copy_file_range(handle, &in, handle, &out, (size_t)(end - in), 0);
+    if ((n > 0) || ((n < 0) && (errno == EINTR)))
+      continue;
+    if ((n < 0) && (errno != ENOSYS) && (errno != EXDEV) && (errno != EINVAL) && (errno != EOPNOTSUPP)) {
+      log_error(FS_EIO, "block_copy: failed to copy: %s", strerror(errno));
+      return -1;
+    }
+    return copy_through_buffer(in, out, end - in);
+  }
+
   return 0;
 }
@@ -1,19 +1,66 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <sys/uio.h>
+
 /******************************************************************************/
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
+#define DISK_BLOCKS  8192      /* number of blocks of a disk made by make_disk*/
 #define BLOCK_SIZE   4096      /* block size on "disk"                        */
 
+#define DISK_BACKEND_FILE 0    /* lseek + read/write on the disk file         */
+#define DISK_BACKEND_MMAP 1    /* whole disk file mapped into memory          */
+#define DISK_BACKEND_URING 2   /* io_uring, batched submissions; falls back   */
+                               /* to DISK_BACKEND_FILE if unavailable         */
+
+/******************************************************************************/
+typedef struct {
+  int block;                   /* first block of the range                    */
+  int count;                   /* number of consecutive blocks                */
+  char *buf;                   /* count * BLOCK_SIZE bytes                    */
+} disk_io_t;
+
 /******************************************************************************/
 int make_disk(char *name);     /* create an empty, virtual disk file          */
+int make_disk_size(char *name, int blocks, int preallocate);
+                               /* create an empty disk of a given size (the   */
+                               /* file is sparse until blocks are written,    */
+                               /* unless preallocate reserves its space)      */
 int open_disk(char *name);     /* open a virtual disk (file)                  */
+int open_disk_backend(char *name, int backend);
+                               /* open a virtual disk with a given backend    */
 int close_disk();              /* close a previously opened disk (file)       */
+int sync_disk();               /* flush written blocks to stable storage      */
+int disk_blocks();             /* number of blocks of the open disk           */
+int register_disk_buffers(char *base, size_t len);
+                               /* declare memory that most transfers use, or  */
+                               /* forget it with NULL (io_uring fixed buffers)*/
 
-int block_write(int block, char *buf);
+char *block_ptr(int block);    /* address of a block in the mapped disk, or   */
+                               /* NULL when the disk is not memory-mapped     */
+
+int block_write(int block, const char *buf);
                                /* write a block of size BLOCK_SIZE to disk    */
 int block_read(int block, char *buf);
                                /* read a block of size BLOCK_SIZE from disk   */
+
+int block_writev(int block, const struct iovec *iov, int iovcnt);
+                               /* write consecutive blocks starting at block  */
+                               /* from a scatter list (multiple of BLOCK_SIZE)*/
+int block_readv(int block, const struct iovec *iov, int iovcnt);
+                               /* read consecutive blocks starting at block   */
+                               /* into a scatter list (multiple of BLOCK_SIZE)*/
+
+int block_write_batch(const disk_io_t *io, int n);
+                               /* write n independent block ranges, submitted */
+                               /* together with io_uring                      */
+int block_read_batch(const disk_io_t *io, int n);
+                               /* read n independent block ranges, submitted  */
+                               /* together with io_uring                      */
+
+int block_copy(int from, int to, int count);
+                               /* copy count blocks from block from to block  */
+                               /* to inside the disk file (copy_file_range),  */
+                               /* without passing them through user space     */
 /******************************************************************************/
 
 #endif
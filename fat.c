@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "fat.h"
+#include "cache.h"
+#include "log.h"
+
+// File allocation table access.
+//
+// With FAT_EAGER, fat_open reads FAT 1 into one array and fat_get is an
+// index into it. With FAT_LAZY nothing is read at mount: fat_get and fat_set
+// go through the block cache to the FAT 1 block holding the entry, so only
+// the blocks of clusters actually used are loaded, the hot ones stay cached
+// and cold clean ones are evicted like any other block. A block changed by
+// fat_set carries the LSN of its journal record, which keeps it pinned in
+// the cache until the record is durable; write-back then updates FAT 1.
+//
+// In both modes every change sets the FAT block's dirty bit, and a
+// checkpoint (fat_write_dirty) writes the changed blocks to FAT 1 and its
+// duplicate FAT 2. fat_set is called with journal_lock held, so changes to
+// the table and the dirty bits are serialized; the journal pins the block
+// with fat_pin beforehand, as a cache miss may have to commit the journal.
+//
+// Next to the FAT, a volume of FS_VERSION_NOINLINE (3) or later keeps a
+// reference count per data cluster: one byte holding the references beyond
+// the first, so the region of a new volume is all zeros. A cluster is
+// referenced by the entry whose chain starts there and by each FAT entry
+// pointing at it, which is how clones share a chain. The counts are always
+// read and written through the block cache in the same way as a lazily
+// loaded FAT, and a checkpoint's cache flush writes them in place.
+
+static uint32_t *fat = NULL;        // the whole FAT with FAT_EAGER, else NULL
+static uint32_t entries = 0;        // entries the FAT blocks hold
+static uint64_t *fat_dirty = NULL;  // one bit per FAT block changed since the last checkpoint
+
+int fat_open(int mode) {
+    entries = superblock.fat_blocks_count * FAT_ENTRIES_PER_BLOCK;
+    fat_dirty = (uint64_t *)calloc((superblock.fat_blocks_count + 63) / 64, sizeof(uint64_t));
+    if (!fat_dirty) {
+        log_error(FS_ENOMEM, "fat_open: failed to allocate FAT dirty bits");
+        return -1;
+    }
+    if (mode == FAT_LAZY) {
+        return 0;
+    }
+
+    // Sized to whole FAT blocks so it can be read and written block by block
+    fat = (uint32_t *)malloc((size_t)superblock.fat_blocks_count * BLOCK_SIZE);
+    if (!fat) {
+        log_error(FS_ENOMEM, "fat_open: failed to allocate memory for FAT");
+        fat_close();
+        return -1;
+    }
+
+    // Read FAT 1 with a few large requests
+    for (uint32_t i = 0; i < superblock.fat_blocks_count; i += FORMAT_IO_BLOCKS) {
+        uint32_t count = superblock.fat_blocks_count - i;
+        count = (count < FORMAT_IO_BLOCKS) ? count : FORMAT_IO_BLOCKS;
+        disk_io_t io = { superblock.fat1_start_block + i, (int)count, (char *)(fat + (size_t)i * FAT_ENTRIES_PER_BLOCK) };
+        if (block_read_batch(&io, 1) < 0) {
+            log_error(FS_EIO, "fat_open: failed to read FAT blocks %u-%u", i, i + count - 1);
+            fat_close();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void fat_close() {
+    free(fat);
+    free(fat_dirty);
+    fat = NULL;
+    fat_dirty = NULL;
+    entries = 0;
+}
+
+int fat_lazy() {
+    return fat == NULL;
+}
+
+// Return FAT entry `cluster`, FAT_FREE past the end of the table, or
+// FAT_ERROR if its block cannot be read.
+uint32_t fat_get(uint32_t cluster) {
+    if (cluster >= entries) {
+        return FAT_FREE;
+    }
+    if (fat) {
+        return fat[cluster];
+    }
+
+    char *page = cache_get(superblock.fat1_start_block + cluster / FAT_ENTRIES_PER_BLOCK, 0);
+    if (!page) {
+        log_error(FS_EIO, "fat_get: failed to read FAT entry %u", cluster);
+        return FAT_ERROR;
+    }
+    uint32_t value = ((const uint32_t *)page)[cluster % FAT_ENTRIES_PER_BLOCK];
+    cache_put(page, 0);
+    return value;
+}
+
+// Set FAT entry `cluster`, changed by journal record `lsn` (0 if unlogged),
+// and mark its FAT block dirty. Called with journal_lock held and the block
+// pinned by fat_pin, so it cannot fail then, or during replay.
+int fat_set(uint32_t cluster, uint32_t value, uint64_t lsn) {
+    if (cluster >= entries) {
+        return log_error(FS_EINVAL, "fat_set: cluster %u out of range", cluster);
+    }
+    uint32_t block = cluster / FAT_ENTRIES_PER_BLOCK;
+    if (fat) {
+        fat[cluster] = value;
+        fat_dirty[block / 64] |= 1ULL << (block % 64);
+        return 0;
+    }
+
+    char *page = cache_get(superblock.fat1_start_block + block, 0);
+    if (!page) {
+        return log_error(FS_EIO, "fat_set: failed to read FAT block %u", block);
+    }
+    ((uint32_t *)page)[cluster % FAT_ENTRIES_PER_BLOCK] = value;
+    fat_dirty[block / 64] |= 1ULL << (block % 64);
+    cache_mark_logged(page, lsn);
+    cache_put(page, 1);
+    return 0;
+}
+
+// Pin the cache page holding FAT entry `cluster` into *page, or set it to
+// NULL when the FAT is in memory, so that a fat_set made next finds it
+// cached. Released with fat_unpin.
+int fat_pin(uint32_t cluster, char **page) {
+    *page = NULL;
+    if (cluster >= entries) {
+        return log_error(FS_EINVAL, "fat_pin: cluster %u out of range", cluster);
+    }
+    if (fat) {
+        return 0;
+    }
+    *page = cache_get(superblock.fat1_start_block + cluster / FAT_ENTRIES_PER_BLOCK, 0);
+    if (!*page) {
+        return log_error(FS_EIO, "fat_pin: failed to read FAT entry %u", cluster);
+    }
+    return 0;
+}
+
+// Pin the page holding the reference count of `cluster` like fat_pin.
+int fat_pin_refs(uint32_t cluster, char **page) {
+    *page = NULL;
+    if (cluster >= superblock.data_clusters_count || superblock.ref_blocks == 0) {
+        return 0;
+    }
+    *page = cache_get(superblock.ref_start_block + cluster / BLOCK_SIZE, 0);
+    if (!*page) {
+        return log_error(FS_EIO, "fat_pin_refs: failed to read reference count of cluster %u", cluster);
+    }
+    return 0;
+}
+
+void fat_unpin(char *page) {
+    if (page) {
+        cache_put(page, 0);
+    }
+}
+
+// Copy the FAT_ENTRIES_PER_BLOCK entries of FAT block `block` to `out`.
+int fat_read_block(uint32_t block, uint32_t *out) {
+    if (block >= superblock.fat_blocks_count) {
+        return log_error(FS_EINVAL, "fat_read_block: block %u out of range", block);
+    }
+    if (fat) {
+        memcpy(out, fat + (size_t)block * FAT_ENTRIES_PER_BLOCK, BLOCK_SIZE);
+        return 0;
+    }
+
+    char *page = cache_get(superblock.fat1_start_block + block, 0);
+    if (!page) {
+        return log_error(FS_EIO, "fat_read_block: failed to read FAT block %u", block);
+    }
+    memcpy(out, page, BLOCK_SIZE);
+    cache_put(page, 0);
+    return 0;
+}
+
+// Write the FAT blocks marked dirty to FAT 1 and FAT 2 and clear their bits.
+// With FAT_LAZY, FAT 1 is written by the cache flush that precedes this, so
+// only the FAT 2 copies are written here. Called by the checkpoint with
+// journal_lock held.
+int fat_write_dirty() {
+    for (uint32_t w = 0; w * 64 < superblock.fat_blocks_count; w++) {
+        while (fat_dirty[w]) {
+            uint32_t i = w * 64 + __builtin_ctzll(fat_dirty[w]);
+            int result;
+            if (fat) {
+                const char *block = (const char *)(fat + (size_t)i * FAT_ENTRIES_PER_BLOCK);
+                result = block_write(superblock.fat1_start_block + i, block) < 0 ||
+                         block_write(superblock.fat2_start_block + i, block) < 0 ? -1 : 0;
+            } else {
+                char *page = cache_get(superblock.fat1_start_block + i, 0);
+                result = (page && block_write(superblock.fat2_start_block + i, page) == 0) ? 0 : -1;
+                if (page) {
+                    cache_put(page, 0);
+                }
+            }
+            if (result < 0) {
+                log_error(FS_EIO, "journal_checkpoint: failed to write FAT block %u", i);
+                return -1;
+            }
+            fat_dirty[w] &= fat_dirty[w] - 1;
+        }
+    }
+    return 0;
+}
+
+// Return the number of references to `cluster`: 1 for a cluster owned by one
+// chain, or on a volume without reference counts. FAT_ERROR if the count
+// cannot be read.
+uint32_t fat_refs(uint32_t cluster) {
+    if (cluster >= superblock.data_clusters_count || superblock.ref_blocks == 0) {
+        return 1;
+    }
+
+    char *page = cache_get(superblock.ref_start_block + cluster / BLOCK_SIZE, 0);
+    if (!page) {
+        log_error(FS_EIO, "fat_refs: failed to read reference count of cluster %u", cluster);
+        return FAT_ERROR;
+    }
+    uint32_t extra = (uint8_t)page[cluster % BLOCK_SIZE];
+    cache_put(page, 0);
+    return 1 + extra;
+}
+
+// Set the references to `cluster` beyond the first to `extra`, changed by
+// journal record `lsn` (0 if unlogged). Called with journal_lock held, or
+// during replay.
+int fat_set_refs(uint32_t cluster, uint32_t extra, uint64_t lsn) {
+    if (cluster >= superblock.data_clusters_count || superblock.ref_blocks == 0) {
+        return log_error(FS_EINVAL, "fat_set_refs: cluster %u has no reference count", cluster);
+    }
+
+    char *page = cache_get(superblock.ref_start_block + cluster / BLOCK_SIZE, 0);
+    if (!page) {
+        return log_error(FS_EIO, "fat_set_refs: failed to read reference count of cluster %u", cluster);
+    }
+    page[cluster % BLOCK_SIZE] = (char)extra;
+    cache_mark_logged(page, lsn);
+    cache_put(page, 1);
+    return 0;
+}
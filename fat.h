@@ -0,0 +1,31 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdint.h>
+#include "filesystem.h"
+#include "disk.h"
+
+// Constants
+#define FAT_EAGER 0                 // mount_fs reads the whole FAT into memory (default)
+#define FAT_LAZY  1                 // FAT blocks are loaded on demand through the block cache
+#define FAT_ENTRIES_PER_BLOCK ((uint32_t)(BLOCK_SIZE / sizeof(uint32_t)))
+#define FAT_ERROR 0xFFFFFFFD        // fat_get, fat_refs: the entry could not be read (never a FAT value)
+
+// Function prototypes
+int fat_open(int mode);
+void fat_close();
+int fat_lazy();
+
+uint32_t fat_get(uint32_t cluster);
+int fat_set(uint32_t cluster, uint32_t value, uint64_t lsn);
+int fat_read_block(uint32_t block, uint32_t *entries);
+int fat_write_dirty();
+
+int fat_pin(uint32_t cluster, char **page);
+int fat_pin_refs(uint32_t cluster, char **page);
+void fat_unpin(char *page);
+
+uint32_t fat_refs(uint32_t cluster);
+int fat_set_refs(uint32_t cluster, uint32_t extra, uint64_t lsn);
+
+#endif
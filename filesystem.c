@@ -2,439 +2,1462 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 #include "filesystem.h"
 #include "disk.h"
+#include "cache.h"
+#include "alloc.h"
+#include "directory.h"
+#include "journal.h"
+#include "fat.h"
+#include "stats.h"
+#include "log.h"
 
 // Global variables to store file system strctures in memory
 superblock_t superblock;
-uint32_t *fat = NULL;  
 root_directory_t root_directory;
 file_descriptor_t file_descriptors[MAX_OPEN_FILES];
 
+// An open file: the working copy of its directory entry, shared by every
+// descriptor open on it. The entry is written back to its directory when the
+// last descriptor is closed and at unmount.
+typedef struct {
+    int refs;                   // descriptors open on the file, 0 if the slot is unused
+    dir_t *dir;                 // directory holding the file's entry
+    uint32_t slot;              // slot of the entry in dir
+    dir_entry_t entry;          // working copy of the entry
+    uint8_t dirty;              // entry differs from the directory's copy
+    uint32_t chain_generation;  // bumped when the file's chain shrinks
+    char *wbuf;                 // appends not yet written to the chain, allocated on first use
+    uint64_t wbuf_start;        // file offset of wbuf[0]; the chain holds the bytes before it
+    uint32_t wbuf_len;          // bytes buffered, 0 if none
+    uint32_t shared_from;       // first chain index that may be shared with a clone, UINT32_MAX if none
+    uint32_t replaced;          // shared chain the entry on disk still starts with, FAT_EOF if none
+    char *idata;                // with ATTR_INLINE, the file's bytes (INLINE_MAX), loaded when it is opened
+    uint32_t inline_held;       // data slots the entry on disk refers to
+    uint8_t inline_dirty;       // idata differs from the data slots
+    pthread_rwlock_t lock;
+} open_file_t;
+
+// Small appends collect in the open file's write buffer, shared by its
+// descriptors, and no clusters are allocated for them yet. The file size
+// already includes them and fs_read serves them from the buffer. When the
+// buffer fills, before any other write or a truncate, at fs_close, fs_fsync,
+// fs_sync and umount the buffer is flushed: the clusters it needs are
+// allocated as one contiguous run and the data written in large pieces.
+
+// Small files are inline: fs_create gives a file in a subdirectory no
+// cluster, only ATTR_INLINE, and up to INLINE_MAX bytes are kept in idata
+// while it is open and stored in data slots of its directory (free slots
+// marked with INLINE_MARK) when it is closed or synced, the entry listing
+// them. A write past INLINE_MAX, or a directory without a free slot, moves
+// the bytes to a cluster chain (promote), and the file stays there. The
+// root's fixed slots are kept for names, so files there get a cluster, as
+// every file does on volumes of version FS_VERSION_NOINLINE and older.
+
+// Locking: dir_lock protects the directory tree (taken exclusive by
+// fs_create, fs_delete, fs_mkdir and fs_rmdir, shared by fs_open and
+// fs_close). Each open file has a reader-writer lock covering its entry and
+// FAT chain: fs_read, fs_lseek and fs_get_filesize take it shared, fs_write
+// and fs_trunc exclusive, so readers of a file run in parallel and files
+// never block each other. fs_copy_range holds the source's lock shared and
+// the destination's exclusive, taken in the order of their open file slots.
+// open_files_lock guards the open file table; the
+// allocator and the block cache take their own locks below these.
+// Descriptor slots are claimed with an atomic compare-and-swap on in_use; a
+// descriptor itself must not be used by two threads at once. mount_fs and
+// umount_fs must not run concurrently with any other call.
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static open_file_t open_files[MAX_OPEN_FILES];
+static int mounted = 0;
+static uint32_t write_buffer_size = 0;   // bytes per open file, 0 if appends are not buffered
+
+static int flush_write_buffer(open_file_t *file, file_descriptor_t *descriptor);
+static int promote(open_file_t *file, file_descriptor_t *descriptor);
+static int write_superblock(uint32_t clean);
+
 int make_fs(char *disk_name) {
-    // Create virtual disk
-    if (make_disk(disk_name) < 0) {
-        fprintf(stderr, "make_fs: failed to create disk\n");
+    return make_fs_opts(disk_name, NULL);
+}
+
+// Lay out a volume of `total_blocks`: the superblock, the two FATs, the root
+// directory, the journal and the reference counts, then the data area on a
+// cluster boundary. The FATs and the reference counts hold an entry per data
+// cluster, so the cluster count is what is left once they are sized for it;
+// shrinking it only shrinks them, so the loop converges in a few steps.
+static int layout(uint32_t total_blocks, uint32_t cluster_blocks) {
+    uint32_t fixed = 1 + 1 + JOURNAL_BLOCKS;  // superblock, root directory, journal
+    if (total_blocks <= fixed) {
         return -1;
     }
 
-    // Open virtual disk
-    if (open_disk(disk_name) < 0) {
-        fprintf(stderr, "make_fs: failed to open disk\n");
+    uint32_t clusters = (total_blocks - fixed) / cluster_blocks;
+    uint32_t fat_blocks, ref_blocks, data_start;
+    for (;;) {
+        fat_blocks = ((uint64_t)clusters * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        ref_blocks = (clusters + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        data_start = (fixed + 2 * fat_blocks + ref_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+        if (data_start >= total_blocks) {
+            return -1;
+        }
+        uint32_t fit = (total_blocks - data_start) / cluster_blocks;
+        if (fit >= clusters) {
+            break;
+        }
+        clusters = fit;
+    }
+    if (clusters == 0) {
         return -1;
     }
-    printf("make_fs: Disk opened successfully\n");
 
-    // Initialize superblock
+    memset(&superblock, 0, sizeof(superblock_t));
     superblock.magic = MAGIC_NUMBER;
-    superblock.total_blocks = DISK_BLOCKS;
+    superblock.version = FS_VERSION;
+    superblock.total_blocks = total_blocks;
     superblock.block_size = BLOCK_SIZE;
+    superblock.cluster_blocks = cluster_blocks;
 
     superblock.fat1_start_block = 1; // FAT 1 starts at block 1
-    superblock.fat_blocks_count = (DISK_BLOCKS * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE; // Number of blocks for FAT
+    superblock.fat_blocks_count = fat_blocks; // Number of blocks for FAT
     superblock.fat2_start_block = superblock.fat1_start_block + superblock.fat_blocks_count; // FAT 2 starts after FAT 1
     superblock.root_dir_block = superblock.fat2_start_block + superblock.fat_blocks_count; // Root directory starts after FAT 2
     superblock.root_dir_blocks = 1; // Assume 1 block for the root directory
-    superblock.data_start_block = superblock.root_dir_block + superblock.root_dir_blocks; // Data blocks start after root directory
-    superblock.data_blocks_count = DISK_BLOCKS - superblock.data_start_block; // Total blocks minus metadata
-    superblock.free_blocks_count = superblock.data_blocks_count; // Initially all data blocks are free
+    superblock.journal_start_block = superblock.root_dir_block + superblock.root_dir_blocks; // Metadata journal follows the root directory
+    superblock.journal_blocks = JOURNAL_BLOCKS;
+    superblock.ref_start_block = superblock.journal_start_block + superblock.journal_blocks; // Reference counts follow the journal
+    superblock.ref_blocks = ref_blocks;
+    superblock.data_start_block = data_start; // Data clusters start after the reference counts, aligned to a cluster
+    superblock.data_clusters_count = clusters;
+    superblock.free_clusters_count = clusters; // Initially all data clusters are free
+    superblock.clean = FS_CLEAN; // The free count is exact until the first mount
+    return 0;
+}
 
-    // Write the superblock to block 0
-    char buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);                    //  buffer is zeroed out
-    memcpy(buf, &superblock, sizeof(superblock_t)); // Copy superblock into buffer
+int make_fs_opts(char *disk_name, const mkfs_opts_t *opts) {
+    uint64_t volume_size = (opts && opts->volume_size) ? opts->volume_size : (uint64_t)DISK_BLOCKS * BLOCK_SIZE;
+    uint32_t cluster_size = (opts && opts->cluster_size) ? opts->cluster_size : BLOCK_SIZE;
 
-    if (block_write(0, buf) < 0) {
-        fprintf(stderr, "make_fs: failed to write superblock\n");
-        close_disk();
+    // Validate the geometry before anything is written
+    if (cluster_size % BLOCK_SIZE != 0 || cluster_size / BLOCK_SIZE > MAX_CLUSTER_BLOCKS) {
+        log_error(FS_EINVAL, "make_fs: cluster size %u is not a multiple of %d up to %d blocks",
+                  cluster_size, BLOCK_SIZE, MAX_CLUSTER_BLOCKS);
+        return -1;
+    }
+    if (volume_size / BLOCK_SIZE > INT32_MAX ||
+        layout((uint32_t)(volume_size / BLOCK_SIZE), cluster_size / BLOCK_SIZE) < 0) {
+        log_error(FS_EINVAL, "make_fs: volume size %llu is not supported",
+                  (unsigned long long)volume_size);
         return -1;
     }
 
-    // Initialize the FAT
-    fat = (uint32_t *)malloc(superblock.data_blocks_count * sizeof(uint32_t));
-    if (!fat) {
-        fprintf(stderr, "make_fs: failed to allocate memory for FAT\n");
-        close_disk();
+    // Create virtual disk
+    if (make_disk_size(disk_name, superblock.total_blocks, opts ? opts->preallocate : 0) < 0) {
+        log_error(FS_EIO, "make_fs: failed to create disk");
         return -1;
     }
 
-    // Set all FAT entries to free
-    for (uint32_t i = 0; i < superblock.data_blocks_count; i++) {
-        fat[i] = FAT_FREE;
+    // Open virtual disk
+    if (open_disk(disk_name) < 0) {
+        log_error(FS_EIO, "make_fs: failed to open disk");
+        return -1;
     }
+    log_info("make_fs: Disk opened successfully");
 
-    // Write FAT 1 to the reserved FAT blocks on disk
-    for (uint32_t i = 0; i < superblock.fat_blocks_count; i++) {
-        memset(buf, 0, BLOCK_SIZE);
-        memcpy(buf, fat + (i * (BLOCK_SIZE / sizeof(uint32_t))), BLOCK_SIZE);
-        if (block_write(superblock.fat1_start_block + i, buf) < 0) {
-            fprintf(stderr, "make_fs: failed to write FAT 1 to disk\n");
-            free(fat);
-            close_disk();
-            return -1;
-        }
+    // The image is new and reads as zeros, so only blocks with nonzero
+    // content are written: the superblock, the FATs (whose free marker is
+    // not zero) and the journal header. The root directory, the rest of the
+    // journal, the reference counts and the data area stay unwritten.
+    char buf[BLOCK_SIZE];
+    memset(buf, 0, BLOCK_SIZE);                    //  buffer is zeroed out
+    memcpy(buf, &superblock, sizeof(superblock_t)); // Copy superblock into buffer
+    memset(&root_directory, 0, sizeof(root_directory_t));
+
+    // Every FAT block of a new volume is the same, so one chunk of free
+    // entries is written over both FATs, the superblock going with the first
+    uint32_t chunk = (superblock.fat_blocks_count < FORMAT_IO_BLOCKS) ? superblock.fat_blocks_count
+                                                                       : FORMAT_IO_BLOCKS;
+    uint32_t *entries = (uint32_t *)malloc((size_t)chunk * BLOCK_SIZE);
+    if (!entries) {
+        log_error(FS_ENOMEM, "make_fs: failed to allocate memory for FAT");
+        close_disk();
+        return -1;
+    }
+    for (size_t i = 0; i < (size_t)chunk * (BLOCK_SIZE / sizeof(uint32_t)); i++) {
+        entries[i] = FAT_FREE;
     }
 
-    // Write FAT 2 (duplicate of FAT 1)
-    for (uint32_t i = 0; i < superblock.fat_blocks_count; i++) {
-        memset(buf, 0, BLOCK_SIZE);
-        memcpy(buf, fat + (i * (BLOCK_SIZE / sizeof(uint32_t))), BLOCK_SIZE);
-        if (block_write(superblock.fat2_start_block + i, buf) < 0) {
-            fprintf(stderr, "make_fs: failed to write FAT 2 to disk\n");
-            free(fat);
+    for (uint32_t i = 0; i < superblock.fat_blocks_count; i += chunk) {
+        int count = (superblock.fat_blocks_count - i < chunk) ? superblock.fat_blocks_count - i : chunk;
+        disk_io_t io[3] = {
+            { superblock.fat1_start_block + i, count, (char *)entries },
+            { superblock.fat2_start_block + i, count, (char *)entries },
+            { 0, 1, buf }
+        };
+        if (block_write_batch(io, (i == 0) ? 3 : 2) < 0) {
+            log_error(FS_EIO, "make_fs: failed to write superblock and FATs to disk");
+            free(entries);
             close_disk();
             return -1;
         }
     }
+    free(entries);
 
-    // Initialize the root Directory
-    memset(&root_directory, 0, sizeof(root_directory_t));
-
-    // Write the root directory to its designated blocks
-    memset(buf, 0, BLOCK_SIZE);
-    memcpy(buf, &root_directory, sizeof(root_directory_t));
-    if (block_write(superblock.root_dir_block, buf) < 0) {
-        fprintf(stderr, "make_fs: failed to write root directory to disk\n");
-        free(fat);
+    // Write an empty journal
+    if (journal_format() < 0) {
         close_disk();
         return -1;
     }
 
     // Close the disk
     if (close_disk() < 0) {
-        fprintf(stderr, "make_fs: failed to close disk\n");
-        free(fat);
+        log_error(FS_EIO, "make_fs: failed to close disk");
         return -1;
     }
-    printf("make_fs: Disk closed successfully after initialization\n");
-
-    free(fat); // Free FAT memory allocation
-    fat = NULL;
+    log_info("make_fs: Disk closed successfully after initialization");
 
     return 0; // Success
 }
 
 int mount_fs(char *disk_name) {
+    return mount_fs_opts(disk_name, NULL);
+}
+
+int mount_fs_opts(char *disk_name, const mount_opts_t *opts) {
     if (!disk_name) {
-        fprintf(stderr, "mount_fs: Invalid disk name.\n");
+        log_error(FS_EINVAL, "mount_fs: Invalid disk name.");
+        return -1;
+    }
+    if (opts && opts->cache_blocks != 0 && opts->cache_blocks < CACHE_MIN_BLOCKS) {
+        log_error(FS_EINVAL, "mount_fs: cache_blocks must be 0 or at least %d.", CACHE_MIN_BLOCKS);
         return -1;
     }
 
-    // Open the virtual disk
-    if (open_disk(disk_name) < 0) {
-        fprintf(stderr, "mount_fs: Failed to open disk '%s'.\n", disk_name);
+    // Open the virtual disk with the requested backend
+    if (open_disk_backend(disk_name, opts ? opts->disk_backend : DISK_BACKEND_FILE) < 0) {
+        log_error(FS_EIO, "mount_fs: Failed to open disk '%s'.", disk_name);
         return -1;
     }
-    printf("mount_fs: Disk '%s' opened successfully.\n", disk_name);
+    log_info("mount_fs: Disk '%s' opened successfully.", disk_name);
 
     // Read and verify the superblock
     char buf[BLOCK_SIZE];
     if (block_read(0, buf) < 0) {
-        fprintf(stderr, "mount_fs: Failed to read superblock.\n");
+        log_error(FS_EIO, "mount_fs: Failed to read superblock.");
         close_disk();
         return -1;
     }
 
     memcpy(&superblock, buf, sizeof(superblock_t));
     if (superblock.magic != MAGIC_NUMBER) {
-        fprintf(stderr, "mount_fs: Invalid magic number in superblock.\n");
+        log_error(FS_ECORRUPT, "mount_fs: Invalid magic number in superblock.");
+        close_disk();
+        return -1;
+    }
+    if (superblock.version != FS_VERSION && superblock.version != FS_VERSION_NOINLINE &&
+        superblock.version != FS_VERSION_NOREFS) {
+        log_error(FS_EVERSION, "mount_fs: Unsupported file system version %u.", superblock.version);
+        close_disk();
+        return -1;
+    }
+    if (superblock.version == FS_VERSION_NOREFS) {
+        superblock.ref_blocks = 0;
+    }
+
+    // The geometry comes from the superblock; check it fits the disk
+    if (superblock.block_size != BLOCK_SIZE || superblock.cluster_blocks == 0 ||
+        superblock.cluster_blocks > MAX_CLUSTER_BLOCKS || superblock.total_blocks > (uint32_t)disk_blocks() ||
+        superblock.data_start_block + (uint64_t)superblock.data_clusters_count * superblock.cluster_blocks >
+            superblock.total_blocks ||
+        (uint64_t)superblock.data_clusters_count * sizeof(uint32_t) >
+            (uint64_t)superblock.fat_blocks_count * BLOCK_SIZE ||
+        (superblock.ref_blocks && ((uint64_t)superblock.ref_blocks * BLOCK_SIZE < superblock.data_clusters_count ||
+                                   superblock.ref_start_block + (uint64_t)superblock.ref_blocks >
+                                       superblock.data_start_block))) {
+        log_error(FS_ECORRUPT, "mount_fs: Invalid geometry in superblock.");
         close_disk();
         return -1;
     }
-    printf("mount_fs: Superblock loaded successfully.\n");
+    log_info("mount_fs: Superblock loaded successfully.");
 
-    // Allocate memory for the FAT
-    fat = (uint32_t *)malloc(superblock.data_blocks_count * sizeof(uint32_t));
-    if (!fat) {
-        fprintf(stderr, "mount_fs: Failed to allocate memory for FAT.\n");
+    int was_clean = superblock.clean == FS_CLEAN;
+    int fat_mode = opts ? opts->fat_mode : FAT_EAGER;
+
+    // Set up the buffer cache first: a lazily loaded FAT lives in it
+    if (cache_init(opts ? opts->cache_blocks : 0) < 0) {
+        log_error(FS_EIO, "mount_fs: Failed to initialize block cache.");
         close_disk();
         return -1;
     }
 
-    // Load FAT1 into memory
-    for (uint32_t i = 0; i < superblock.fat_blocks_count; i++) {
-        if (block_read(superblock.fat1_start_block + i, buf) < 0) {
-            fprintf(stderr, "mount_fs: Failed to read FAT block %u.\n", i);
-            free(fat);
-            close_disk();
-            return -1;
-        }
-        memcpy(fat + (i * (BLOCK_SIZE / sizeof(uint32_t))), buf, BLOCK_SIZE);
+    // Load the FAT, or with FAT_LAZY leave its blocks to be read on demand
+    if (fat_open(fat_mode) < 0) {
+        log_error(FS_EIO, "mount_fs: Failed to load FAT.");
+        cache_destroy();
+        close_disk();
+        return -1;
     }
-    printf("mount_fs: FAT loaded successfully.\n");
+    log_info("mount_fs: FAT loaded successfully.");
 
     // Load the root directory
     if (block_read(superblock.root_dir_block, buf) < 0) {
-        fprintf(stderr, "mount_fs: Failed to read root directory block.\n");
-        free(fat);
+        log_error(FS_EIO, "mount_fs: Failed to read root directory block.");
+        fat_close();
+        cache_destroy();
         close_disk();
         return -1;
     }
 
     memcpy(&root_directory, buf, sizeof(root_directory_t));
-    printf("mount_fs: Root directory loaded successfully.\n");
+    log_info("mount_fs: Root directory loaded successfully.");
+
+    // Replay the metadata journal into the FAT and directories
+    if (journal_open(opts ? opts->journal_mode : JOURNAL_SYNC) < 0) {
+        log_error(FS_EIO, "mount_fs: Failed to recover metadata journal.");
+        fat_close();
+        cache_destroy();
+        close_disk();
+        return -1;
+    }
+    // Logged blocks wait for the journal from here on
+    cache_set_wal(journal_durable, journal_wait);
+
+    // Build the free-space index; after a clean umount a lazily loaded FAT
+    // keeps the superblock's free count instead of being read in full
+    if (alloc_init(fat_mode == FAT_LAZY && was_clean) < 0) {
+        log_error(FS_EIO, "mount_fs: Failed to build free-space index.");
+        cache_destroy();
+        journal_close();
+        fat_close();
+        close_disk();
+        return -1;
+    }
+
+    if (dir_init() < 0) {
+        log_error(FS_EIO, "mount_fs: Failed to index root directory.");
+        cache_destroy();
+        alloc_destroy();
+        journal_close();
+        fat_close();
+        close_disk();
+        return -1;
+    }
+
+    // Until the next clean umount the free count on disk may be stale
+    if (was_clean && write_superblock(0) < 0) {
+        log_error(FS_EIO, "mount_fs: Failed to write superblock.");
+        cache_destroy();
+        dir_destroy();
+        alloc_destroy();
+        journal_close();
+        fat_close();
+        close_disk();
+        return -1;
+    }
 
-    // Initialize the file descriptor table
+    // Initialize the file descriptor and open file tables
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         file_descriptors[i].in_use = 0;
         file_descriptors[i].file_index = -1;
         file_descriptors[i].offset = 0;
+        open_files[i].refs = 0;
+        open_files[i].wbuf = NULL;
+        open_files[i].wbuf_len = 0;
+        open_files[i].idata = NULL;
+        pthread_rwlock_init(&open_files[i].lock, NULL);
     }
-    printf("mount_fs: File descriptor table initialized.\n");
+    int wb = opts ? opts->write_buffer : 0;
+    write_buffer_size = (wb < 0) ? 0 : (wb == 0) ? WRITE_BUFFER_DEFAULT : (uint32_t)wb;
+    log_info("mount_fs: File descriptor table initialized.");
 
+    mounted = 1;
     return 0;  // Success
 }
 
 
-int umount_fs() {
-    char buf[BLOCK_SIZE];  // Temporary buffer for block writes
-
-    // Ensure FAT is allocated
-    if (fat == NULL) {
-        fprintf(stderr, "umount_fs: FAT is not loaded in memory. Cannot unmount.\n");
+// Write the superblock with the current free block count and allocation
+// hint. `clean` is FS_CLEAN only from umount_fs, once everything else is on
+// disk; any other write goes through to the disk before the volume changes.
+static int write_superblock(uint32_t clean) {
+    char buf[BLOCK_SIZE];
+    superblock_t copy;
+    alloc_superblock(&copy);
+    copy.clean = clean;
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, &copy, sizeof(superblock_t));
+    if (block_write(0, buf) < 0) {
+        log_error(FS_EIO, "write_superblock: failed to write superblock");
         return -1;
     }
+    return clean == FS_CLEAN ? 0 : sync_disk();
+}
+
+// Data slots an inline file of `size` bytes uses.
+static uint32_t inline_slots(uint64_t size) {
+    return (uint32_t)((size + INLINE_SLOT_BYTES - 1) / INLINE_SLOT_BYTES);
+}
+
+// Store an inline file's bytes in data slots of its directory, claiming or
+// releasing slots as its size changed. Directories are not grown under the
+// shared lock and the root keeps its slots for names (dir_claim_slot), so
+// 1 is returned when a slot is missing. Called with dir_lock held and the
+// file's entry not changing.
+static int store_inline(open_file_t *file) {
+    uint32_t need = inline_slots(file->entry.file_size);
+    while (file->inline_held < need) {
+        int slot = dir_claim_slot(file->dir, 0);
+        if (slot < 0) {
+            return 1;
+        }
+        file->entry.inline_slots[file->inline_held++] = (uint32_t)slot;
+    }
+    while (file->inline_held > need) {
+        if (dir_release_slot(file->dir, file->entry.inline_slots[--file->inline_held]) < 0) {
+            return -1;
+        }
+    }
 
-    // Write the FAT back to disk (FAT 1)
-    printf("umount_fs: Writing FAT to disk...\n");
-    for (uint32_t i = 0; i < superblock.fat_blocks_count; i++) {
-        memset(buf, 0, BLOCK_SIZE);
-        memcpy(buf, fat + (i * (BLOCK_SIZE / sizeof(uint32_t))), BLOCK_SIZE);
-        if (block_write(superblock.fat1_start_block + i, buf) < 0) {
-            fprintf(stderr, "umount_fs: failed to write FAT 1 to disk\n");
+    for (uint32_t i = 0; i < need; i++) {
+        inline_slot_t record;
+        size_t done = (size_t)i * INLINE_SLOT_BYTES;
+        size_t n = (file->entry.file_size - done < INLINE_SLOT_BYTES) ? file->entry.file_size - done
+                                                                      : INLINE_SLOT_BYTES;
+        memset(&record, 0, sizeof(inline_slot_t));
+        record.mark = INLINE_MARK;
+        memcpy(record.data, file->idata + done, n);
+        if (dir_write_entry(file->dir, file->entry.inline_slots[i], (const dir_entry_t *)&record) < 0) {
             return -1;
         }
     }
+    file->inline_dirty = 0;
+    file->dirty = 1;
+    return 0;
+}
 
-    // Write the duplicate FAT (FAT 2)
-    for (uint32_t i = 0; i < superblock.fat_blocks_count; i++) {
-        memset(buf, 0, BLOCK_SIZE);
-        memcpy(buf, fat + (i * (BLOCK_SIZE / sizeof(uint32_t))), BLOCK_SIZE);
-        if (block_write(superblock.fat2_start_block + i, buf) < 0) {
-            fprintf(stderr, "umount_fs: failed to write FAT 2 to disk\n");
+// Put the bytes only memory holds of an open file where its entry can list
+// them: an inline file's in data slots, or in clusters when its directory
+// has no free slot, and buffered appends in the chain. `descriptor` lends
+// its chain cursor and may be NULL. Called with dir_lock held and the
+// file's lock held exclusive, before write_back.
+static int store_file(open_file_t *file, file_descriptor_t *descriptor) {
+    if ((file->entry.attribute & ATTR_INLINE) && file->inline_dirty) {
+        int result = store_inline(file);
+        if (result < 0 || (result > 0 && promote(file, descriptor) < 0)) {
             return -1;
         }
     }
+    return flush_write_buffer(file, descriptor);
+}
 
-    // Write the root directory back to disk
-    printf("umount_fs: Writing root directory to disk...\n");
-    for (uint32_t i = 0; i < superblock.root_dir_blocks; i++) {
-        memset(buf, 0, BLOCK_SIZE);
-        memcpy(buf, ((char *)&root_directory) + (i * BLOCK_SIZE), BLOCK_SIZE);
-        if (block_write(superblock.root_dir_block + i, buf) < 0) {
-            fprintf(stderr, "umount_fs: failed to write root directory to disk\n");
+// Write an open file's entry back to its directory if it changed, with an
+// inline file's data slots before it, then drop what the entry on disk no
+// longer refers to: the data slots of a file that left them, and the shared
+// chain a file no longer starts with (see unshare). Only directory entries,
+// the FAT and reference counts change: the data was placed by store_file.
+// Called with dir_lock held and the file's entry not changing.
+static int write_back(open_file_t *file) {
+    if ((file->entry.attribute & ATTR_INLINE) && file->inline_dirty) {
+        int result = store_inline(file);
+        if (result > 0) {
+            result = log_error(FS_ENOSPC, "write_back: no directory slot for the data of '%s'",
+                               file->entry.filename);
+        }
+        if (result < 0) {
+            return -1;
+        }
+    }
+    if (file->dirty) {
+        if (dir_write_entry(file->dir, file->slot, &file->entry) < 0) {
+            return -1;
+        }
+        file->dirty = 0;
+    }
+    while (!(file->entry.attribute & ATTR_INLINE) && file->inline_held > 0) {
+        if (dir_release_slot(file->dir, file->entry.inline_slots[--file->inline_held]) < 0) {
             return -1;
         }
     }
+    if (file->replaced != FAT_EOF) {
+        // Not retried on failure: part of the chain may be free already
+        uint32_t replaced = file->replaced;
+        file->replaced = FAT_EOF;
+        return alloc_release(replaced);
+    }
+    return 0;
+}
+
+// Write the modified entries of open files back to their directories. Called
+// with dir_lock held shared, or from umount_fs.
+static int write_open_files() {
+    int result = 0;
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_file_t *file = &open_files[i];
+        if (file->refs == 0) {
+            continue;
+        }
+        pthread_rwlock_wrlock(&file->lock);
+        if (store_file(file, NULL) < 0 || write_back(file) < 0) {
+            result = -1;
+        }
+        pthread_rwlock_unlock(&file->lock);
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return result;
+}
 
-    // Free any dynamically allocated memory for FAT
-    free(fat);
-    fat = NULL;
+int umount_fs() {
+    if (!mounted) {
+        log_error(FS_ENODEV, "umount_fs: no file system is mounted. Cannot unmount.");
+        return -1;
+    }
+
+    // Write back the entries of files still open, then dirty blocks, the
+    // changed FAT blocks, the root directory and the superblock
+    log_info("umount_fs: Writing FAT and root directory to disk...");
+    if (write_open_files() < 0 || journal_checkpoint() < 0 || write_superblock(FS_CLEAN) < 0 || cache_destroy() < 0) {
+        log_error(FS_EIO, "umount_fs: failed to write metadata");
+        return -1;
+    }
+
+    // Free any dynamically allocated memory for FAT and the directory tree
+    dir_destroy();
+    alloc_destroy();
+    journal_close();
+    fat_close();
+    mounted = 0;
 
     // Close any open file descriptors
-    printf("umount_fs: Closing all file descriptors...\n");
+    log_info("umount_fs: Closing all file descriptors...");
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (file_descriptors[i].in_use) {
             file_descriptors[i].in_use = 0;
             file_descriptors[i].file_index = -1;
             file_descriptors[i].offset = 0;
         }
+        if (open_files[i].refs > 0) {
+            open_files[i].refs = 0;
+            open_files[i].dirty = 0;
+        }
+        free(open_files[i].wbuf);
+        open_files[i].wbuf = NULL;
+        open_files[i].wbuf_len = 0;
+        free(open_files[i].idata);
+        open_files[i].idata = NULL;
     }
 
     // Close the disk
-    printf("umount_fs: Closing disk...\n");
+    log_info("umount_fs: Closing disk...");
     if (close_disk() < 0) {
-        fprintf(stderr, "umount_fs: failed to close disk\n");
+        log_error(FS_EIO, "umount_fs: failed to close disk");
         return -1;
     }
 
-    printf("umount_fs: Disk unmounted and closed successfully.\n");
+    log_info("umount_fs: Disk unmounted and closed successfully.");
     return 0;  // Success
 }
 
 
-int fs_open(const char *filename) {
-    // Validate input filename
-    if (!filename || strlen(filename) == 0) {
-        fprintf(stderr, "fs_open: invalid filename\n");
-        return -1;
+// Check that fd names a claimed descriptor slot.
+static int fd_valid(int fd) {
+    return fd >= 0 && fd < MAX_OPEN_FILES &&
+           __atomic_load_n(&file_descriptors[fd].in_use, __ATOMIC_ACQUIRE);
+}
+
+// Forget the descriptor's cached position in the FAT chain.
+static void reset_cursor(file_descriptor_t *descriptor) {
+    descriptor->cursor_block = 0;
+    descriptor->cursor_cluster = FAT_FREE;
+    descriptor->skip_stride = 1;
+    descriptor->skip_count = 0;
+}
+
+// Invalidate the cursors of every descriptor open on a file whose chain
+// shrank or was replaced in part. Called with the file's lock held
+// exclusive; each descriptor notices the new generation the next time it
+// walks the chain.
+static void reset_file_cursors(open_file_t *file) {
+    file->chain_generation++;
+}
+
+// Add the cluster at index `block` of the chain to the sparse skip index
+// when the walk reaches the next sampling point. A full index halves its resolution
+// by keeping every other entry and doubling the stride.
+static void skip_record(file_descriptor_t *descriptor, uint32_t block, uint32_t cluster) {
+    if (block != descriptor->skip_count * descriptor->skip_stride) {
+        return;
+    }
+
+    if (descriptor->skip_count == FD_SKIP_SLOTS) {
+        for (uint32_t i = 0; i < FD_SKIP_SLOTS / 2; i++) {
+            descriptor->skip[i] = descriptor->skip[2 * i];
+        }
+        descriptor->skip_count = FD_SKIP_SLOTS / 2;
+        descriptor->skip_stride *= 2;
+    }
+
+    descriptor->skip[descriptor->skip_count++] = cluster;
+}
+
+// Return the cluster at index `block` of the descriptor's file chain (the
+// cluster holding bytes block * CLUSTER_SIZE onwards). The FAT walk starts at
+// the descriptor's cursor or the nearest skip index entry before `block`, so
+// sequential access costs one FAT step per cluster. With `extend`, clusters
+// missing at the end of the chain are allocated.
+// Returns (uint32_t)-1 on a short or corrupted chain or a full disk, and for
+// a file with no chain yet (its bytes still inline or in the write buffer).
+static uint32_t cluster_at(file_descriptor_t *descriptor, uint32_t block, int extend) {
+    open_file_t *file = &open_files[descriptor->file_index];
+    if (file->entry.starting_cluster == FAT_FREE) {
+        return (uint32_t)-1;
+    }
+    if (descriptor->cursor_generation != file->chain_generation) {
+        reset_cursor(descriptor);
+        descriptor->cursor_generation = file->chain_generation;
+    }
+
+    uint32_t pos = 0;
+    uint32_t cluster = file->entry.starting_cluster;
+
+    if (descriptor->skip_count > 0) {
+        uint32_t k = block / descriptor->skip_stride;
+        if (k >= descriptor->skip_count) {
+            k = descriptor->skip_count - 1;
+        }
+        pos = k * descriptor->skip_stride;
+        cluster = descriptor->skip[k];
+    }
+
+    if (descriptor->cursor_cluster != FAT_FREE &&
+        descriptor->cursor_block <= block && descriptor->cursor_block >= pos) {
+        pos = descriptor->cursor_block;
+        cluster = descriptor->cursor_cluster;
     }
 
-    // Search root directory for the file
-    int file_index = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (root_directory.entries[i].filename[0] != '\0' && // valid entry
-        strcmp(root_directory.entries[i].filename, filename) == 0) {
-            file_index = i;
+    uint32_t steps = 0;
+    for (;;) {
+        skip_record(descriptor, pos, cluster);
+        if (pos == block) {
             break;
         }
+
+        uint32_t next = fat_get(cluster);
+        if (next == FAT_EOF) {
+            if (!extend) {
+                return (uint32_t)-1;
+            }
+            next = alloc_block();
+            if (next == ALLOC_NONE) {
+                log_error(FS_ENOSPC, "cluster_at: No free blocks available.");
+                return (uint32_t)-1;
+            }
+            if (journal_fat(cluster, next) < 0) {
+                alloc_free(next);
+                return (uint32_t)-1;
+            }
+        } else if (next == FAT_ERROR) {
+            return (uint32_t)-1;
+        } else if (next == FAT_FREE || next >= superblock.data_clusters_count) {
+            log_error(FS_ECORRUPT, "cluster_at: corrupted FAT chain at cluster %u", cluster);
+            return (uint32_t)-1;
+        }
+
+        cluster = next;
+        pos++;
+        steps++;
     }
+    stats_add(STAT_FAT_STEPS, steps);
 
-    if (file_index == -1) {
-        fprintf(stderr, "fs_open: file '%s' not found\n", filename);
+    descriptor->cursor_block = pos;
+    descriptor->cursor_cluster = cluster;
+    return cluster;
+}
+
+// Count how many of the next `max_blocks` blocks of the file, starting at
+// file block `block` held in `cluster`, sit on consecutive disk blocks so
+// they can be transferred with one vectored I/O: the rest of `cluster`, then
+// every following cluster of the chain that is physically next to it. With
+// `extend`, clusters are allocated past the end of the chain as for cluster_at.
+static uint32_t contiguous_run(file_descriptor_t *descriptor, uint32_t block, uint32_t cluster,
+                               uint32_t max_blocks, int extend) {
+    uint32_t cluster_blocks = superblock.cluster_blocks;
+    uint32_t index = block / cluster_blocks;
+    uint32_t run = cluster_blocks - block % cluster_blocks;
+    while (run < max_blocks && cluster_at(descriptor, ++index, extend) == ++cluster) {
+        run += cluster_blocks;
+    }
+    return (run < max_blocks) ? run : max_blocks;
+}
+
+// Disk block of file block `block`, which lies in `cluster`.
+static uint32_t file_block(uint32_t cluster, uint32_t block) {
+    return CLUSTER_BLOCK(cluster) + block % superblock.cluster_blocks;
+}
+
+// Read an inline file's bytes from its data slots into a new idata.
+static int load_inline(open_file_t *file) {
+    if (file->entry.file_size > INLINE_MAX) {
+        return log_error(FS_ECORRUPT, "fs_open: inline file '%s' is too large", file->entry.filename);
+    }
+    file->idata = (char *)malloc(INLINE_MAX);
+    if (!file->idata) {
+        return log_error(FS_ENOMEM, "fs_open: failed to allocate inline data");
+    }
+
+    uint32_t count = inline_slots(file->entry.file_size);
+    for (uint32_t i = 0; i < count; i++) {
+        inline_slot_t record;
+        uint32_t slot = file->entry.inline_slots[i];
+        size_t done = (size_t)i * INLINE_SLOT_BYTES;
+        size_t n = (file->entry.file_size - done < INLINE_SLOT_BYTES) ? file->entry.file_size - done
+                                                                      : INLINE_SLOT_BYTES;
+        if (slot >= file->dir->nslots || dir_read_entry(file->dir, slot, (dir_entry_t *)&record) < 0 ||
+            record.mark != INLINE_MARK) {
+            free(file->idata);
+            file->idata = NULL;
+            return log_error(FS_ECORRUPT, "fs_open: bad data slot in inline file '%s'", file->entry.filename);
+        }
+        memcpy(file->idata + done, record.data, n);
+    }
+    file->inline_held = count;
+    return 0;
+}
+
+// Find the open file for dir's `slot`, or take a free one and load the entry.
+// Called with dir_lock held; returns its index in open_files or -1.
+static int get_open_file(dir_t *dir, uint32_t slot) {
+    pthread_mutex_lock(&open_files_lock);
+    int free_index = -1;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_file_t *file = &open_files[i];
+        if (file->refs > 0 && file->dir == dir && file->slot == slot) {
+            file->refs++;
+            pthread_mutex_unlock(&open_files_lock);
+            return i;
+        }
+        if (file->refs == 0 && free_index == -1) {
+            free_index = i;
+        }
+    }
+
+    // Every open file has a descriptor, so a slot is free when a descriptor was
+    if (free_index != -1) {
+        open_file_t *file = &open_files[free_index];
+        file->dir = dir;
+        file->slot = slot;
+        file->inline_held = 0;
+        file->inline_dirty = 0;
+        if (dir_read_entry(dir, slot, &file->entry) < 0 ||
+            ((file->entry.attribute & ATTR_INLINE) && load_inline(file) < 0)) {
+            free_index = -1;
+        } else {
+            file->refs = 1;
+            file->dirty = 0;
+            file->shared_from = (file->entry.attribute & ATTR_SHARED) ? 0 : UINT32_MAX;
+            file->replaced = FAT_EOF;
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return free_index;
+}
+
+// Drop a descriptor's reference to an open file, writing the entry back to
+// its directory when the last one goes. Called with dir_lock held.
+static int put_open_file(int index) {
+    int result = 0;
+    pthread_mutex_lock(&open_files_lock);
+    open_file_t *file = &open_files[index];
+    if (--file->refs == 0) {
+        result = write_back(file);
+        file->dirty = 0;
+    }
+    if (file->refs == 0) {
+        free(file->wbuf);  // flushed by fs_close
+        file->wbuf = NULL;
+        free(file->idata);  // stored by fs_close
+        file->idata = NULL;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return result;
+}
+
+// Return the open file for dir's `slot`, or NULL if no descriptor is open on
+// it. Called with dir_lock held exclusive, which keeps fs_open and fs_close
+// out.
+static open_file_t *find_open_file(dir_t *dir, uint32_t slot) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].refs > 0 && open_files[i].dir == dir && open_files[i].slot == slot) {
+            return &open_files[i];
+        }
+    }
+    return NULL;
+}
+
+static int is_open(dir_t *dir, uint32_t slot) {
+    return find_open_file(dir, slot) != NULL;
+}
+
+// Free a FAT chain from its starting cluster, up to where it is shared with
+// a clone. On failure the rest of the chain is leaked.
+static int free_chain(uint32_t cluster) {
+    return alloc_release(cluster);
+}
+
+// Release the data slots of an inline file's entry, once the entry no longer
+// refers to them. A slot that holds no data is left alone.
+static int release_inline(dir_t *dir, const dir_entry_t *entry) {
+    uint32_t count = (entry->attribute & ATTR_INLINE) ? inline_slots(entry->file_size) : 0;
+    for (uint32_t i = 0; i < count && i < INLINE_SLOTS; i++) {
+        inline_slot_t record;
+        uint32_t slot = entry->inline_slots[i];
+        if (slot >= dir->nslots || dir_read_entry(dir, slot, (dir_entry_t *)&record) < 0 ||
+            record.mark != INLINE_MARK) {
+            continue;
+        }
+        if (dir_release_slot(dir, slot) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Body of fs_open, called with dir_lock held shared.
+static int open_locked(const char *filename) {
+    // Resolve the path and find the file in its directory
+    char name[MAX_FILENAME_LENGTH];
+    dir_t *dir = dir_resolve(filename, name);
+    int slot = dir ? dir_lookup(dir, name) : -1;
+
+    if (slot == -1) {
+        log_error(FS_ENOENT, "fs_open: file '%s' not found", filename);
+        return -1;
+    }
+
+    dir_entry_t entry;
+    if (dir_read_entry(dir, slot, &entry) < 0) {
+        return -1;
+    }
+    if (entry.attribute & ATTR_DIRECTORY) {
+        log_error(FS_EISDIR, "fs_open: '%s' is a directory", filename);
         return -1;
     }
 
-    // Find an unused file descriptor
+    // Claim an unused file descriptor without a lock
     int fd = -1;
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if(!file_descriptors[i].in_use) { // unused descriptor
+        uint8_t unused = 0;
+        if (__atomic_compare_exchange_n(&file_descriptors[i].in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
             fd = i;
             break;
         }
     }
 
     if (fd == -1) {
-        fprintf(stderr, "fs_open: no available file descriptors\n");
+        log_error(FS_EMFILE, "fs_open: no available file descriptors");
+        return -1;
+    }
+
+    int file_index = get_open_file(dir, slot);
+    if (file_index == -1) {
+        __atomic_store_n(&file_descriptors[fd].in_use, 0, __ATOMIC_RELEASE);
+        log_error(FS_EIO, "fs_open: failed to open '%s'", filename);
         return -1;
     }
 
     // Initialize file descriptor
     file_descriptors[fd].file_index = file_index;
     file_descriptors[fd].offset = 0; // Start at beginning of file
-    file_descriptors[fd].in_use = 1; // Mark as in use
+    reset_cursor(&file_descriptors[fd]);
+    file_descriptors[fd].cursor_generation = open_files[file_index].chain_generation;
+    file_descriptors[fd].ra_offset = 0;
+    file_descriptors[fd].ra_window = 0;
+    file_descriptors[fd].ra_end = 0;
+    return fd;
+}
+
+int fs_open(const char *filename) {
+    uint64_t start = stats_now();
 
-    printf("fs_open: file '%s' opened successfully with descriptor %d\n", filename, fd);
+    // Validate input filename
+    if (!filename || strlen(filename) == 0) {
+        log_error(FS_EINVAL, "fs_open: invalid filename");
+        return stats_op(FS_OP_OPEN, start, -1);
+    }
+
+    pthread_rwlock_rdlock(&dir_lock);
+    int fd = open_locked(filename);
+    pthread_rwlock_unlock(&dir_lock);
+
+    if (fd != -1) {
+        log_debug("fs_open: file '%s' opened successfully with descriptor %d", filename, fd);
+        log_trace(TRACE_OPEN, fd, file_descriptors[fd].file_index);
+    }
 
     // Return the file descriptor index
-    return fd;
+    return stats_op(FS_OP_OPEN, start, fd);
 }
 
 int fs_close(int fd) {
+    uint64_t start = stats_now();
+
     // Check if the file descriptor is within range
     if (fd < 0 || fd >= MAX_OPEN_FILES) {
-        fprintf(stderr, "fs_close: invalid file descriptor %d\n", fd);
-        return -1;
+        log_error(FS_EBADF, "fs_close: invalid file descriptor %d", fd);
+        return stats_op(FS_OP_CLOSE, start, -1);
     }
 
     // Check if the file descriptor is in use
-    if (!file_descriptors[fd].in_use) {
-        fprintf(stderr, "fs_close: file descriptor %d is not in use\n", fd);
-        return -1;
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_close: file descriptor %d is not in use", fd);
+        return stats_op(FS_OP_CLOSE, start, -1);
+    }
+
+    // Store inline data and flush buffered appends, then release the open
+    // file, writing its entry back if this was the last descriptor
+    pthread_rwlock_rdlock(&dir_lock);
+    open_file_t *file = &open_files[file_descriptors[fd].file_index];
+    pthread_rwlock_wrlock(&file->lock);
+    int result = store_file(file, &file_descriptors[fd]);
+    pthread_rwlock_unlock(&file->lock);
+    if (put_open_file(file_descriptors[fd].file_index) < 0) {
+        result = -1;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    if (result == 0) {
+        result = journal_commit();
     }
 
-    // Mark the descriptor as unused
-    file_descriptors[fd].in_use = 0;
+    // Mark the descriptor as unused; the slot is released last
     file_descriptors[fd].file_index = -1;
     file_descriptors[fd].offset = 0;
+    __atomic_store_n(&file_descriptors[fd].in_use, 0, __ATOMIC_RELEASE);
 
-    printf("fs_close: file descriptor %d closed successfully\n", fd);
-    return 0; // Success
+    if (result < 0) {
+        log_error(fs_errno(), "fs_close: failed to write back entry of descriptor %d", fd);
+        return stats_op(FS_OP_CLOSE, start, -1);
+    }
+    log_debug("fs_close: file descriptor %d closed successfully", fd);
+    log_trace(TRACE_CLOSE, fd, 0);
+    return stats_op(FS_OP_CLOSE, start, 0); // Success
 }
 
-int fs_create(const char *filename) {
-    // Check for invalid filename
-    if (!filename || strlen(filename) == 0 || strlen(filename) >= MAX_FILENAME_LENGTH) {
-        fprintf(stderr, "fs_create: Invalid filename\n");
-        return -1;
+// Add a new file or directory `name` to `dir`, which does not hold the name
+// yet. Directories start with one zeroed cluster of empty entries, files
+// inline with no cluster where the volume allows, except in the root. Called with dir_lock held
+// exclusive; returns the entry's slot or -1.
+static int add_locked(dir_t *dir, const char *name, uint8_t attribute) {
+    // Allocate the starting cluster (marked as EOF), unless the file is inline
+    uint32_t starting_cluster = FAT_FREE;
+    if (!(attribute & ATTR_DIRECTORY) && superblock.version == FS_VERSION && dir->id != DIR_ROOT) {
+        attribute |= ATTR_INLINE;
+    } else {
+        starting_cluster = alloc_block();
     }
 
-    // Check if the file already exists
-    for (int i = 0; i < MAX_FILES; i++) {
-        dir_entry_t *entry = &root_directory.entries[i];
-        if (entry->filename[0] != '\0' && strcmp(entry->filename, filename) == 0) {
-            fprintf(stderr, "fs_create: File '%s' already exists\n", filename);
-            return -1;
-        }
+    // If no free cluster is found, return  error
+    if (!(attribute & ATTR_INLINE) && starting_cluster == ALLOC_NONE) {
+        log_error(FS_ENOSPC, "fs_create: No free clusters available");
+        return -1;
     }
 
-    // Find an empty directory entry
-    for (int i = 0; i < MAX_FILES; i++) {
-        dir_entry_t *entry = &root_directory.entries[i];
-        if (entry->filename[0] == '\0') {  // Empty entry found
-            // Initialize directory entry
-            strncpy(entry->filename, filename, MAX_FILENAME_LENGTH);
-            entry->filename[MAX_FILENAME_LENGTH - 1] = '\0';
-            entry->file_size = 0;
-
-            // Find a free cluster for the starting cluster
-            uint32_t starting_cluster = FAT_FREE;
-            for (uint32_t j = 0; j < superblock.data_blocks_count; j++) {
-                if (fat[j] == FAT_FREE) {
-                    fat[j] = FAT_EOF;  // Mark the cluster as EOF
-                    starting_cluster = j;
-                    superblock.free_blocks_count--;
-                    break;
-                }
+    // Initialize directory entry
+    dir_entry_t entry;
+    memset(&entry, 0, sizeof(dir_entry_t));
+    strncpy(entry.filename, name, MAX_FILENAME_LENGTH);
+    entry.filename[MAX_FILENAME_LENGTH - 1] = '\0';
+    entry.attribute = attribute;
+    entry.file_size = 0;
+    entry.starting_cluster = starting_cluster;
+
+    if (attribute & ATTR_DIRECTORY) {
+        for (uint32_t i = 0; i < superblock.cluster_blocks; i++) {
+            int block = CLUSTER_BLOCK(starting_cluster) + i;
+            char *page = cache_get(block, CACHE_NOREAD);
+            int result = page ? journal_zero(block, page) : -1;
+            if (page) {
+                cache_put(page, 0);
             }
-
-            // If no free cluster is found, return  error
-            if (starting_cluster == FAT_FREE) {
-                fprintf(stderr, "fs_create: No free clusters available\n");
+            if (result < 0) {
+                alloc_free(starting_cluster);
                 return -1;
             }
+        }
+        entry.file_size = CLUSTER_SIZE;
+    }
 
-            // Update directory entry
-            entry->starting_cluster = starting_cluster;
-
-            printf("fs_create: File '%s' created successfully\n", filename);
-            return 0;  // Success
+    // Store the entry in a free slot, growing the directory if needed
+    int slot = dir_add_entry(dir, &entry);
+    if (slot < 0) {
+        if (!(attribute & ATTR_INLINE)) {
+            alloc_free(starting_cluster);
         }
+        return -1;
     }
 
-    // If no free directory entry is found return an error
-    fprintf(stderr, "fs_create: No free directory entries available\n");
-    return -1;
+    log_trace(TRACE_CREATE, starting_cluster, attribute);
+    return slot;
 }
 
-int fs_delete(const char *filename) {
-    if (!filename || strlen(filename) == 0) {
-        fprintf(stderr, "fs_delete: Invalid filename provided.\n");
+// Body of fs_create and fs_mkdir, called with dir_lock held exclusive.
+static int create_locked(const char *filename, uint8_t attribute) {
+    // Resolve the parent directory and check if the name already exists
+    char name[MAX_FILENAME_LENGTH];
+    dir_t *dir = dir_resolve(filename, name);
+    if (!dir) {
         return -1;
     }
-
-    // Locate the file in the root directory
-    int file_index = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (root_directory.entries[i].filename[0] != '\0' &&
-            strcmp(root_directory.entries[i].filename, filename) == 0) {
-            file_index = i;
-            break;
-        }
+    if (dir_lookup(dir, name) != -1) {
+        log_error(FS_EEXIST, "fs_create: File '%s' already exists", filename);
+        return -1;
     }
 
-    if (file_index == -1) {
-        fprintf(stderr, "fs_delete: File '%s' not found.\n", filename);
+    if (add_locked(dir, name, attribute) < 0) {
         return -1;
     }
+    log_debug("fs_create: File '%s' created successfully", filename);
+    return 0;  // Success
+}
 
-    // Start freeing clusters in the FAT chain
-    uint32_t current_cluster = root_directory.entries[file_index].starting_cluster;
-    printf("fs_delete: Deleting file '%s', starting at cluster %u.\n", filename, current_cluster);
-
-    while (current_cluster != FAT_EOF) {
-        uint32_t next_cluster = fat[current_cluster];
+int fs_create(const char *filename) {
+    uint64_t start = stats_now();
 
-        fat[current_cluster] = FAT_FREE;  // Mark the cluster as free
-        superblock.free_blocks_count++;  // Increment the free block count
-        current_cluster = next_cluster;
+    // Check for invalid filename
+    if (!filename || strlen(filename) == 0 || strlen(filename) >= MAX_PATH_LENGTH) {
+        log_error(FS_EINVAL, "fs_create: Invalid filename");
+        return stats_op(FS_OP_CREATE, start, -1);
     }
 
-    // Clear the root directory entry
-    memset(&root_directory.entries[file_index], 0, sizeof(dir_entry_t));
-    printf("fs_delete: File '%s' successfully deleted.\n", filename);
+    pthread_rwlock_wrlock(&dir_lock);
+    int result = create_locked(filename, 0);
+    pthread_rwlock_unlock(&dir_lock);
 
-    return 0;  // Success
+    // Commit outside the lock so concurrent operations share one journal flush
+    return stats_op(FS_OP_CREATE, start, (result == 0) ? journal_commit() : result);
 }
 
+int fs_mkdir(const char *path) {
+    uint64_t start = stats_now();
 
+    if (!path || strlen(path) == 0 || strlen(path) >= MAX_PATH_LENGTH) {
+        log_error(FS_EINVAL, "fs_mkdir: Invalid path");
+        return stats_op(FS_OP_MKDIR, start, -1);
+    }
 
-int fs_read(int fd, void *buf, size_t count) {
-    // Validate inputs
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !file_descriptors[fd].in_use) {
-        fprintf(stderr, "fs_read: invalid file descriptor %d\n", fd);
+    pthread_rwlock_wrlock(&dir_lock);
+    int result = create_locked(path, ATTR_DIRECTORY);
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Commit outside the lock so concurrent operations share one journal flush
+    return stats_op(FS_OP_MKDIR, start, (result == 0) ? journal_commit() : result);
+}
+
+// Body of fs_delete and fs_rmdir, called with dir_lock held exclusive.
+static int delete_locked(const char *filename, int directory) {
+    // Locate the entry in its directory
+    char name[MAX_FILENAME_LENGTH];
+    dir_t *dir = dir_resolve(filename, name);
+    int file_index = dir ? dir_lookup(dir, name) : -1;
+
+    if (file_index == -1) {
+        log_error(FS_ENOENT, "fs_delete: File '%s' not found.", filename);
         return -1;
     }
-    if (!buf || count == 0) {
-        fprintf(stderr, "fs_read: invalid buffer or count\n");
+
+    dir_entry_t entry;
+    if (dir_read_entry(dir, file_index, &entry) < 0) {
         return -1;
     }
+    if (!(entry.attribute & ATTR_DIRECTORY) != !directory) {
+        if (directory) {
+            return log_error(FS_ENOTDIR, "fs_rmdir: '%s' is not a directory.", filename);
+        }
+        return log_error(FS_EISDIR, "fs_delete: '%s' is a directory.", filename);
+    }
 
-    // Locate the file and check the offset
-    file_descriptor_t *descriptor = &file_descriptors[fd];
-    dir_entry_t *file_entry = &root_directory.entries[descriptor->file_index];
-    if (descriptor->offset >= file_entry->file_size) {
-        fprintf(stderr, "fs_read: offset beyond end of file\n");
+    dir_t *child = NULL;
+    if (directory) {
+        // Only empty directories are removed
+        child = dir_open_child(dir, file_index);
+        if (!child) {
+            return -1;
+        }
+        if (child->index.count > 0) {
+            log_error(FS_ENOTEMPTY, "fs_rmdir: Directory '%s' is not empty.", filename);
+            return -1;
+        }
+    } else if (is_open(dir, file_index)) {
+        // Descriptors would keep writing to the freed clusters and the reused slot
+        log_error(FS_EBUSY, "fs_delete: File '%s' is open.", filename);
+        return -1;
+    }
+
+    // Clear the directory entry, then free clusters in the FAT chain, so a
+    // crash in between only leaks them
+    log_debug("fs_delete: Deleting file '%s', starting at cluster %u.", filename, entry.starting_cluster);
+    if (dir_remove_entry(dir, file_index, name) < 0 || release_inline(dir, &entry) < 0) {
+        return -1;
+    }
+
+    if (child) {
+        // Replay must not rewrite the directory's blocks once they are
+        // reused; if that cannot be logged its clusters are leaked instead
+        int revoked = 0;
+        for (uint32_t i = 0; i < child->nclusters && revoked == 0; i++) {
+            for (uint32_t b = 0; b < superblock.cluster_blocks && revoked == 0; b++) {
+                revoked = journal_revoke(CLUSTER_BLOCK(child->clusters[i]) + b);
+            }
+        }
+        dir_forget(child);
+        if (revoked < 0) {
+            return -1;
+        }
+    }
+    if (free_chain(entry.starting_cluster) < 0) {
+        return -1;
+    }
+
+    log_debug("fs_delete: File '%s' successfully deleted.", filename);
+    log_trace(TRACE_DELETE, entry.starting_cluster, entry.file_size);
+
+    return 0;  // Success
+}
+
+int fs_delete(const char *filename) {
+    uint64_t start = stats_now();
+
+    if (!filename || strlen(filename) == 0) {
+        log_error(FS_EINVAL, "fs_delete: Invalid filename provided.");
+        return stats_op(FS_OP_DELETE, start, -1);
+    }
+
+    pthread_rwlock_wrlock(&dir_lock);
+    int result = delete_locked(filename, 0);
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Commit outside the lock so concurrent operations share one journal flush
+    return stats_op(FS_OP_DELETE, start, (result == 0) ? journal_commit() : result);
+}
+
+int fs_rmdir(const char *path) {
+    uint64_t start = stats_now();
+
+    if (!path || strlen(path) == 0) {
+        log_error(FS_EINVAL, "fs_rmdir: Invalid path provided.");
+        return stats_op(FS_OP_RMDIR, start, -1);
+    }
+
+    pthread_rwlock_wrlock(&dir_lock);
+    int result = delete_locked(path, 1);
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Commit outside the lock so concurrent operations share one journal flush
+    return stats_op(FS_OP_RMDIR, start, (result == 0) ? journal_commit() : result);
+}
+
+// Give the inline file `entry` in `src` a cluster holding the bytes of its
+// data slots, and drop ATTR_INLINE. Called with dir_lock held exclusive.
+static int inline_to_cluster(dir_t *src, dir_entry_t *entry) {
+    uint32_t cluster = alloc_block();
+    if (cluster == ALLOC_NONE) {
+        return log_error(FS_ENOSPC, "fs_clone: no free cluster for '%s'", entry->filename);
+    }
+    char *page = cache_get(CLUSTER_BLOCK(cluster), CACHE_NOREAD);
+    if (!page) {
+        alloc_free(cluster);
+        return -1;
+    }
+
+    // INLINE_MAX bytes fit in the first block
+    memset(page, 0, BLOCK_SIZE);
+    uint32_t count = inline_slots(entry->file_size);
+    int result = 0;
+    for (uint32_t i = 0; i < count && result == 0; i++) {
+        inline_slot_t record;
+        size_t done = (size_t)i * INLINE_SLOT_BYTES;
+        size_t n = (entry->file_size - done < INLINE_SLOT_BYTES) ? entry->file_size - done : INLINE_SLOT_BYTES;
+        if (entry->inline_slots[i] >= src->nslots) {
+            result = log_error(FS_ECORRUPT, "fs_clone: '%s' lists an invalid data slot", entry->filename);
+        } else if ((result = dir_read_entry(src, entry->inline_slots[i], (dir_entry_t *)&record)) == 0) {
+            memcpy(page + done, record.data, n);
+        }
+    }
+    cache_put(page, result == 0);
+    if (result < 0) {
+        alloc_free(cluster);
+        return -1;
+    }
+
+    entry->attribute &= ~ATTR_INLINE;
+    entry->starting_cluster = cluster;
+    memset(entry->inline_slots, 0, sizeof(entry->inline_slots));
+    return 0;
+}
+
+// Copy the data slots of the inline file `entry` in `src` to new data slots
+// of `dst`, which the entry then lists. In the root, which keeps its slots
+// for names, the copy gets a cluster instead. Called with dir_lock held
+// exclusive.
+static int copy_inline(dir_t *src, dir_entry_t *entry, dir_t *dst) {
+    if (dst->id == DIR_ROOT) {
+        return inline_to_cluster(src, entry);
+    }
+    uint32_t count = inline_slots(entry->file_size);
+    for (uint32_t i = 0; i < count; i++) {
+        dir_entry_t record;
+        uint32_t from = entry->inline_slots[i];
+        int slot = dir_claim_slot(dst, 1);
+        if (slot < 0 || from >= src->nslots || dir_read_entry(src, from, &record) < 0 ||
+            dir_write_entry(dst, (uint32_t)slot, &record) < 0) {
+            if (slot < 0) {
+                log_error(FS_ENOSPC, "fs_clone: no free directory slots for '%s'", entry->filename);
+            } else {
+                dir_release_slot(dst, (uint32_t)slot);
+            }
+            entry->file_size = (uint64_t)i * INLINE_SLOT_BYTES;
+            release_inline(dst, entry);
+            return -1;
+        }
+        entry->inline_slots[i] = (uint32_t)slot;
+    }
+    return 0;
+}
+
+// Give `name` in `dst` the chain of the file in src's `slot`: the new entry
+// starts at the same cluster, which gains a reference, so no data is copied
+// and the two chains only part when one of the files is written (see
+// unshare). Both entries are flagged ATTR_SHARED. An inline file has no
+// chain, so its few data slots are copied instead. An open source has its
+// buffered appends and entry written first and its lock held meanwhile.
+// Called with dir_lock held exclusive.
+static int clone_entry(dir_t *src, uint32_t slot, dir_t *dst, const char *name) {
+    open_file_t *file = find_open_file(src, slot);
+    if (file) {
+        pthread_rwlock_wrlock(&file->lock);
+        if (store_file(file, NULL) < 0 || write_back(file) < 0) {
+            pthread_rwlock_unlock(&file->lock);
+            return -1;
+        }
+    }
+
+    dir_entry_t entry;
+    int result = dir_read_entry(src, slot, &entry);
+    uint32_t start = entry.starting_cluster;
+    int inline_data = (entry.attribute & ATTR_INLINE) != 0;
+    if (result == 0 && inline_data) {
+        result = copy_inline(src, &entry, dst);
+    }
+    if (result == 0 && !inline_data && start < superblock.data_clusters_count) {
+        result = alloc_ref(start);
+        if (result > 0) {
+            result = log_error(FS_EMLINK, "fs_clone: '%s' has too many clones", entry.filename);
+        }
+    }
+    if (result == 0 && !inline_data && !(entry.attribute & ATTR_SHARED)) {
+        entry.attribute |= ATTR_SHARED;
+        result = dir_write_entry(src, slot, &entry);
+    }
+    if (result == 0) {
+        if (file && !inline_data) {
+            file->entry.attribute |= ATTR_SHARED;
+            file->shared_from = 0;
+        }
+        strncpy(entry.filename, name, MAX_FILENAME_LENGTH);
+        entry.filename[MAX_FILENAME_LENGTH - 1] = '\0';
+        if (dir_add_entry(dst, &entry) < 0) {
+            if (entry.attribute & ATTR_INLINE) {
+                release_inline(dst, &entry);
+            } else {
+                alloc_release(entry.starting_cluster);
+            }
+            result = -1;
+        }
+    }
+
+    if (file) {
+        pthread_rwlock_unlock(&file->lock);
+    }
+    if (result == 0) {
+        log_trace(TRACE_CLONE, start, entry.file_size);
+    }
+    return result;
+}
+
+// Body of fs_clone, called with dir_lock held exclusive.
+static int clone_locked(const char *src, const char *dst) {
+    char name[MAX_FILENAME_LENGTH];
+    dir_t *dir = dir_resolve(src, name);
+    int slot = dir ? dir_lookup(dir, name) : -1;
+    if (slot == -1) {
+        return log_error(FS_ENOENT, "fs_clone: file '%s' not found", src);
+    }
+
+    dir_entry_t entry;
+    if (dir_read_entry(dir, slot, &entry) < 0) {
+        return -1;
+    }
+    if (entry.attribute & ATTR_DIRECTORY) {
+        return log_error(FS_EISDIR, "fs_clone: '%s' is a directory", src);
+    }
+
+    char dst_name[MAX_FILENAME_LENGTH];
+    dir_t *dst_dir = dir_resolve(dst, dst_name);
+    if (!dst_dir) {
+        return -1;
+    }
+    if (dir_lookup(dst_dir, dst_name) != -1) {
+        return log_error(FS_EEXIST, "fs_clone: '%s' already exists", dst);
+    }
+    return clone_entry(dir, slot, dst_dir, dst_name);
+}
+
+int fs_clone(const char *src, const char *dst) {
+    uint64_t start = stats_now();
+
+    if (!src || !dst || strlen(src) == 0 || strlen(dst) == 0) {
+        log_error(FS_EINVAL, "fs_clone: Invalid path");
+        return stats_op(FS_OP_CLONE, start, -1);
+    }
+    if (superblock.ref_blocks == 0) {
+        log_error(FS_EVERSION, "fs_clone: the volume keeps no cluster reference counts");
+        return stats_op(FS_OP_CLONE, start, -1);
+    }
+
+    pthread_rwlock_wrlock(&dir_lock);
+    int result = clone_locked(src, dst);
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Commit outside the lock so concurrent operations share one journal flush
+    return stats_op(FS_OP_CLONE, start, (result == 0) ? journal_commit() : result);
+}
+
+// Mirror the tree under `src` into the empty directory `dst`: directories
+// are made afresh, since their entries change independently, and files are
+// cloned. Earlier snapshots are skipped. Called with dir_lock held exclusive.
+static int snapshot_dir(dir_t *src, dir_t *dst) {
+    for (uint32_t slot = 0; slot < src->nslots; slot++) {
+        dir_entry_t entry;
+        if (dir_read_entry(src, slot, &entry) < 0) {
+            return -1;
+        }
+        if (entry.filename[0] == '\0' || (uint8_t)entry.filename[0] == INLINE_MARK ||
+            (entry.attribute & ATTR_SNAPSHOT)) {
+            continue;
+        }
+        if (!(entry.attribute & ATTR_DIRECTORY)) {
+            if (clone_entry(src, slot, dst, entry.filename) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        int copy_slot = add_locked(dst, entry.filename, ATTR_DIRECTORY);
+        dir_t *child = (copy_slot < 0) ? NULL : dir_open_child(src, slot);
+        dir_t *copy = child ? dir_open_child(dst, copy_slot) : NULL;
+        if (!copy || snapshot_dir(child, copy) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int fs_snapshot(const char *name) {
+    uint64_t start = stats_now();
+
+    // A snapshot is a directory in the root
+    while (name && *name == '/') {
+        name++;
+    }
+    if (!name || strlen(name) == 0 || strchr(name, '/')) {
+        log_error(FS_EINVAL, "fs_snapshot: Invalid snapshot name");
+        return stats_op(FS_OP_SNAPSHOT, start, -1);
+    }
+    if (superblock.ref_blocks == 0) {
+        log_error(FS_EVERSION, "fs_snapshot: the volume keeps no cluster reference counts");
+        return stats_op(FS_OP_SNAPSHOT, start, -1);
+    }
+
+    pthread_rwlock_wrlock(&dir_lock);
+    char snap_name[MAX_FILENAME_LENGTH];
+    dir_t *root = dir_resolve(name, snap_name);
+    int result = root ? 0 : -1;
+    if (result == 0 && dir_lookup(root, snap_name) != -1) {
+        result = log_error(FS_EEXIST, "fs_snapshot: '%s' already exists", name);
+    }
+    if (result == 0) {
+        int slot = add_locked(root, snap_name, ATTR_DIRECTORY | ATTR_SNAPSHOT);
+        dir_t *snap = (slot < 0) ? NULL : dir_open_child(root, slot);
+        result = snap ? snapshot_dir(root, snap) : -1;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Commit outside the lock so concurrent operations share one journal flush
+    if (result == 0) {
+        log_debug("fs_snapshot: snapshot '%s' taken", name);
+    }
+    return stats_op(FS_OP_SNAPSHOT, start, (result == 0) ? journal_commit() : result);
+}
+
+// Readahead after a read shorter than a block or a read view, which go
+// through the block cache. A read starting where the descriptor's previous
+// one ended is sequential; once such a reader gets within half a window of
+// the blocks already prefetched, the window doubles (up to RA_MAX_BLOCKS) and
+// the clusters of the next window are handed to cache_prefetch, which loads
+// them in the background. Any other read halves the window. Called with the
+// file's lock held shared after reading from `start` up to `end`.
+static void read_ahead(file_descriptor_t *descriptor, uint64_t start, uint64_t end_offset, uint64_t file_size) {
+    uint32_t next = end_offset / BLOCK_SIZE;
+    if (start != descriptor->ra_offset) {
+        descriptor->ra_window /= 2;
+        descriptor->ra_end = 0;
+        descriptor->ra_offset = end_offset;
+        return;
+    }
+    descriptor->ra_offset = end_offset;
+    if (descriptor->ra_end > next + descriptor->ra_window / 2) {
+        return;  // enough prefetched ahead of the reader
+    }
+
+    uint32_t window = descriptor->ra_window ? 2 * descriptor->ra_window : RA_MIN_BLOCKS;
+    descriptor->ra_window = (window < RA_MAX_BLOCKS) ? window : RA_MAX_BLOCKS;
+
+    uint32_t from = (descriptor->ra_end > next) ? descriptor->ra_end : next;
+    uint32_t end = next + descriptor->ra_window;
+    uint32_t file_blocks = (uint32_t)((file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (end > file_blocks) {
+        end = file_blocks;
+    }
+    if (from >= end) {
+        return;
+    }
+
+    // Walk the chain ahead, then put the cursor back where the read left it
+    int blocks[RA_MAX_BLOCKS];
+    int n = 0;
+    uint32_t cursor_block = descriptor->cursor_block;
+    uint32_t cursor_cluster = descriptor->cursor_cluster;
+    for (uint32_t b = from; b < end; b++) {
+        uint32_t cluster = cluster_at(descriptor, b / superblock.cluster_blocks, 0);
+        if (cluster == (uint32_t)-1) {
+            break;
+        }
+        blocks[n++] = file_block(cluster, b);
+    }
+    descriptor->cursor_block = cursor_block;
+    descriptor->cursor_cluster = cursor_cluster;
+
+    cache_prefetch(blocks, n);
+    descriptor->ra_end = end;
+}
+
+// Body of fs_read, called with the file's lock held shared.
+static int read_locked(file_descriptor_t *descriptor, void *buf, size_t count) {
+    // Locate the file and check the offset
+    open_file_t *file = &open_files[descriptor->file_index];
+    dir_entry_t *file_entry = &file->entry;
+    if (descriptor->offset >= file_entry->file_size) {
+        log_error(FS_EINVAL, "fs_read: offset beyond end of file");
         return 0;  // No more data to read
     }
 
@@ -444,110 +1467,402 @@ int fs_read(int fd, void *buf, size_t count) {
         bytes_to_read = file_entry->file_size - descriptor->offset;
     }
 
-    // Traverse the FAT to locate the starting cluster
-    uint16_t cluster = file_entry->starting_cluster;
-    size_t cluster_size = BLOCK_SIZE;
-    size_t cluster_offset = descriptor->offset / cluster_size;
-    size_t intra_cluster_offset = descriptor->offset % cluster_size;
+    // An inline file is all in memory
+    if (file_entry->attribute & ATTR_INLINE) {
+        memcpy(buf, file->idata + descriptor->offset, bytes_to_read);
+        descriptor->offset += bytes_to_read;
+        return (int)bytes_to_read;
+    }
 
-    // Move to the correct cluster based on offset
-    for (size_t i = 0; i < cluster_offset; i++) {
-        if (cluster == FAT_EOF || fat[cluster] == FAT_FREE) {
-            fprintf(stderr, "fs_read: corrupted FAT chain\n");
-            return -1;
-        }
-        cluster = fat[cluster];
+    // Bytes from wbuf_start on are still in the write buffer; copy them now
+    // and read the rest from the chain
+    size_t buffered = 0;
+    if (file->wbuf_len > 0 && descriptor->offset + bytes_to_read > file->wbuf_start) {
+        uint64_t from = (descriptor->offset > file->wbuf_start) ? descriptor->offset : file->wbuf_start;
+        buffered = descriptor->offset + bytes_to_read - from;
+        memcpy((char *)buf + (from - descriptor->offset), file->wbuf + (from - file->wbuf_start), buffered);
+        bytes_to_read -= buffered;
     }
 
-    // Read data from the file
-    char temp_buf[BLOCK_SIZE];
+    // Locate the starting block; its cluster comes from the descriptor's cursor
+    uint64_t start_offset = descriptor->offset;
+    size_t block_size = BLOCK_SIZE;
+    uint32_t block = (uint32_t)(descriptor->offset / block_size);
+    size_t intra_block_offset = descriptor->offset % block_size;
+
+    // Read data from the file through the block cache. Runs of whole blocks
+    // are queued and read with one batch, so they are in flight together.
     size_t bytes_read = 0;
+    disk_io_t runs[IO_BATCH_RUNS];
+    int nruns = 0;
 
     while (bytes_to_read > 0) {
-        if (block_read(superblock.data_start_block + cluster, temp_buf) < 0) {
-            fprintf(stderr, "fs_read: failed to read block %d\n", cluster);
+        uint32_t cluster = cluster_at(descriptor, block / superblock.cluster_blocks, 0);
+        if (cluster == (uint32_t)-1) {
+            log_error(FS_ECORRUPT, "fs_read: corrupted FAT chain");
             return -1;
         }
 
-        size_t bytes_in_cluster = cluster_size - intra_cluster_offset;
-        size_t bytes_to_copy = (bytes_to_read < bytes_in_cluster) ? bytes_to_read : bytes_in_cluster;
+        if (intra_block_offset == 0 && bytes_to_read >= block_size) {
+            // Whole blocks: queue each run of consecutive blocks as one transfer
+            uint32_t run = contiguous_run(descriptor, block, cluster, bytes_to_read / block_size, 0);
+            runs[nruns++] = (disk_io_t){ file_block(cluster, block), run, (char *)buf + bytes_read };
+            if (nruns == IO_BATCH_RUNS) {
+                if (cache_read_batch(runs, nruns) < 0) {
+                    log_error(FS_EIO, "fs_read: failed to read %d block runs", nruns);
+                    return -1;
+                }
+                nruns = 0;
+            }
+
+            bytes_read += run * block_size;
+            bytes_to_read -= run * block_size;
+            block += run;
+            continue;
+        }
+
+        char *page = cache_get(file_block(cluster, block), 0);
+        if (!page) {
+            log_error(FS_EIO, "fs_read: failed to read block %u", file_block(cluster, block));
+            return -1;
+        }
 
-        memcpy((char *)buf + bytes_read, temp_buf + intra_cluster_offset, bytes_to_copy);
+        size_t bytes_in_block = block_size - intra_block_offset;
+        size_t bytes_to_copy = (bytes_to_read < bytes_in_block) ? bytes_to_read : bytes_in_block;
+
+        memcpy((char *)buf + bytes_read, page + intra_block_offset, bytes_to_copy);
+        cache_put(page, 0);
 
         bytes_read += bytes_to_copy;
         bytes_to_read -= bytes_to_copy;
 
-        intra_cluster_offset = 0;  // Only the first cluster read has an offset
+        intra_block_offset = 0;  // Only the first block read has an offset
+        block++;
+    }
 
-        // Move to the next cluster if necessary
-        if (bytes_to_read > 0) {
-            if (fat[cluster] == FAT_EOF) {
-                break;  // No more clusters in the chain
-            }
-            cluster = fat[cluster];
-        }
+    if (nruns > 0 && cache_read_batch(runs, nruns) < 0) {
+        log_error(FS_EIO, "fs_read: failed to read %d block runs", nruns);
+        return -1;
     }
 
     // Update the file descriptor offset
+    bytes_read += buffered;
     descriptor->offset += bytes_read;
 
+    if (count < BLOCK_SIZE) {
+        read_ahead(descriptor, start_offset, descriptor->offset, file_entry->file_size);
+    }
+
     return bytes_read;  // Return the number of bytes read
 }
 
+int fs_read(int fd, void *buf, size_t count) {
+    uint64_t start = stats_now();
 
-int fs_write(int fd, const void *buf, size_t count) {
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !file_descriptors[fd].in_use) {
-        fprintf(stderr, "fs_write: Invalid file descriptor.\n");
+    // Validate inputs
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_read: invalid file descriptor %d", fd);
+        return stats_op(FS_OP_READ, start, -1);
+    }
+    if (!buf || count == 0) {
+        log_error(FS_EINVAL, "fs_read: invalid buffer or count");
+        return stats_op(FS_OP_READ, start, -1);
+    }
+
+    // Hold the file's lock shared so other readers proceed in parallel
+    file_descriptor_t *descriptor = &file_descriptors[fd];
+    pthread_rwlock_t *lock = &open_files[descriptor->file_index].lock;
+    pthread_rwlock_rdlock(lock);
+    int result = read_locked(descriptor, buf, count);
+    pthread_rwlock_unlock(lock);
+    log_trace(TRACE_READ, fd, result);
+    return stats_op(FS_OP_READ, start, result);
+}
+
+// Body of fs_read_view, called with the file's lock held. Pins the cache
+// page of each block in the range, up to VIEW_MAX_BLOCKS, and points a span
+// at the requested part of it; spans that follow each other in memory (the
+// mapped disk) are merged. The blocks missing from the cache are queued with
+// cache_prefetch first, so they are read with one batch rather than one
+// request each.
+static int view_locked(file_descriptor_t *descriptor, uint64_t offset, size_t len, fs_view_t *view) {
+    open_file_t *file = &open_files[descriptor->file_index];
+    uint64_t file_size = file->entry.file_size;
+    if (offset >= file_size) {
+        return 0;  // End of file
+    }
+    if (len > file_size - offset) {
+        len = (size_t)(file_size - offset);
+    }
+
+    int blocks[VIEW_MAX_BLOCKS];
+    int n = 0;
+    for (uint64_t pos = offset - offset % BLOCK_SIZE; pos < offset + len && n < VIEW_MAX_BLOCKS; pos += BLOCK_SIZE) {
+        uint32_t block = (uint32_t)(pos / BLOCK_SIZE);
+        uint32_t cluster = cluster_at(descriptor, block / superblock.cluster_blocks, 0);
+        if (cluster == (uint32_t)-1) {
+            return log_error(FS_ECORRUPT, "fs_read_view: corrupted FAT chain");
+        }
+        blocks[n++] = file_block(cluster, block);
+    }
+    cache_prefetch(blocks, n);
+
+    uint64_t pos = offset;
+    for (int i = 0; i < n; i++) {
+        char *page = cache_get(blocks[i], 0);
+        if (!page) {
+            fs_release_view(view);
+            return log_error(FS_EIO, "fs_read_view: failed to read block %d", blocks[i]);
+        }
+        view->pages[view->npages++] = page;
+
+        size_t in_block = pos % BLOCK_SIZE;
+        size_t bytes = (len < BLOCK_SIZE - in_block) ? len : BLOCK_SIZE - in_block;
+        fs_span_t *last = view->count ? &view->spans[view->count - 1] : NULL;
+        if (last && last->data + last->len == page + in_block) {
+            last->len += bytes;
+        } else {
+            view->spans[view->count++] = (fs_span_t){ page + in_block, bytes };
+        }
+        view->bytes += bytes;
+        pos += bytes;
+        len -= bytes;
+    }
+
+    read_ahead(descriptor, offset, pos, file_size);
+    return (int)view->bytes;
+}
+
+// Return read-only references to up to `len` bytes of the file at `offset`
+// in `view`, without copying them: the spans point into block cache pages,
+// which stay pinned until fs_release_view. A view covers at most
+// VIEW_MAX_BLOCKS blocks, so it may be shorter than asked, like a short
+// read. The descriptor's offset does not move. A view shows the cached
+// blocks themselves, so a later write to the range shows through it.
+// Returns the bytes covered, 0 at end of file.
+int fs_read_view(int fd, size_t offset, size_t len, fs_view_t *view) {
+    uint64_t start = stats_now();
+
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_read_view: invalid file descriptor %d", fd);
+        return stats_op(FS_OP_READ_VIEW, start, -1);
+    }
+    if (!view || len == 0) {
+        log_error(FS_EINVAL, "fs_read_view: invalid view or length");
+        return stats_op(FS_OP_READ_VIEW, start, -1);
+    }
+    memset(view, 0, sizeof(fs_view_t));
+
+    // Appends still in the write buffer have no cache pages, and the buffer
+    // changes after the lock is dropped; a view reaching them flushes it. An
+    // inline file has none either, so it moves to clusters first.
+    file_descriptor_t *descriptor = &file_descriptors[fd];
+    open_file_t *file = &open_files[descriptor->file_index];
+    pthread_rwlock_rdlock(&file->lock);
+    if ((file->entry.attribute & ATTR_INLINE) || (file->wbuf_len > 0 && offset + len > file->wbuf_start)) {
+        pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_wrlock(&file->lock);
+        if (((file->entry.attribute & ATTR_INLINE) && promote(file, NULL) < 0) ||
+            flush_write_buffer(file, NULL) < 0) {
+            pthread_rwlock_unlock(&file->lock);
+            return stats_op(FS_OP_READ_VIEW, start, -1);
+        }
+    }
+    int result = view_locked(descriptor, offset, len, view);
+    pthread_rwlock_unlock(&file->lock);
+    log_trace(TRACE_VIEW, fd, result);
+    return stats_op(FS_OP_READ_VIEW, start, result);
+}
+
+// Unpin the pages of a view returned by fs_read_view and empty it.
+int fs_release_view(fs_view_t *view) {
+    if (!view) {
+        return log_error(FS_EINVAL, "fs_release_view: invalid view");
+    }
+    for (int i = 0; i < view->npages; i++) {
+        cache_put(view->pages[i], 0);
+    }
+    memset(view, 0, sizeof(fs_view_t));
+    return 0;
+}
+
+// Copy cluster `from` to cluster `to` on disk through `buf`, a cluster in
+// size. The cache writes back its newer copies of `from` first and keeps
+// its copies of `to` in step.
+static int copy_cluster(uint32_t from, uint32_t to, char *buf) {
+    if (cache_read_direct(CLUSTER_BLOCK(from), superblock.cluster_blocks, buf) < 0 ||
+        cache_write_direct(CLUSTER_BLOCK(to), superblock.cluster_blocks, buf) < 0) {
+        return log_error(FS_EIO, "fs_write: failed to copy cluster %u", from);
+    }
+    return 0;
+}
+
+// Give the file its own copy of the clusters at chain indexes 0..`index`
+// before they change. From the first cluster with more than one reference
+// on, the chain is shared with a clone. When that is the cluster at `index`,
+// only it is copied: the cluster before it (or the entry) is pointed at the
+// copy, the copy at the next cluster, which gains a reference, and the
+// original loses the file's. A shared cluster before `index` cannot be
+// re-linked that way, since its next pointer belongs to every chain through
+// it, so it and each cluster after it up to `index` are copied into a new
+// chain, linked in the same way. A cluster that cannot take another
+// reference is copied as well. The copies are on disk before the chain is
+// linked to them, and a new starting cluster only reaches the disk with the
+// entry, so the one it replaces is released by write_back. Called with the
+// file's lock held exclusive.
+static int unshare(open_file_t *file, uint32_t index) {
+    if (index < file->shared_from) {
+        return 0;
+    }
+
+    // Find the first shared cluster
+    uint32_t prev = FAT_EOF;
+    uint32_t cluster = file->entry.starting_cluster;
+    uint32_t pos = 0;
+    uint32_t refs = 1;
+    while (pos <= index && cluster < superblock.data_clusters_count && (refs = fat_refs(cluster)) == 1) {
+        prev = cluster;
+        cluster = fat_get(cluster);
+        pos++;
+    }
+    stats_add(STAT_FAT_STEPS, pos);
+    if (cluster == FAT_ERROR || refs == FAT_ERROR) {
         return -1;
     }
+    if (cluster == FAT_EOF) {
+        file->shared_from = UINT32_MAX;
+        file->entry.attribute &= ~ATTR_SHARED;
+        file->dirty = 1;
+        return 0;
+    }
+    if (pos > index) {
+        file->shared_from = pos;
+        return 0;
+    }
 
-    if (!buf || count == 0) {
-        fprintf(stderr, "fs_write: Invalid buffer or count.\n");
+    // Copy it and the clusters after it, up to `index`, into a new chain
+    char *buf = (char *)malloc(CLUSTER_SIZE);
+    if (!buf) {
+        return log_error(FS_ENOMEM, "fs_write: failed to allocate copy buffer");
+    }
+    uint32_t shared = cluster;
+    uint32_t first = FAT_EOF;
+    uint32_t last = FAT_EOF;
+    uint32_t copied = 0;
+    int ref = 0;
+    while (cluster != FAT_EOF &&
+           (pos <= index || cluster >= superblock.data_clusters_count || (ref = alloc_ref(cluster)) > 0)) {
+        uint32_t copy = (cluster < superblock.data_clusters_count) ? alloc_block() : ALLOC_NONE;
+        if (copy == ALLOC_NONE || copy_cluster(cluster, copy, buf) < 0) {
+            if (copy == ALLOC_NONE) {
+                log_error(cluster < superblock.data_clusters_count ? FS_ENOSPC : FS_ECORRUPT,
+                          "fs_write: no cluster to copy shared cluster %u to", cluster);
+            } else {
+                alloc_free(copy);
+            }
+            alloc_release(first);
+            free(buf);
+            return -1;
+        }
+        if (last == FAT_EOF) {
+            first = copy;
+        } else if (journal_fat(last, copy) < 0) {
+            alloc_free(copy);
+            alloc_release(first);
+            free(buf);
+            return -1;
+        }
+        last = copy;
+        cluster = fat_get(cluster);
+        if (cluster == FAT_ERROR) {
+            alloc_release(first);
+            free(buf);
+            return -1;
+        }
+        pos++;
+        copied++;
+    }
+    free(buf);
+    if (ref < 0) {
+        alloc_release(first);
+        return -1;
+    }
+    if (cluster != FAT_EOF && journal_fat(last, cluster) < 0) {
+        alloc_release(cluster);  // the reference taken for the copy
+        alloc_release(first);
+        return -1;
+    }
+    if (sync_disk() < 0) {
+        alloc_release(first);
         return -1;
     }
 
-    int file_index = file_descriptors[fd].file_index;
-    uint32_t offset = file_descriptors[fd].offset;
+    // Link the copy in place of the shared part
+    if (prev != FAT_EOF) {
+        if (journal_fat(prev, first) < 0) {
+            alloc_release(first);
+            return -1;
+        }
+        alloc_release(shared);
+    } else {
+        if (file->replaced == FAT_EOF) {
+            file->replaced = shared;
+        } else {
+            alloc_release(shared);
+        }
+        file->entry.starting_cluster = first;
+        file->dirty = 1;
+    }
+    file->shared_from = (cluster == FAT_EOF) ? UINT32_MAX : pos;
+    if (cluster == FAT_EOF) {
+        file->entry.attribute &= ~ATTR_SHARED;
+    }
+    reset_file_cursors(file);
+    log_trace(TRACE_UNSHARE, first, copied);
+    return 0;
+}
+
+// Write `count` bytes at the descriptor's offset into the file's chain,
+// extending it as needed. Called with the file's lock held exclusive.
+static int write_through(file_descriptor_t *descriptor, const void *buf, size_t count) {
+    open_file_t *file = &open_files[descriptor->file_index];
+    dir_entry_t *file_entry = &file->entry;
+    uint64_t offset = descriptor->offset;
     const char *buffer = (const char *)buf;
     size_t bytes_written = 0;
 
-    printf("fs_write: Starting write for file '%s', offset %u, count %zu.\n",
-           root_directory.entries[file_index].filename, offset, count);
+    log_debug("fs_write: Starting write for file '%s', offset %llu, count %zu.",
+           file_entry->filename, (unsigned long long)offset, count);
 
     // Determine the starting cluster
-    uint32_t current_cluster = root_directory.entries[file_index].starting_cluster;
+    uint32_t current_cluster = file_entry->starting_cluster;
     if (current_cluster == FAT_FREE) {
-        current_cluster = find_free_block();
-        if (current_cluster == (uint32_t)-1) {
-            fprintf(stderr, "fs_write: No free blocks available.\n");
+        current_cluster = alloc_block();
+        if (current_cluster == ALLOC_NONE) {
+            log_error(FS_ENOSPC, "fs_write: No free blocks available.");
             return -1;
         }
-        root_directory.entries[file_index].starting_cluster = current_cluster;
-        fat[current_cluster] = FAT_EOF;
-        superblock.free_blocks_count--;  // Decrement free block count
+        file_entry->starting_cluster = current_cluster;
+        file->dirty = 1;
     }
 
-    // Traverse clusters to reach the write offset
-    while (offset >= BLOCK_SIZE) {
-        if (fat[current_cluster] == FAT_EOF) {
-            uint32_t new_block = find_free_block();
-            if (new_block == (uint32_t)-1) {
-                fprintf(stderr, "fs_write: No free blocks available.\n");
-                return -1;
-            }
-            fat[current_cluster] = new_block;
-            fat[new_block] = FAT_EOF;
-            superblock.free_blocks_count--;  // Decrement free block count
-        }
-        current_cluster = fat[current_cluster];
-        offset -= BLOCK_SIZE;
+    // Clusters shared with a clone are copied before they change
+    if (unshare(file, (uint32_t)((offset + count - 1) / CLUSTER_SIZE)) < 0) {
+        return -1;
     }
 
-    // Write data into clusters
+    // Write data into clusters through the block cache, extending the chain as
+    // needed. Runs of whole blocks are queued and written with one batch.
+    uint32_t block = (uint32_t)(offset / BLOCK_SIZE);
+    offset %= BLOCK_SIZE;
+    disk_io_t runs[IO_BATCH_RUNS];
+    int nruns = 0;
+
     while (bytes_written < count) {
-        char block_buf[BLOCK_SIZE];
-        if (block_read(superblock.data_start_block + current_cluster, block_buf) < 0) {
-            fprintf(stderr, "fs_write: Failed to read block %u.\n", current_cluster);
+        current_cluster = cluster_at(descriptor, block / superblock.cluster_blocks, 1);
+        if (current_cluster == (uint32_t)-1) {
+            // cluster_at recorded why: no space or a corrupted chain
+            log_error(fs_errno(), "fs_write: Failed to extend file.");
             return -1;
         }
 
@@ -556,140 +1871,712 @@ int fs_write(int fd, const void *buf, size_t count) {
             write_size = count - bytes_written;
         }
 
-        memcpy(block_buf + offset, buffer + bytes_written, write_size);
+        if (write_size == BLOCK_SIZE) {
+            // Whole blocks: queue each run of consecutive blocks as one transfer
+            // straight from the caller's buffer, no read
+            uint32_t run = contiguous_run(descriptor, block, current_cluster,
+                                          (count - bytes_written) / BLOCK_SIZE, 1);
+            runs[nruns++] = (disk_io_t){ file_block(current_cluster, block), run,
+                                         (char *)buffer + bytes_written };
+            if (nruns == IO_BATCH_RUNS) {
+                if (cache_write_batch(runs, nruns) < 0) {
+                    log_error(FS_EIO, "fs_write: Failed to write %d block runs.", nruns);
+                    return -1;
+                }
+                nruns = 0;
+            }
+            write_size = (size_t)run * BLOCK_SIZE;
+            block += run - 1;
+        } else {
+            // A block at or past end of file holds no data yet, so skip the read and zero it
+            int fresh = (uint64_t)block * BLOCK_SIZE >= file_entry->file_size;
+            char *page = cache_get(file_block(current_cluster, block), fresh ? CACHE_NOREAD : 0);
+            if (!page) {
+                log_error(FS_EIO, "fs_write: Failed to read block %u.", file_block(current_cluster, block));
+                return -1;
+            }
+            if (fresh) {
+                memset(page, 0, BLOCK_SIZE);
+            }
 
-        if (block_write(superblock.data_start_block + current_cluster, block_buf) < 0) {
-            fprintf(stderr, "fs_write: Failed to write block %u.\n", current_cluster);
-            return -1;
+            memcpy(page + offset, buffer + bytes_written, write_size);
+            cache_put(page, 1);
         }
 
         bytes_written += write_size;
         offset = 0;
+        block++;
+    }
 
-        if (bytes_written < count) {
-            if (fat[current_cluster] == FAT_EOF) {
-                uint32_t new_block = find_free_block();
-                if (new_block == (uint32_t)-1) {
-                    fprintf(stderr, "fs_write: No free blocks available.\n");
-                    return -1;
-                }
-                fat[current_cluster] = new_block;
-                fat[new_block] = FAT_EOF;
-                superblock.free_blocks_count--;  // Decrement free block count
-            }
-            current_cluster = fat[current_cluster];
-        }
+    if (nruns > 0 && cache_write_batch(runs, nruns) < 0) {
+        log_error(FS_EIO, "fs_write: Failed to write %d block runs.", nruns);
+        return -1;
     }
 
     // Update the file descriptor offset
-    file_descriptors[fd].offset += bytes_written;
+    descriptor->offset += bytes_written;
 
     // Update the file size if the offset extends it
-    if (file_descriptors[fd].offset > root_directory.entries[file_index].file_size) {
-        root_directory.entries[file_index].file_size = file_descriptors[fd].offset;
+    if (descriptor->offset > file_entry->file_size) {
+        file_entry->file_size = descriptor->offset;
+        file->dirty = 1;
     }
 
-    printf("fs_write: Completed write for file '%s', total bytes written: %zu.\n",
-           root_directory.entries[file_index].filename, bytes_written);
+    log_debug("fs_write: Completed write for file '%s', total bytes written: %zu.",
+           file_entry->filename, bytes_written);
 
     return bytes_written;
 }
 
+// Extend the file's chain to cover its first `end` bytes, of which the first
+// `covered` are known to be in the chain. The clusters missing past the end
+// of the chain are allocated as one contiguous run when the allocator has
+// one; otherwise the caller's write extends the chain a cluster at a time.
+// The last cluster's FAT entry changes, so it must not be shared. Called
+// with the file's lock held exclusive.
+static int grow_chain(open_file_t *file, file_descriptor_t *descriptor, uint64_t covered, uint64_t end) {
+    // Find the end of the chain
+    uint32_t need = (uint32_t)((end + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    uint32_t have = 0;
+    uint32_t last = FAT_FREE;
+    if (file->entry.starting_cluster != FAT_FREE) {
+        have = (uint32_t)((covered + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+        have = have ? have : 1;
+        last = cluster_at(descriptor, have - 1, 0);
+        if (last == (uint32_t)-1) {
+            log_error(FS_ECORRUPT, "grow_chain: corrupted FAT chain");
+            return -1;
+        }
+        uint32_t steps = 0;
+        uint32_t next;
+        while (have < need && (next = fat_get(last)) < superblock.data_clusters_count) {
+            last = next;
+            have++;
+            steps++;
+        }
+        stats_add(STAT_FAT_STEPS, steps);
+        if (have < need && next != FAT_EOF) {
+            if (next != FAT_ERROR) {
+                log_error(FS_ECORRUPT, "grow_chain: corrupted FAT chain at cluster %u", last);
+            }
+            return -1;
+        }
+    }
 
-int fs_get_filesize(int fd) {
-    // Validate file descriptor
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !file_descriptors[fd].in_use) {
-        fprintf(stderr, "fs_get_filesize: invalid file descriptor %d\n", fd);
+    // Allocate the rest as one extent, linked in after the run is complete
+    // so a crash in between only leaks it
+    if (need > have) {
+        uint32_t first = alloc_run(need - have);
+        if (first != ALLOC_NONE && last == FAT_FREE) {
+            file->entry.starting_cluster = first;
+            file->dirty = 1;
+        } else if (first != ALLOC_NONE && journal_fat(last, first) < 0) {
+            alloc_release(first);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write the file's buffered appends into its chain, after allocating the
+// clusters they need as one run (grow_chain). `descriptor` lends its chain
+// cursor and may be NULL. Called with the file's lock held exclusive.
+static int flush_write_buffer(open_file_t *file, file_descriptor_t *descriptor) {
+    if (file->wbuf_len == 0) {
+        return 0;
+    }
+
+    file_descriptor_t scratch;
+    if (!descriptor) {
+        scratch.file_index = (int)(file - open_files);
+        reset_cursor(&scratch);
+        scratch.cursor_generation = file->chain_generation;
+        descriptor = &scratch;
+    }
+
+    // The chain covers at least the bytes before wbuf_start
+    uint64_t end = file->wbuf_start + file->wbuf_len;
+    if (unshare(file, (uint32_t)((end - 1) / CLUSTER_SIZE)) < 0 ||
+        grow_chain(file, descriptor, file->wbuf_start, end) < 0) {
+        return -1;
+    }
+
+    // Nothing is buffered from here on, so the write goes to the chain. The
+    // size drops to what the chain holds meanwhile, so blocks past it are
+    // known to be new and are not read first; the write restores it.
+    uint32_t len = file->wbuf_len;
+    uint64_t offset = descriptor->offset;
+    log_trace(TRACE_FLUSH, file->wbuf_start, len);
+    file->wbuf_len = 0;
+    file->entry.file_size = file->wbuf_start;
+    descriptor->offset = file->wbuf_start;
+    int written = write_through(descriptor, file->wbuf, len);
+    descriptor->offset = offset;
+    return (written == (int)len) ? 0 : -1;
+}
+
+// Move an inline file's bytes to a cluster chain: into the write buffer if
+// there is one, so the chain is allocated when it is flushed, or else to
+// new clusters. The data slots are released by write_back, with the entry
+// that stops referring to them. `descriptor` lends its chain cursor and may
+// be NULL. Called with the file's lock held exclusive.
+static int promote(open_file_t *file, file_descriptor_t *descriptor) {
+    uint32_t size = (uint32_t)file->entry.file_size;
+    if (size > 0 && size < write_buffer_size && !file->wbuf) {
+        file->wbuf = (char *)malloc(write_buffer_size);
+    }
+    if (size > 0 && size < write_buffer_size && file->wbuf) {
+        memcpy(file->wbuf, file->idata, size);
+        file->wbuf_start = 0;
+        file->wbuf_len = size;
+    } else if (size > 0) {
+        file_descriptor_t scratch;
+        if (!descriptor) {
+            scratch.file_index = (int)(file - open_files);
+            reset_cursor(&scratch);
+            scratch.cursor_generation = file->chain_generation;
+            descriptor = &scratch;
+        }
+
+        // As in flush_write_buffer, the size starts from what the chain holds
+        uint64_t offset = descriptor->offset;
+        file->entry.file_size = 0;
+        descriptor->offset = 0;
+        int written = write_through(descriptor, file->idata, size);
+        descriptor->offset = offset;
+        if (written != (int)size) {
+            free_chain(file->entry.starting_cluster);
+            file->entry.starting_cluster = FAT_FREE;
+            file->entry.file_size = size;
+            return -1;
+        }
+    }
+
+    log_trace(TRACE_PROMOTE, size, file->inline_held);
+    file->entry.attribute &= ~ATTR_INLINE;
+    file->dirty = 1;
+    file->inline_dirty = 0;
+    free(file->idata);
+    file->idata = NULL;
+    reset_file_cursors(file);
+    return 0;
+}
+
+// Body of fs_write, called with the file's lock held exclusive. A write an
+// inline file can hold only goes to its bytes in memory, and an append that
+// fits in the write buffer is only copied there.
+static int write_locked(file_descriptor_t *descriptor, const void *buf, size_t count) {
+    open_file_t *file = &open_files[descriptor->file_index];
+    if (file->entry.attribute & ATTR_INLINE) {
+        if (descriptor->offset + count <= INLINE_MAX) {
+            memcpy(file->idata + descriptor->offset, buf, count);
+            descriptor->offset += count;
+            if (descriptor->offset > file->entry.file_size) {
+                file->entry.file_size = descriptor->offset;
+            }
+            file->inline_dirty = 1;
+            file->dirty = 1;
+            return (int)count;
+        }
+        if (promote(file, descriptor) < 0) {
+            return -1;
+        }
+    }
+
+    int append = descriptor->offset == file->entry.file_size;
+
+    if (append && count < write_buffer_size) {
+        if (file->wbuf_len + count > write_buffer_size && flush_write_buffer(file, descriptor) < 0) {
+            return -1;
+        }
+        if (!file->wbuf) {
+            file->wbuf = (char *)malloc(write_buffer_size);
+        }
+        if (file->wbuf) {
+            if (file->wbuf_len == 0) {
+                file->wbuf_start = descriptor->offset;
+            }
+            memcpy(file->wbuf + file->wbuf_len, buf, count);
+            file->wbuf_len += count;
+            descriptor->offset += count;
+            file->entry.file_size = descriptor->offset;
+            file->dirty = 1;
+            return (int)count;
+        }
+    }
+
+    // Anything else writes the buffered appends out first
+    if (flush_write_buffer(file, descriptor) < 0) {
+        return -1;
+    }
+    return write_through(descriptor, buf, count);
+}
+
+int fs_write(int fd, const void *buf, size_t count) {
+    uint64_t start = stats_now();
+
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_write: Invalid file descriptor.");
+        return stats_op(FS_OP_WRITE, start, -1);
+    }
+
+    if (!buf || count == 0) {
+        log_error(FS_EINVAL, "fs_write: Invalid buffer or count.");
+        return stats_op(FS_OP_WRITE, start, -1);
+    }
+
+    // Hold the file's lock exclusive while the chain and size change
+    file_descriptor_t *descriptor = &file_descriptors[fd];
+    pthread_rwlock_t *lock = &open_files[descriptor->file_index].lock;
+    pthread_rwlock_wrlock(lock);
+    int result = write_locked(descriptor, buf, count);
+    pthread_rwlock_unlock(lock);
+    log_trace(TRACE_WRITE, fd, result);
+    return stats_op(FS_OP_WRITE, start, result);
+}
+
+// Copy `len` bytes of the source descriptor's file chain at `src_pos` into
+// the destination's chain at `dst_pos`; the descriptors lend their chain
+// cursors. Runs of whole blocks that are consecutive on disk in both files
+// are copied inside the disk (cache_copy_direct). Anything else goes from
+// cache page to cache page, one destination block at a time, so a block is
+// only read first when the copy keeps part of its data. Called with the
+// destination's lock held exclusive and the source's held.
+static int copy_chain(file_descriptor_t *src, uint64_t src_pos, file_descriptor_t *dst, uint64_t dst_pos,
+                      uint64_t len) {
+    open_file_t *file = &open_files[dst->file_index];
+    uint32_t cluster_blocks = superblock.cluster_blocks;
+
+    while (len > 0) {
+        uint32_t src_block = (uint32_t)(src_pos / BLOCK_SIZE);
+        uint32_t dst_block = (uint32_t)(dst_pos / BLOCK_SIZE);
+        uint32_t src_cluster = cluster_at(src, src_block / cluster_blocks, 0);
+        uint32_t dst_cluster = cluster_at(dst, dst_block / cluster_blocks, 1);
+        if (src_cluster == (uint32_t)-1) {
+            return log_error(FS_ECORRUPT, "fs_copy_range: corrupted FAT chain");
+        }
+        if (dst_cluster == (uint32_t)-1) {
+            // cluster_at recorded why: no space or a corrupted chain
+            return log_error(fs_errno(), "fs_copy_range: failed to extend file");
+        }
+
+        if (src_pos % BLOCK_SIZE == 0 && dst_pos % BLOCK_SIZE == 0 && len >= BLOCK_SIZE) {
+            // Whole blocks: copy the run both files have on consecutive blocks
+            uint32_t run = contiguous_run(src, src_block, src_cluster, (uint32_t)(len / BLOCK_SIZE), 0);
+            run = contiguous_run(dst, dst_block, dst_cluster, run, 1);
+            if (cache_copy_direct(file_block(src_cluster, src_block), file_block(dst_cluster, dst_block), run) < 0) {
+                return log_error(FS_EIO, "fs_copy_range: failed to copy %u blocks", run);
+            }
+            src_pos += (uint64_t)run * BLOCK_SIZE;
+            dst_pos += (uint64_t)run * BLOCK_SIZE;
+            len -= (uint64_t)run * BLOCK_SIZE;
+            continue;
+        }
+
+        // One destination block, filled from one or two source blocks. A
+        // block the copy covers, or one at or past end of file, is not read.
+        size_t dst_in = dst_pos % BLOCK_SIZE;
+        size_t fill = (len < BLOCK_SIZE - dst_in) ? (size_t)len : BLOCK_SIZE - dst_in;
+        int whole = fill == BLOCK_SIZE;
+        int fresh = (uint64_t)dst_block * BLOCK_SIZE >= file->entry.file_size;
+        char *page = cache_get(file_block(dst_cluster, dst_block), (whole || fresh) ? CACHE_NOREAD : 0);
+        if (!page) {
+            return log_error(FS_EIO, "fs_copy_range: failed to read block %u", file_block(dst_cluster, dst_block));
+        }
+        if (fresh && !whole) {
+            memset(page, 0, BLOCK_SIZE);
+        }
+        for (size_t done = 0; done < fill;) {
+            src_block = (uint32_t)(src_pos / BLOCK_SIZE);
+            src_cluster = cluster_at(src, src_block / cluster_blocks, 0);
+            char *from = (src_cluster == (uint32_t)-1) ? NULL : cache_get(file_block(src_cluster, src_block), 0);
+            if (!from) {
+                cache_put(page, 1);
+                return log_error(FS_EIO, "fs_copy_range: failed to read source block %u", src_block);
+            }
+            size_t src_in = src_pos % BLOCK_SIZE;
+            size_t n = (fill - done < BLOCK_SIZE - src_in) ? fill - done : BLOCK_SIZE - src_in;
+            memcpy(page + dst_in + done, from + src_in, n);
+            cache_put(from, 0);
+            done += n;
+            src_pos += n;
+        }
+        cache_put(page, 1);
+        dst_pos += fill;
+        len -= fill;
+    }
+    return 0;
+}
+
+// Body of fs_copy_range, called with the destination file's lock held
+// exclusive and the source's held.
+static int copy_range_locked(file_descriptor_t *src, uint64_t src_off, file_descriptor_t *dst, uint64_t dst_off,
+                             size_t len) {
+    open_file_t *in = &open_files[src->file_index];
+    open_file_t *out = &open_files[dst->file_index];
+    if (dst_off > out->entry.file_size) {
+        log_error(FS_EINVAL, "fs_copy_range: destination offset beyond end of file");
         return -1;
     }
+    if (src_off >= in->entry.file_size) {
+        return 0;  // Nothing to copy
+    }
+    if (len > in->entry.file_size - src_off) {
+        len = (size_t)(in->entry.file_size - src_off);
+    }
+    if (in == out && src_off < dst_off + len && dst_off < src_off + len) {
+        log_error(FS_EINVAL, "fs_copy_range: source and destination ranges overlap");
+        return -1;
+    }
+
+    // An inline destination that stays small takes the bytes with a read;
+    // a larger one moves to clusters first
+    if (out->entry.attribute & ATTR_INLINE) {
+        if (dst_off + len <= INLINE_MAX) {
+            uint64_t offset = src->offset;
+            src->offset = src_off;
+            int copied = read_locked(src, out->idata + dst_off, len);
+            src->offset = offset;
+            if (copied != (int)len) {
+                return -1;
+            }
+            if (dst_off + len > out->entry.file_size) {
+                out->entry.file_size = dst_off + len;
+            }
+            out->inline_dirty = 1;
+            out->dirty = 1;
+            return (int)len;
+        }
+        if (promote(out, dst) < 0) {
+            return -1;
+        }
+    }
+
+    // The destination's buffered appends go to its chain first. Bytes of the
+    // source from wbuf_start on are still in its write buffer, and an inline
+    // source's are all in memory; they are written from there after the rest
+    // is copied.
+    if (flush_write_buffer(out, dst) < 0) {
+        return -1;
+    }
+    uint64_t chain_len = len;
+    const char *held = NULL;  // source bytes from src_off + chain_len on
+    if (in->entry.attribute & ATTR_INLINE) {
+        chain_len = 0;
+        held = in->idata + src_off;
+    } else if (in->wbuf_len > 0 && src_off + len > in->wbuf_start) {
+        chain_len = (in->wbuf_start > src_off) ? in->wbuf_start - src_off : 0;
+        held = in->wbuf + (src_off + chain_len - in->wbuf_start);
+    }
+
+    // Copy clusters shared with a clone, then allocate the clusters the copy
+    // adds as one extent
+    uint64_t end = dst_off + len;
+    if (out->entry.starting_cluster == FAT_FREE) {
+        uint32_t cluster = alloc_block();
+        if (cluster == ALLOC_NONE) {
+            log_error(FS_ENOSPC, "fs_copy_range: No free blocks available.");
+            return -1;
+        }
+        out->entry.starting_cluster = cluster;
+        out->dirty = 1;
+    }
+    if (unshare(out, (uint32_t)((end - 1) / CLUSTER_SIZE)) < 0 ||
+        (end > out->entry.file_size && grow_chain(out, dst, out->entry.file_size, end) < 0)) {
+        return -1;
+    }
+
+    if (chain_len > 0 && copy_chain(src, src_off, dst, dst_off, chain_len) < 0) {
+        return -1;
+    }
+    if (dst_off + chain_len > out->entry.file_size) {
+        out->entry.file_size = dst_off + chain_len;
+        out->dirty = 1;
+    }
+    if (chain_len < len) {
+        uint64_t offset = dst->offset;
+        dst->offset = dst_off + chain_len;
+        int written = write_through(dst, held, len - chain_len);
+        dst->offset = offset;
+        if (written != (int)(len - chain_len)) {
+            return -1;
+        }
+    }
+    return (int)len;
+}
+
+// Copy up to `len` bytes from offset `src_off` of one open file to offset
+// `dst_off` of another, or of the same one if the ranges do not overlap,
+// without passing the data through a caller's buffer. The destination offset
+// may be at most its file size; the copy stops at the source's end of file.
+// The descriptors' offsets do not change. Returns the bytes copied.
+int fs_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len) {
+    uint64_t start = stats_now();
+
+    if (!fd_valid(src_fd) || !fd_valid(dst_fd)) {
+        log_error(FS_EBADF, "fs_copy_range: invalid file descriptor");
+        return stats_op(FS_OP_COPY_RANGE, start, -1);
+    }
+    if (len == 0) {
+        log_error(FS_EINVAL, "fs_copy_range: invalid length");
+        return stats_op(FS_OP_COPY_RANGE, start, -1);
+    }
+    if (len > INT_MAX) {
+        len = INT_MAX;  // the count has to fit the result
+    }
+
+    // Lock the two files in the order of their slots; the source is only read
+    file_descriptor_t *src = &file_descriptors[src_fd];
+    file_descriptor_t *dst = &file_descriptors[dst_fd];
+    open_file_t *in = &open_files[src->file_index];
+    open_file_t *out = &open_files[dst->file_index];
+    if (in < out) {
+        pthread_rwlock_rdlock(&in->lock);
+    }
+    pthread_rwlock_wrlock(&out->lock);
+    if (in > out) {
+        pthread_rwlock_rdlock(&in->lock);
+    }
+    int result = copy_range_locked(src, src_off, dst, dst_off, len);
+    if (in != out) {
+        pthread_rwlock_unlock(&in->lock);
+    }
+    pthread_rwlock_unlock(&out->lock);
+    log_trace(TRACE_COPY, dst_fd, result);
+    return stats_op(FS_OP_COPY_RANGE, start, result);
+}
+
+int64_t fs_get_filesize(int fd) {
+    uint64_t start = stats_now();
+
+    // Validate file descriptor
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_get_filesize: invalid file descriptor %d", fd);
+        return stats_op(FS_OP_FILESIZE, start, -1);
+    }
 
     // Access the file's metadata
     file_descriptor_t *descriptor = &file_descriptors[fd];
-    dir_entry_t *file_entry = &root_directory.entries[descriptor->file_index];
+    open_file_t *file = &open_files[descriptor->file_index];
+    dir_entry_t *file_entry = &file->entry;
 
     // Return the file size
-    return file_entry->file_size;
+    pthread_rwlock_rdlock(&file->lock);
+    int64_t size = file_entry->file_size;
+    pthread_rwlock_unlock(&file->lock);
+    stats_op(FS_OP_FILESIZE, start, 0);
+    return size;
 }
 
 int fs_lseek(int fd, size_t offset) {
+    uint64_t start = stats_now();
+
     // Validate the file descriptor
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !file_descriptors[fd].in_use) {
-        fprintf(stderr, "fs_lseek: invalid file descriptor %d\n", fd);
-        return -1;
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_lseek: invalid file descriptor %d", fd);
+        return stats_op(FS_OP_LSEEK, start, -1);
     }
 
     // Validate the offset
     file_descriptor_t *descriptor = &file_descriptors[fd];
-    dir_entry_t *file_entry = &root_directory.entries[descriptor->file_index];
+    open_file_t *file = &open_files[descriptor->file_index];
+    dir_entry_t *file_entry = &file->entry;
+    pthread_rwlock_rdlock(&file->lock);
     if (offset > file_entry->file_size) {
-        fprintf(stderr, "fs_lseek: offset %zu exceeds file size %u\n", offset, file_entry->file_size);
-        return -1;
+        log_error(FS_EINVAL, "fs_lseek: offset %zu exceeds file size %llu", offset,
+                  (unsigned long long)file_entry->file_size);
+        pthread_rwlock_unlock(&file->lock);
+        return stats_op(FS_OP_LSEEK, start, -1);
     }
 
     // Update the file descriptor's offset
     descriptor->offset = offset;
-    printf("fs_lseek: file descriptor %d moved to offset %zu\n", fd, offset);
+    pthread_rwlock_unlock(&file->lock);
+    log_debug("fs_lseek: file descriptor %d moved to offset %zu", fd, offset);
+    log_trace(TRACE_LSEEK, fd, offset);
 
-    return 0;  // Success
+    return stats_op(FS_OP_LSEEK, start, 0);  // Success
+}
+
+// Free the clusters of the file's chain past the first `new_size` bytes.
+// Called with the file's lock held exclusive.
+static int shrink_chain(open_file_t *file, uint64_t new_size) {
+    dir_entry_t *file_entry = &file->entry;
+
+    // Calculate the required number of clusters; the starting cluster is always kept
+    size_t current_clusters = (file_entry->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    size_t new_clusters = (new_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (new_clusters == 0) {
+        new_clusters = 1;
+    }
+
+    // Truncate the FAT chain if needed, after copying the part that stays if
+    // a clone shares it
+    if (new_clusters < current_clusters && unshare(file, (uint32_t)new_clusters - 1) < 0) {
+        return -1;
+    }
+    uint32_t cluster = file_entry->starting_cluster;
+    uint32_t prev_cluster = FAT_EOF;
+    size_t steps = 0;
+    for (; steps < new_clusters && cluster < superblock.data_clusters_count; steps++) {
+        prev_cluster = cluster;
+        cluster = fat_get(cluster);
+    }
+    stats_add(STAT_FAT_STEPS, steps);
+    if (cluster == FAT_ERROR) {
+        return -1;
+    }
+
+    if (new_clusters < current_clusters && prev_cluster != FAT_EOF) {
+        // Terminate the FAT chain before freeing, so a crash in between only leaks
+        if (journal_fat(prev_cluster, FAT_EOF) < 0) {
+            return -1;
+        }
+        reset_file_cursors(file);
+        return free_chain(cluster);
+    }
+    return 0;
 }
 
 int fs_trunc(int fd, size_t new_size) {
+    uint64_t start = stats_now();
+
     // Validate the file descriptor
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !file_descriptors[fd].in_use) {
-        fprintf(stderr, "fs_trunc: invalid file descriptor %d\n", fd);
-        return -1;
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_trunc: invalid file descriptor %d", fd);
+        return stats_op(FS_OP_TRUNC, start, -1);
     }
 
     // Access the file's metadata
     file_descriptor_t *descriptor = &file_descriptors[fd];
-    dir_entry_t *file_entry = &root_directory.entries[descriptor->file_index];
-
-    // Validate the new size
+    open_file_t *file = &open_files[descriptor->file_index];
+    dir_entry_t *file_entry = &file->entry;
+
+    // Validate the new size, holding the file's lock exclusive while the chain shrinks
+    pthread_rwlock_wrlock(&file->lock);
+    if (flush_write_buffer(file, descriptor) < 0) {
+        pthread_rwlock_unlock(&file->lock);
+        return stats_op(FS_OP_TRUNC, start, -1);
+    }
     if (new_size > file_entry->file_size) {
-        fprintf(stderr, "fs_trunc: new size %zu is greater than file size %u\n", new_size, file_entry->file_size);
-        return -1;
+        log_error(FS_EINVAL, "fs_trunc: new size %zu is greater than file size %llu", new_size,
+                  (unsigned long long)file_entry->file_size);
+        pthread_rwlock_unlock(&file->lock);
+        return stats_op(FS_OP_TRUNC, start, -1);
     }
 
-    // Calculate the required number of clusters
-    size_t current_clusters = (file_entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    size_t new_clusters = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // An inline file shrinks in memory, and write_back stores it in fewer
+    // data slots; otherwise the chain is cut
+    if (file_entry->attribute & ATTR_INLINE) {
+        file->inline_dirty = 1;
+    } else if (shrink_chain(file, new_size) < 0) {
+        pthread_rwlock_unlock(&file->lock);
+        return stats_op(FS_OP_TRUNC, start, -1);
+    }
 
-    // Truncate the FAT chain if needed
-    uint16_t cluster = file_entry->starting_cluster;
-    uint16_t prev_cluster = FAT_EOF;
-    for (size_t i = 0; i < new_clusters; i++) {
-        prev_cluster = cluster;
-        cluster = fat[cluster];
+    // Update file size
+    file_entry->file_size = new_size;
+    file->dirty = 1;
+    pthread_rwlock_unlock(&file->lock);
+
+    if (journal_commit() < 0) {
+        return stats_op(FS_OP_TRUNC, start, -1);
     }
 
-    if (new_clusters < current_clusters) {
-        // Free unused clusters
-        while (cluster != FAT_EOF && cluster != FAT_FREE) {
-            uint16_t next_cluster = fat[cluster];
-            fat[cluster] = FAT_FREE; // Mark as free
-            cluster = next_cluster;
-        }
+    log_debug("fs_trunc: file descriptor %d truncated to %zu bytes", fd, new_size);
+    log_trace(TRACE_TRUNC, fd, new_size);
+    return stats_op(FS_OP_TRUNC, start, 0); // Success
+}
+
+int fs_sync() {
+    uint64_t start = stats_now();
 
-        // Terminate the FAT chain
-        fat[prev_cluster] = FAT_EOF;
+    if (!mounted) {
+        log_error(FS_ENODEV, "fs_sync: file system is not mounted");
+        return stats_op(FS_OP_SYNC, start, -1);
     }
 
-    // Update file size
-    file_entry->file_size = new_size;
+    // Write back open files' entries, then fold the journal into place: dirty
+    // blocks, the changed FAT1/FAT2 blocks and the root directory
+    pthread_rwlock_rdlock(&dir_lock);
+    int result = write_open_files();
+    pthread_rwlock_unlock(&dir_lock);
 
-    printf("fs_trunc: file descriptor %d truncated to %zu bytes\n", fd, new_size);
-    return 0; // Success
+    if (result < 0 || journal_checkpoint() < 0 || write_superblock(0) < 0) {
+        log_error(FS_EIO, "fs_sync: failed to write file system state");
+        return stats_op(FS_OP_SYNC, start, -1);
+    }
+    return stats_op(FS_OP_SYNC, start, 0);
 }
 
-uint32_t find_free_block() {
-    for (uint32_t i = 0; i < superblock.data_blocks_count; i++) {
-        if (fat[i] == FAT_FREE) {
-            printf("find_free_block: Found free block %d.\n", i);
-            return i;
+int fs_fsync(int fd) {
+    uint64_t start = stats_now();
+
+    if (!fd_valid(fd)) {
+        log_error(FS_EBADF, "fs_fsync: invalid file descriptor %d", fd);
+        return stats_op(FS_OP_FSYNC, start, -1);
+    }
+
+    file_descriptor_t *descriptor = &file_descriptors[fd];
+    open_file_t *file = &open_files[descriptor->file_index];
+    int result = 0;
+
+    pthread_rwlock_rdlock(&dir_lock);
+    pthread_rwlock_wrlock(&file->lock);
+    result = store_file(file, descriptor);
+
+    // Write the file's dirty blocks, one run of consecutive clusters at a time
+    uint32_t clusters = (uint32_t)((file->entry.file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    uint32_t remaining = clusters;
+    uint32_t cluster = file->entry.starting_cluster;
+    while (remaining > 0 && cluster < superblock.data_clusters_count && result == 0) {
+        uint32_t first = cluster;
+        uint32_t run = 1;
+        cluster = fat_get(cluster);
+        while (run < remaining && cluster == first + run) {
+            cluster = fat_get(cluster);
+            run++;
         }
+        result = cache_flush_range(CLUSTER_BLOCK(first), run * superblock.cluster_blocks);
+        remaining -= run;
+    }
+    if (result == 0 && remaining > 0 && cluster == FAT_ERROR) {
+        result = -1;
+    }
+    stats_add(STAT_FAT_STEPS, clusters - remaining);
+
+    // Then its directory entry
+    if (result == 0) {
+        result = write_back(file);
     }
-    printf("find_free_block: No free blocks available.\n");
-    return (uint32_t)-1; // Return -1 if no free block is available
+
+    pthread_rwlock_unlock(&file->lock);
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Commit the metadata and make the data durable
+    if (result < 0 || journal_flush() < 0 || sync_disk() < 0) {
+        log_error(FS_EIO, "fs_fsync: failed to flush descriptor %d", fd);
+        return stats_op(FS_OP_FSYNC, start, -1);
+    }
+    return stats_op(FS_OP_FSYNC, start, 0);
+}
+
+int fs_get_stats(fs_stats_t *stats) {
+    if (!stats) {
+        log_error(FS_EINVAL, "fs_get_stats: invalid stats buffer");
+        return -1;
+    }
+    stats_collect(stats);
+    return 0;
+}
+
+void fs_reset_stats() {
+    stats_reset();
+}
+
+uint32_t find_free_block() {
+    // Look up the free-space index; the block is not marked as used
+    return alloc_find(); // Returns (uint32_t)-1 if no free block is available
 }
 
 
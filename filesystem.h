@@ -3,20 +3,54 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "stats.h"
+#include "log.h"
 
 // Constants
 #define MAGIC_NUMBER 0xFADEBEEF  // Magic number for file system validation
-#define FAT_FREE 0xFFFF          // Indicates a free block in the FAT
-#define FAT_EOF  0xFFFE          // Indicates the end of a file chain
+#define FS_CLEAN 0x434C4E21      // superblock.clean after a clean umount ("CLN!")
+#define FS_VERSION 4             // On-disk format: 32-bit clusters, 64-bit sizes, superblock geometry, cluster refcounts, inline files
+#define FS_VERSION_NOINLINE 3    // Still mounted: no inline files, so every file gets a cluster when it is created
+#define FS_VERSION_NOREFS 2      // Still mounted: also without reference counts, so no clones
+#define FAT_FREE 0xFFFFFFFF      // Indicates a free cluster in the FAT
+#define FAT_EOF  0xFFFFFFFE      // Indicates the end of a file chain
+#define MAX_CLUSTER_BLOCKS 256   // Largest cluster, in blocks (1 MB)
+#define FORMAT_IO_BLOCKS 1024    // FAT blocks make_fs writes per request (4 MB)
 #define MAX_FILENAME_LENGTH 15   // Maximum length for file names
-#define MAX_FILES 64             // Maximum number of files
+#define MAX_PATH_LENGTH 256      // Maximum length for paths
+#define ATTR_INLINE 0x08         // Directory entry attribute: the file's data is in data slots of its directory, no chain
+#define ATTR_DIRECTORY 0x10      // Directory entry attribute: the entry is a subdirectory
+#define ATTR_SHARED 0x20         // Directory entry attribute: the file's chain may share clusters with a clone
+#define ATTR_SNAPSHOT 0x40       // Directory entry attribute: a root directory made by fs_snapshot
+#define MAX_FILES 64             // Maximum number of entries in the root directory
 #define MAX_OPEN_FILES 32        // Maximum number of open files
+#define FD_SKIP_SLOTS 64         // Entries in each descriptor's sparse cluster index
+#define IO_BATCH_RUNS 16         // Whole-block runs fs_read and fs_write submit as one batch
+#define RA_MIN_BLOCKS 4          // First readahead window of a sequential reader
+#define RA_MAX_BLOCKS 64         // Largest readahead window
+#define WRITE_BUFFER_DEFAULT (64 * 1024) // Per-file append buffer when mount_opts_t leaves it 0
+#define VIEW_MAX_BLOCKS 16       // Cache blocks one fs_read_view can pin
+#define INLINE_SLOTS 6           // Data slots an inline file can use
+#define INLINE_SLOT_BYTES 63     // File bytes per data slot
+#define INLINE_MAX (INLINE_SLOTS * INLINE_SLOT_BYTES) // Largest inline file (378 bytes)
+#define INLINE_MARK 0x01         // First byte of a data slot, where an entry's name starts
 
 // Structures
 typedef struct {
-    int file_index;     // Index of the file in the root directory
-    uint32_t offset;    // Current offset within the file
+    int file_index;     // Index of the file in the open file table
+    uint64_t offset;    // Current offset within the file
     uint8_t in_use;     // flag indicating if this descriptor is in use
+
+    uint32_t cursor_block;    // Logical cluster (index in the chain) last accessed
+    uint32_t cursor_cluster;  // Physical cluster of cursor_block, FAT_FREE if unset
+    uint32_t cursor_generation; // File chain generation the cursor was built for
+    uint32_t skip_stride;     // Logical clusters between skip index entries
+    uint32_t skip_count;      // Valid entries in skip[]
+    uint32_t skip[FD_SKIP_SLOTS]; // Cluster of logical cluster i * skip_stride
+
+    uint64_t ra_offset;       // Offset at which a read counts as sequential
+    uint32_t ra_window;       // Readahead window in blocks, shrinks on random reads
+    uint32_t ra_end;          // First logical block past those already prefetched
 } file_descriptor_t;
 
 typedef struct {
@@ -29,14 +63,34 @@ typedef struct {
     uint16_t last_modified_time;        // 2 bytes for last modified time
     uint16_t last_modified_date;        // 2 bytes for last modified date
 
-    uint16_t starting_cluster;          // 2 bytes for starting cluster number
-    uint32_t file_size;                 // 4 bytes for file size
+    uint16_t reserved1;                 // 2 bytes, keeps the fields below aligned
+    uint32_t starting_cluster;          // 4 bytes for starting cluster number
+    uint64_t file_size;                 // 8 bytes for file size
+    uint32_t inline_slots[INLINE_SLOTS]; // with ATTR_INLINE, the data slots holding the file, in order
 } dir_entry_t;
 
+typedef struct {
+    uint8_t mark;                       // INLINE_MARK
+    char data[INLINE_SLOT_BYTES];       // 63 bytes of an inline file
+} inline_slot_t;                        // a directory slot holding file data, the size of a dir_entry_t
+
 typedef struct {
     dir_entry_t entries[MAX_FILES];
 } root_directory_t;
 
+typedef struct {
+    const char *data;           // File data in a pinned cache page (or the mapped disk)
+    size_t len;                 // Bytes at data
+} fs_span_t;
+
+typedef struct {
+    int count;                  // Spans in use, in file order
+    size_t bytes;               // Bytes the spans cover
+    fs_span_t spans[VIEW_MAX_BLOCKS];
+    int npages;                 // Pages pinned for the view
+    char *pages[VIEW_MAX_BLOCKS]; // Released by fs_release_view
+} fs_view_t;
+
 typedef struct {
     uint32_t magic;             // Magic number for file system identification
     uint32_t total_blocks;      // Total number of blocks
@@ -49,32 +103,74 @@ typedef struct {
     uint32_t root_dir_block;    // Start block of the root directory
     uint32_t root_dir_blocks;   // Number of blocks reserved for the root directory
 
-    uint32_t data_start_block;  // Starting block of data blocks
-    uint32_t data_blocks_count; // Number of blocks reserved for data
+    uint32_t data_start_block;  // Starting block of data clusters, a multiple of cluster_blocks
+    uint32_t data_clusters_count; // Number of clusters in the data area
+
+    uint32_t free_clusters_count; // Count of free data clusters
 
-    uint32_t free_blocks_count; // Count of free data blocks
+    uint32_t journal_start_block; // First block of the metadata journal
+    uint32_t journal_blocks;      // Blocks reserved for the journal, 0 if the volume has none
+
+    uint32_t version;           // FS_VERSION
+    uint32_t cluster_blocks;    // Blocks per cluster, the allocation unit
+
+    uint32_t clean;             // FS_CLEAN if the FAT and free_clusters_count were written by umount_fs
+    uint32_t alloc_hint;        // Cluster the allocator resumes its search from
+
+    uint32_t ref_start_block;   // First block of the cluster reference counts, one byte per data cluster
+    uint32_t ref_blocks;        // Blocks reserved for the reference counts, 0 if the volume has none
 } superblock_t;
 
+typedef struct {
+    uint64_t volume_size;       // Disk size in bytes (0 selects DISK_BLOCKS blocks)
+    uint32_t cluster_size;      // Cluster size in bytes, a multiple of BLOCK_SIZE (0 selects BLOCK_SIZE)
+    int preallocate;            // Reserve the image's space with fallocate instead of leaving it sparse
+} mkfs_opts_t;
+
+typedef struct {
+    int cache_blocks;           // Buffer cache size in blocks (0 selects CACHE_DEFAULT_BLOCKS)
+    int disk_backend;           // DISK_BACKEND_FILE (default), DISK_BACKEND_MMAP or DISK_BACKEND_URING
+    int journal_mode;           // JOURNAL_SYNC (default) or JOURNAL_ASYNC
+    int write_buffer;           // Append buffer per open file in bytes (0 selects WRITE_BUFFER_DEFAULT, -1 disables)
+    int fat_mode;               // FAT_EAGER (default) or FAT_LAZY
+} mount_opts_t;
+
+// Geometry of the mounted volume
+#define CLUSTER_SIZE ((uint64_t)superblock.cluster_blocks * BLOCK_SIZE)  // Bytes per cluster
+#define CLUSTER_BLOCK(c) (superblock.data_start_block + (c) * superblock.cluster_blocks)  // First block of cluster c
+
 // Extern declarations for global variables
 extern superblock_t superblock;
-extern uint32_t *fat;
 extern root_directory_t root_directory;
 extern file_descriptor_t file_descriptors[MAX_OPEN_FILES];
 
 // Function prototypes
 int make_fs(char *disk_name);
+int make_fs_opts(char *disk_name, const mkfs_opts_t *opts);
 int mount_fs(char *disk_name);
+int mount_fs_opts(char *disk_name, const mount_opts_t *opts);
 int umount_fs();
 
 int fs_create(const char *filename);
 int fs_open(const char *filename);
 int fs_close(int fd);
 int fs_read(int fd, void *buf, size_t count);
+int fs_read_view(int fd, size_t offset, size_t len, fs_view_t *view);
+int fs_release_view(fs_view_t *view);
 int fs_write(int fd, const void *buf, size_t count);
 int fs_delete(const char *filename);
-int fs_get_filesize(int fd);
+int fs_mkdir(const char *path);
+int fs_rmdir(const char *path);
+int64_t fs_get_filesize(int fd);
 int fs_lseek(int fd, size_t offset);
 int fs_trunc(int fd, size_t length);
+int fs_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len);
+int fs_clone(const char *src, const char *dst);
+int fs_snapshot(const char *name);
+int fs_sync();
+int fs_fsync(int fd);
+int fs_get_stats(fs_stats_t *stats);
+void fs_reset_stats();
 
 uint32_t find_free_block();
 
@@ -0,0 +1,1016 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "filesystem.h"
+#include "alloc.h"
+#include "cache.h"
+#include "fat.h"
+
+#define BENCH_DISK "bench_disk"
+#define SLICE 512   // allocations per reported latency sample
+#define NAME_LEN 48 // file name buffers, long enough for any printed int or long
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Fill the data area one allocation at a time and report the mean latency of
+// each slice, so a flat column shows allocation cost does not grow with how
+// full the volume is.
+static int bench_fill(uint32_t run_length) {
+    if (make_fs(BENCH_DISK) != 0 || mount_fs(BENCH_DISK) != 0) {
+        printf("fill: failed to initialize the file system.\n");
+        return -1;
+    }
+
+    printf("fill: run_length=%u data_blocks=%u\n", run_length, superblock.data_clusters_count);
+    printf("%10s %10s %14s\n", "allocated", "free", "ns_per_alloc");
+
+    uint32_t allocated = 0;
+    uint32_t in_slice = 0;
+    uint64_t slice_start = now_ns();
+    uint64_t total_start = slice_start;
+
+    for (;;) {
+        uint32_t c = (run_length == 1) ? alloc_block() : alloc_run(run_length);
+        if (c == ALLOC_NONE) {
+            break;
+        }
+        allocated += run_length;
+
+        if (++in_slice == SLICE) {
+            uint64_t t = now_ns();
+            printf("%10u %10u %14.1f\n", allocated, superblock.free_clusters_count,
+                   (double)(t - slice_start) / SLICE);
+            in_slice = 0;
+            slice_start = now_ns();
+        }
+    }
+
+    uint64_t total = now_ns() - total_start;
+    printf("fill: %u blocks in %u calls, %.1f ns per call\n", allocated, allocated / run_length,
+           allocated ? (double)total / (allocated / run_length) : 0.0);
+
+    umount_fs();
+    return 0;
+}
+
+#define SCALE_FILES 8
+#define SCALE_FILE_SIZE (2 * 1024 * 1024)
+#define SCALE_PASSES 8
+
+typedef struct {
+    int id;
+    size_t io_size;
+    uint64_t bytes;
+    int errors;
+} worker_t;
+
+static void fill_pattern(char *buf, size_t len, int seed, size_t offset) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (char)((offset + i) * 31 + seed);
+    }
+}
+
+static int write_file(const char *name, int seed, size_t size) {
+    char buf[BLOCK_SIZE];
+    if (fs_create(name) != 0) {
+        return -1;
+    }
+    int fd = fs_open(name);
+    if (fd < 0) {
+        return -1;
+    }
+    for (size_t off = 0; off < size; off += sizeof(buf)) {
+        size_t n = (size - off < sizeof(buf)) ? size - off : sizeof(buf);
+        fill_pattern(buf, n, seed, off);
+        if (fs_write(fd, buf, n) != (int)n) {
+            fs_close(fd);
+            return -1;
+        }
+    }
+    return fs_close(fd);
+}
+
+// Read one scaling file start to end SCALE_PASSES times.
+static void *scale_reader(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    char name[NAME_LEN];
+    char *buf = malloc(w->io_size);
+
+    snprintf(name, sizeof(name), "scale%d", w->id % SCALE_FILES);
+    int fd = fs_open(name);
+    if (fd < 0 || !buf) {
+        w->errors++;
+        free(buf);
+        return NULL;
+    }
+
+    for (int pass = 0; pass < SCALE_PASSES; pass++) {
+        fs_lseek(fd, 0);
+        for (size_t off = 0; off < SCALE_FILE_SIZE; off += w->io_size) {
+            int n = fs_read(fd, buf, w->io_size);
+            if (n <= 0) {
+                w->errors++;
+                break;
+            }
+            w->bytes += n;
+        }
+    }
+
+    fs_close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Parallel readers of different files: aggregate throughput for 1..max threads.
+static int bench_scale(int max_threads, size_t io_size, int backend) {
+    mount_opts_t opts = { .cache_blocks = 4096, .disk_backend = backend };
+    if (make_fs(BENCH_DISK) != 0 || mount_fs_opts(BENCH_DISK, &opts) != 0) {
+        printf("scale: failed to initialize the file system.\n");
+        return -1;
+    }
+
+    char name[NAME_LEN];
+    for (int i = 0; i < SCALE_FILES; i++) {
+        snprintf(name, sizeof(name), "scale%d", i);
+        if (write_file(name, i, SCALE_FILE_SIZE) != 0) {
+            printf("scale: failed to create '%s'.\n", name);
+            umount_fs();
+            return -1;
+        }
+    }
+
+    printf("scale: io_size=%zu files=%d file_size=%d backend=%d\n", io_size, SCALE_FILES, SCALE_FILE_SIZE, backend);
+    printf("%8s %12s %10s\n", "threads", "MB_per_s", "speedup");
+
+    double base = 0;
+    int errors = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        pthread_t threads[64];
+        worker_t workers[64];
+
+        uint64_t start = now_ns();
+        for (int i = 0; i < n; i++) {
+            workers[i] = (worker_t){ .id = i, .io_size = io_size };
+            pthread_create(&threads[i], NULL, scale_reader, &workers[i]);
+        }
+        uint64_t bytes = 0;
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+            bytes += workers[i].bytes;
+            errors += workers[i].errors;
+        }
+        double mbps = (double)bytes / (1 << 20) / ((double)(now_ns() - start) / 1e9);
+        if (n == 1) {
+            base = mbps;
+        }
+        printf("%8d %12.1f %10.2f\n", n, mbps, mbps / base);
+    }
+
+    umount_fs();
+    printf("scale: %d errors\n", errors);
+    return errors ? -1 : 0;
+}
+
+#define STRESS_ROUNDS 200
+#define STRESS_MAX_SIZE (64 * 1024)
+
+// Create, write, verify, truncate and delete private files while other
+// threads do the same, checking every byte read back. Odd-numbered threads
+// work in a subdirectory of their own, even ones in the root directory.
+static void *stress_worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    char dir[16] = "";
+    char name[NAME_LEN];
+    char *data = malloc(STRESS_MAX_SIZE);
+    char *check = malloc(STRESS_MAX_SIZE);
+    unsigned seed = (unsigned)w->id * 7919u + 1;
+
+    if (w->id % 2) {
+        snprintf(dir, sizeof(dir), "d%d", w->id);
+        if (fs_mkdir(dir) != 0) {
+            w->errors++;
+        }
+    }
+
+    for (int round = 0; round < STRESS_ROUNDS && data && check; round++) {
+        size_t size = 1 + rand_r(&seed) % STRESS_MAX_SIZE;
+        snprintf(name, sizeof(name), "%s/st%d_%d", dir, w->id, round % 4);
+        fill_pattern(data, size, w->id + round, 0);
+
+        if (fs_create(name) != 0) {
+            w->errors++;
+            continue;
+        }
+        int fd = fs_open(name);
+        if (fd < 0) {
+            w->errors++;
+            fs_delete(name);
+            continue;
+        }
+
+        // Write in random-sized pieces, then read everything back
+        for (size_t off = 0; off < size;) {
+            size_t n = 1 + rand_r(&seed) % 9000;
+            if (n > size - off) {
+                n = size - off;
+            }
+            if (fs_write(fd, data + off, n) != (int)n) {
+                w->errors++;
+                break;
+            }
+            off += n;
+        }
+
+        // Now and then make the file durable, or the whole file system
+        if (round % 8 == 0 && fs_fsync(fd) != 0) {
+            w->errors++;
+        }
+        if (w->id == 0 && round % 16 == 0 && fs_sync() != 0) {
+            w->errors++;
+        }
+
+        // Read back in one piece, or on odd rounds in small sequential pieces
+        // that go through readahead
+        fs_lseek(fd, 0);
+        if (round % 2 == 0) {
+            if (fs_read(fd, check, size) != (int)size) {
+                w->errors++;
+            }
+        } else {
+            for (size_t off = 0; off < size;) {
+                size_t n = 1 + rand_r(&seed) % 4000;
+                int got = fs_read(fd, check + off, n);
+                if (got <= 0) {
+                    w->errors++;
+                    break;
+                }
+                off += got;
+            }
+        }
+        if (memcmp(data, check, size) != 0) {
+            w->errors++;
+        }
+
+        fs_trunc(fd, size / 2);
+        fs_lseek(fd, 0);
+        if (size / 2 > 0 && (fs_read(fd, check, size) != (int)(size / 2) || memcmp(data, check, size / 2) != 0)) {
+            w->errors++;
+        }
+
+        fs_close(fd);
+        if (fs_delete(name) != 0) {
+            w->errors++;
+        }
+        w->bytes += size;
+    }
+
+    if (dir[0] != '\0' && fs_rmdir(dir) != 0) {
+        w->errors++;
+    }
+    free(data);
+    free(check);
+    return NULL;
+}
+
+// Print the counters fs_get_stats gathered during a workload.
+static void print_stats() {
+    static const char *names[FS_OP_COUNT] = {
+        "create", "delete", "mkdir", "rmdir", "open", "close", "read", "write",
+        "lseek", "trunc", "filesize", "sync", "fsync", "clone", "snapshot", "copy_range", "read_view"
+    };
+    fs_stats_t st;
+    if (fs_get_stats(&st) != 0) {
+        return;
+    }
+
+    printf("%10s %10s %8s %14s %12s %12s\n", "op", "calls", "errors", "bytes", "mean_ns", "max_bucket");
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        fs_op_stats_t *o = &st.ops[op];
+        if (o->calls == 0) {
+            continue;
+        }
+        int top = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (o->latency[b]) {
+                top = b;
+            }
+        }
+        printf("%10s %10llu %8llu %14llu %12.0f %11s%d\n", names[op], (unsigned long long)o->calls,
+               (unsigned long long)o->errors, (unsigned long long)o->bytes,
+               (double)o->total_ns / o->calls, "2^", top);
+    }
+    printf("disk: %llu reads (%llu blocks), %llu writes (%llu blocks)\n",
+           (unsigned long long)st.disk_reads, (unsigned long long)st.block_reads,
+           (unsigned long long)st.disk_writes, (unsigned long long)st.block_writes);
+    printf("fat_steps=%llu alloc_calls=%llu alloc_scan=%llu cache_hit_ratio=%.3f\n",
+           (unsigned long long)st.fat_steps, (unsigned long long)st.alloc_calls,
+           (unsigned long long)st.alloc_scan, st.cache_hit_ratio);
+}
+
+static int bench_stress(int nthreads) {
+    if (make_fs(BENCH_DISK) != 0 || mount_fs(BENCH_DISK) != 0) {
+        printf("stress: failed to initialize the file system.\n");
+        return -1;
+    }
+
+    pthread_t threads[64];
+    worker_t workers[64];
+    fs_reset_stats();
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (worker_t){ .id = i };
+        pthread_create(&threads[i], NULL, stress_worker, &workers[i]);
+    }
+
+    int errors = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    uint32_t free_blocks = superblock.free_clusters_count;
+    print_stats();
+    umount_fs();
+
+    printf("stress: threads=%d rounds=%d bytes=%llu time=%.2fs errors=%d free_blocks=%u/%u\n",
+           nthreads, STRESS_ROUNDS, (unsigned long long)bytes, secs, errors,
+           free_blocks, superblock.data_clusters_count);
+    return (errors || free_blocks != superblock.data_clusters_count) ? -1 : 0;
+}
+
+// Parameterized workloads. Each thread works on files of its own; the timed
+// phase ends with fs_sync for workloads that write, so the disk traffic they
+// cause is counted. A run prints one JSON object with throughput, latency
+// percentiles of the individual operations and the block I/O per byte moved.
+
+#define BENCH_MAX_THREADS 16
+
+typedef struct {
+    int threads;
+    size_t io_size;
+    size_t file_size;       // per-thread file, or each file of fillfs
+    long ops;               // operations per thread of the random and storm workloads
+    int backend;
+    int cache_blocks;
+    int read_pct;           // share of reads in mix
+    int sync_every;         // append: fs_fsync after this many appends, 0 never
+    unsigned seed;
+    mkfs_opts_t mkfs;       // volume and cluster size of the bench disk
+    int fat_mode;           // FAT_EAGER or FAT_LAZY
+} bench_opts_t;
+
+typedef struct {
+    const bench_opts_t *opts;
+    int id;
+    unsigned seed;
+    uint64_t *lat;          // latency of each operation in ns
+    long nlat;
+    long cap;
+    uint64_t bytes;
+    int errors;
+    int full;               // fillfs: the volume ran out of space
+} runner_t;
+
+static void record(runner_t *r, uint64_t start, int ok) {
+    if (!ok) {
+        r->errors++;
+    }
+    if (r->nlat == r->cap) {
+        long cap = r->cap ? r->cap * 2 : 4096;
+        uint64_t *lat = realloc(r->lat, cap * sizeof(uint64_t));
+        if (!lat) {
+            return;
+        }
+        r->lat = lat;
+        r->cap = cap;
+    }
+    r->lat[r->nlat++] = now_ns() - start;
+}
+
+static void bench_name(char *name, size_t len, int id, long k) {
+    snprintf(name, len, "b%d_%ld", id, k);
+}
+
+static size_t random_offset(runner_t *r) {
+    size_t slots = r->opts->file_size / r->opts->io_size;
+    return (size_t)(rand_r(&r->seed) % (slots ? slots : 1)) * r->opts->io_size;
+}
+
+// Write the thread's file in io_size pieces
+static void *run_seqwrite(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN];
+    char *buf = malloc(o->io_size);
+
+    bench_name(name, sizeof(name), r->id, 0);
+    int fd = (fs_create(name) == 0) ? fs_open(name) : -1;
+    if (fd < 0 || !buf) {
+        r->errors++;
+        free(buf);
+        return NULL;
+    }
+    fill_pattern(buf, o->io_size, r->id, 0);
+    for (size_t off = 0; off < o->file_size; off += o->io_size) {
+        size_t n = (o->file_size - off < o->io_size) ? o->file_size - off : o->io_size;
+        uint64_t start = now_ns();
+        int ok = fs_write(fd, buf, n) == (int)n;
+        record(r, start, ok);
+        r->bytes += ok ? n : 0;
+    }
+    fs_close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Read the thread's file front to back, checking the data
+static void *run_seqread(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN];
+    char *buf = malloc(o->io_size);
+    char *expect = malloc(o->io_size);
+
+    bench_name(name, sizeof(name), r->id, 0);
+    int fd = fs_open(name);
+    if (fd < 0 || !buf || !expect) {
+        r->errors++;
+    }
+    for (size_t off = 0; fd >= 0 && buf && expect && off < o->file_size;) {
+        uint64_t start = now_ns();
+        int n = fs_read(fd, buf, o->io_size);
+        fill_pattern(expect, n > 0 ? n : 0, r->id, off);
+        record(r, start, n > 0 && memcmp(buf, expect, n) == 0);
+        if (n <= 0) {
+            break;
+        }
+        r->bytes += n;
+        off += n;
+    }
+    if (fd >= 0) {
+        fs_close(fd);
+    }
+    free(buf);
+    free(expect);
+    return NULL;
+}
+
+// Read the thread's file through fs_read_view in io_size pieces, checking
+// the spans in place instead of copying them out
+static void *run_scan(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN];
+    char *expect = malloc(o->io_size);
+
+    bench_name(name, sizeof(name), r->id, 0);
+    int fd = fs_open(name);
+    if (fd < 0 || !expect) {
+        r->errors++;
+    }
+    for (size_t off = 0; fd >= 0 && expect && off < o->file_size;) {
+        fs_view_t view;
+        uint64_t start = now_ns();
+        int n = fs_read_view(fd, off, o->io_size, &view);
+        int ok = n > 0;
+        fill_pattern(expect, n > 0 ? n : 0, r->id, off);
+        size_t at = 0;
+        for (int i = 0; ok && i < view.count; i++) {
+            ok = memcmp(view.spans[i].data, expect + at, view.spans[i].len) == 0;
+            at += view.spans[i].len;
+        }
+        if (n > 0) {
+            fs_release_view(&view);
+        }
+        record(r, start, ok);
+        if (n <= 0) {
+            break;
+        }
+        r->bytes += n;
+        off += n;
+    }
+    if (fd >= 0) {
+        fs_close(fd);
+    }
+    free(expect);
+    return NULL;
+}
+
+// io_size reads and writes at random aligned offsets of the thread's file,
+// read_pct percent of them reads (100 for randread, 0 for randwrite)
+static void *run_random(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN];
+    char *buf = malloc(o->io_size);
+
+    bench_name(name, sizeof(name), r->id, 0);
+    int fd = fs_open(name);
+    if (fd < 0 || !buf) {
+        r->errors++;
+        free(buf);
+        return NULL;
+    }
+    fill_pattern(buf, o->io_size, r->id, 0);
+    for (long i = 0; i < o->ops; i++) {
+        size_t off = random_offset(r);
+        int read = (int)(rand_r(&r->seed) % 100) < o->read_pct;
+        size_t n = (o->file_size - off < o->io_size) ? o->file_size - off : o->io_size;
+        uint64_t start = now_ns();
+        int ok = fs_lseek(fd, off) == 0 &&
+                 (read ? fs_read(fd, buf, n) : fs_write(fd, buf, n)) == (int)n;
+        record(r, start, ok);
+        r->bytes += ok ? n : 0;
+    }
+    fs_close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Small-file storm: each operation creates a file, writes io_size bytes,
+// closes it, opens it again and deletes it. The files are in a directory of
+// the thread's own, as files in the root are never inline.
+static void *run_create(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char dir[16];
+    char name[NAME_LEN];
+    char *buf = malloc(o->io_size);
+
+    // Without the directory every operation fails and counts as an error
+    snprintf(dir, sizeof(dir), "c%d", r->id);
+    fs_mkdir(dir);
+    fill_pattern(buf, buf ? o->io_size : 0, r->id, 0);
+    for (long i = 0; buf && i < o->ops; i++) {
+        snprintf(name, sizeof(name), "c%d/b%d_%ld", r->id, r->id, i % 4);
+        uint64_t start = now_ns();
+        int ok = 0;
+        if (fs_create(name) == 0) {
+            int fd = fs_open(name);
+            ok = fd >= 0 && fs_write(fd, buf, o->io_size) == (int)o->io_size;
+            ok = (fd >= 0 && fs_close(fd) == 0) && ok;
+            fd = fs_open(name);
+            ok = (fd >= 0 && fs_close(fd) == 0) && ok;
+            ok = (fs_delete(name) == 0) && ok;
+        }
+        record(r, start, ok);
+        r->bytes += ok ? o->io_size : 0;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Copy-on-write: each operation clones the thread's file, writes io_size
+// bytes at a random offset of the clone, which copies the shared clusters
+// up to it, and deletes the clone
+static void *run_clone(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN], clone[NAME_LEN];
+    char *buf = malloc(o->io_size);
+
+    bench_name(name, sizeof(name), r->id, 0);
+    bench_name(clone, sizeof(clone), r->id, 1);
+    fill_pattern(buf, buf ? o->io_size : 0, r->id, 0);
+    for (long i = 0; buf && i < o->ops; i++) {
+        size_t off = random_offset(r);
+        size_t n = (o->file_size - off < o->io_size) ? o->file_size - off : o->io_size;
+        uint64_t start = now_ns();
+        int ok = 0;
+        if (fs_clone(name, clone) == 0) {
+            int fd = fs_open(clone);
+            ok = fd >= 0 && fs_lseek(fd, off) == 0 && fs_write(fd, buf, n) == (int)n;
+            ok = (fd >= 0 && fs_close(fd) == 0) && ok;
+            ok = (fs_delete(clone) == 0) && ok;
+        }
+        record(r, start, ok);
+        r->bytes += ok ? n : 0;
+    }
+    free(buf);
+    return NULL;
+}
+
+// In-volume copy: each operation creates a file, fills it from the thread's
+// file with one fs_copy_range and deletes it
+static void *run_copy(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN], copy[NAME_LEN];
+
+    bench_name(name, sizeof(name), r->id, 0);
+    bench_name(copy, sizeof(copy), r->id, 1);
+    int src = fs_open(name);
+    for (long i = 0; src >= 0 && i < o->ops; i++) {
+        uint64_t start = now_ns();
+        int ok = 0;
+        if (fs_create(copy) == 0) {
+            int fd = fs_open(copy);
+            ok = fd >= 0 && fs_copy_range(src, 0, fd, 0, o->file_size) == (int)o->file_size;
+            ok = (fd >= 0 && fs_close(fd) == 0) && ok;
+            ok = (fs_delete(copy) == 0) && ok;
+        }
+        record(r, start, ok);
+        r->bytes += ok ? o->file_size : 0;
+    }
+    if (src >= 0) {
+        fs_close(src);
+    }
+    return NULL;
+}
+
+// Append io_size records to a log until it reaches file_size, with an
+// fs_fsync every sync_every records
+static void *run_append(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN];
+    char *buf = malloc(o->io_size);
+
+    bench_name(name, sizeof(name), r->id, 0);
+    int fd = (fs_create(name) == 0) ? fs_open(name) : -1;
+    if (fd < 0 || !buf) {
+        r->errors++;
+        free(buf);
+        return NULL;
+    }
+    long records = 0;
+    for (size_t off = 0; off + o->io_size <= o->file_size; off += o->io_size) {
+        fill_pattern(buf, o->io_size, r->id, off);
+        uint64_t start = now_ns();
+        int ok = fs_write(fd, buf, o->io_size) == (int)o->io_size;
+        if (o->sync_every && ++records % o->sync_every == 0) {
+            ok = (fs_fsync(fd) == 0) && ok;
+        }
+        record(r, start, ok);
+        r->bytes += ok ? o->io_size : 0;
+    }
+    fs_close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Write file_size files until the volume is full. Running out of clusters
+// or directory entries ends the run; any other failure is an error.
+static void *run_fillfs(void *arg) {
+    runner_t *r = (runner_t *)arg;
+    const bench_opts_t *o = r->opts;
+    char name[NAME_LEN];
+    char *buf = malloc(o->io_size);
+
+    fill_pattern(buf, buf ? o->io_size : 0, r->id, 0);
+    for (long k = 0; buf && !r->full; k++) {
+        bench_name(name, sizeof(name), r->id, k);
+        if (fs_create(name) != 0) {
+            r->full = (fs_errno() == FS_ENOSPC);
+            r->errors += !r->full;
+            break;
+        }
+        int fd = fs_open(name);
+        for (size_t off = 0; fd >= 0 && off < o->file_size; off += o->io_size) {
+            size_t n = (o->file_size - off < o->io_size) ? o->file_size - off : o->io_size;
+            uint64_t start = now_ns();
+            int written = fs_write(fd, buf, n);
+            if (written < 0 && fs_errno() == FS_ENOSPC) {
+                r->full = 1;
+                break;
+            }
+            record(r, start, written == (int)n);
+            r->bytes += written > 0 ? written : 0;
+        }
+        if (fd < 0 || fs_close(fd) != 0) {
+            // A buffered append that finds no space fails at close
+            r->full = r->full || fs_errno() == FS_ENOSPC;
+            r->errors += !r->full;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    void *(*run)(void *arg);
+    int prepare;            // files written and the volume remounted first
+    int read_pct;           // -1 keeps the read_pct option
+} workload_t;
+
+static const workload_t workloads[] = {
+    { "seqwrite", run_seqwrite, 0, 0 },
+    { "seqread", run_seqread, 1, 100 },
+    { "scan", run_scan, 1, 100 },
+    { "randread", run_random, 1, 100 },
+    { "randwrite", run_random, 1, 0 },
+    { "mix", run_random, 1, -1 },
+    { "create", run_create, 0, 0 },
+    { "append", run_append, 0, 0 },
+    { "fillfs", run_fillfs, 0, 0 },
+    { "clone", run_clone, 1, 0 },
+    { "copy", run_copy, 1, 0 },
+};
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static uint64_t percentile(const uint64_t *sorted, long n, double q) {
+    if (n == 0) {
+        return 0;
+    }
+    long rank = (long)(q * n + 0.999999);
+    return sorted[(rank > 0 ? rank : 1) - 1];
+}
+
+static const char *backend_name(int backend) {
+    return backend == DISK_BACKEND_MMAP ? "mmap" : backend == DISK_BACKEND_URING ? "uring" : "file";
+}
+
+static int bench_run(const workload_t *w, bench_opts_t *o) {
+    mount_opts_t mopts = { .cache_blocks = o->cache_blocks, .disk_backend = o->backend, .fat_mode = o->fat_mode };
+    if (make_fs_opts(BENCH_DISK, &o->mkfs) != 0 || mount_fs_opts(BENCH_DISK, &mopts) != 0) {
+        fprintf(stderr, "%s: failed to initialize the file system\n", w->name);
+        return -1;
+    }
+
+    // Read workloads start from files on disk and an empty cache
+    char name[NAME_LEN];
+    for (int i = 0; w->prepare && i < o->threads; i++) {
+        bench_name(name, sizeof(name), i, 0);
+        if (write_file(name, i, o->file_size) != 0) {
+            fprintf(stderr, "%s: failed to create '%s'\n", w->name, name);
+            umount_fs();
+            return -1;
+        }
+    }
+    if (w->prepare && (umount_fs() != 0 || mount_fs_opts(BENCH_DISK, &mopts) != 0)) {
+        fprintf(stderr, "%s: failed to remount\n", w->name);
+        return -1;
+    }
+    if (w->read_pct >= 0) {
+        o->read_pct = w->read_pct;
+    }
+
+    // Running out of space is how fillfs ends, not worth a message per thread
+    int level = log_get_level();
+    if (w->run == run_fillfs) {
+        log_set_level(LOG_NONE);
+    }
+
+    pthread_t threads[BENCH_MAX_THREADS];
+    runner_t runners[BENCH_MAX_THREADS];
+    fs_reset_stats();
+    uint64_t start = now_ns();
+    for (int i = 0; i < o->threads; i++) {
+        runners[i] = (runner_t){ .opts = o, .id = i, .seed = o->seed + (unsigned)i * 7919u };
+        pthread_create(&threads[i], NULL, w->run, &runners[i]);
+    }
+    for (int i = 0; i < o->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    int errors = (fs_sync() != 0);
+    double secs = (double)(now_ns() - start) / 1e9;
+    log_set_level(level);
+
+    fs_stats_t st;
+    fs_get_stats(&st);
+    uint32_t free_blocks = superblock.free_clusters_count;
+    uint32_t data_blocks = superblock.data_clusters_count;
+    uint64_t cluster_size = CLUSTER_SIZE;
+    umount_fs();
+
+    // Merge the samples of every thread
+    long n = 0;
+    uint64_t bytes = 0, total_ns = 0;
+    int full = 0;
+    for (int i = 0; i < o->threads; i++) {
+        n += runners[i].nlat;
+        bytes += runners[i].bytes;
+        errors += runners[i].errors;
+        full |= runners[i].full;
+    }
+    uint64_t *lat = malloc((n ? n : 1) * sizeof(uint64_t));
+    long k = 0;
+    for (int i = 0; i < o->threads; i++) {
+        for (long j = 0; lat && j < runners[i].nlat; j++) {
+            lat[k++] = runners[i].lat[j];
+            total_ns += runners[i].lat[j];
+        }
+        free(runners[i].lat);
+    }
+    if (!lat) {
+        fprintf(stderr, "%s: out of memory\n", w->name);
+        return -1;
+    }
+    qsort(lat, n, sizeof(uint64_t), compare_u64);
+
+    // Blocks moved to or from the disk per byte the workload asked for; a
+    // copied byte is both read and written
+    uint64_t read_bytes = st.ops[FS_OP_READ].bytes + st.ops[FS_OP_READ_VIEW].bytes + st.ops[FS_OP_COPY_RANGE].bytes;
+    uint64_t write_bytes = st.ops[FS_OP_WRITE].bytes + st.ops[FS_OP_COPY_RANGE].bytes;
+    printf("{\"workload\":\"%s\",\"backend\":\"%s\",\"threads\":%d,\"io_size\":%zu,\"file_size\":%zu,"
+           "\"cluster_size\":%llu,\"ops\":%ld,\"bytes\":%llu,\"seconds\":%.6f,\"ops_per_s\":%.1f,\"mb_per_s\":%.2f,"
+           "\"latency_ns\":{\"mean\":%.0f,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+           "\"disk\":{\"reads\":%llu,\"writes\":%llu,\"blocks_read\":%llu,\"blocks_written\":%llu,"
+           "\"read_amplification\":%.3f,\"write_amplification\":%.3f},"
+           "\"cache\":{\"hit_ratio\":%.4f,\"misses\":%llu,\"prefetches\":%llu},"
+           "\"fat_steps\":%llu,\"alloc_scan\":%llu,\"used_pct\":%.1f,\"full\":%d,\"errors\":%d}\n",
+           w->name, backend_name(o->backend), o->threads, o->io_size, o->file_size,
+           (unsigned long long)cluster_size, n, (unsigned long long)bytes, secs, n / secs, bytes / (1024.0 * 1024.0) / secs,
+           n ? (double)total_ns / n : 0.0, (unsigned long long)percentile(lat, n, 0.50),
+           (unsigned long long)percentile(lat, n, 0.99), (unsigned long long)percentile(lat, n, 0.999),
+           (unsigned long long)(n ? lat[n - 1] : 0),
+           (unsigned long long)st.disk_reads, (unsigned long long)st.disk_writes,
+           (unsigned long long)st.block_reads, (unsigned long long)st.block_writes,
+           read_bytes ? (double)st.block_reads * BLOCK_SIZE / read_bytes : 0.0,
+           write_bytes ? (double)st.block_writes * BLOCK_SIZE / write_bytes : 0.0,
+           st.cache_hit_ratio, (unsigned long long)st.cache.misses, (unsigned long long)st.cache.prefetches,
+           (unsigned long long)st.fat_steps, (unsigned long long)st.alloc_scan,
+           100.0 * (data_blocks - free_blocks) / data_blocks, full, errors);
+    free(lat);
+    return errors ? -1 : 0;
+}
+
+// Time make_fs_opts, the first mount of the new volume and a remount after
+// a clean umount, and report how much of the image the format actually wrote
+// (allocated bytes of the file). The first mount also pays for syncing the
+// format's writes, so remount_ms is the one that shows the FAT mode's cost.
+static int bench_format(bench_opts_t *o) {
+    uint64_t start = now_ns();
+    int result = make_fs_opts(BENCH_DISK, &o->mkfs);
+    uint64_t formatted = now_ns();
+    mount_opts_t mopts = { .cache_blocks = o->cache_blocks, .disk_backend = o->backend, .fat_mode = o->fat_mode };
+    if (result != 0 || mount_fs_opts(BENCH_DISK, &mopts) != 0) {
+        fprintf(stderr, "format: failed to initialize the file system\n");
+        return -1;
+    }
+    uint64_t mounted = now_ns();
+    uint64_t volume = (uint64_t)superblock.total_blocks * BLOCK_SIZE;
+    uint64_t cluster_size = CLUSTER_SIZE;
+    umount_fs();
+
+    uint64_t remount_start = now_ns();
+    if (mount_fs_opts(BENCH_DISK, &mopts) != 0) {
+        fprintf(stderr, "format: failed to remount the file system\n");
+        return -1;
+    }
+    uint64_t remounted = now_ns();
+    umount_fs();
+
+    struct stat st;
+    uint64_t allocated = (stat(BENCH_DISK, &st) == 0) ? (uint64_t)st.st_blocks * 512 : 0;
+    printf("{\"workload\":\"format\",\"backend\":\"%s\",\"fat\":\"%s\",\"volume\":%llu,\"cluster_size\":%llu,"
+           "\"preallocate\":%d,\"format_ms\":%.3f,\"mount_ms\":%.3f,\"remount_ms\":%.3f,\"image_allocated\":%llu}\n",
+           backend_name(o->backend), o->fat_mode == FAT_LAZY ? "lazy" : "eager",
+           (unsigned long long)volume, (unsigned long long)cluster_size,
+           o->mkfs.preallocate, (double)(formatted - start) / 1e6, (double)(mounted - formatted) / 1e6,
+           (double)(remounted - remount_start) / 1e6, (unsigned long long)allocated);
+    return 0;
+}
+
+// Parse a size with an optional K, M or G suffix
+static size_t parse_size(const char *s) {
+    char *end;
+    size_t v = (size_t)strtoull(s, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        v *= 1024;
+    } else if (*end == 'M' || *end == 'm') {
+        v *= 1024 * 1024;
+    } else if (*end == 'G' || *end == 'g') {
+        v *= 1024ULL * 1024 * 1024;
+    }
+    return v;
+}
+
+static int key_is(const char *arg, size_t klen, const char *key) {
+    return strlen(key) == klen && strncmp(arg, key, klen) == 0;
+}
+
+// Options are key=value pairs: threads, io_size, size, ops, backend
+// (file|mmap|uring), cache (blocks), read_pct, sync, seed, and the geometry
+// of the bench disk, volume and cluster (bytes), prealloc, and fat
+// (eager|lazy) for how the FAT is loaded at mount.
+static int parse_opts(const char *workload, int argc, char **argv, bench_opts_t *o) {
+    *o = (bench_opts_t){ .threads = 1, .io_size = 4096, .file_size = 1024 * 1024, .ops = 10000,
+                         .read_pct = 70, .seed = 1 };
+    if (strcmp(workload, "create") == 0 || strcmp(workload, "append") == 0) {
+        o->io_size = 128;
+    }
+    for (int i = 0; i < argc; i++) {
+        const char *eq = strchr(argv[i], '=');
+        if (!eq) {
+            fprintf(stderr, "%s: expected key=value, got '%s'\n", workload, argv[i]);
+            return -1;
+        }
+        size_t klen = (size_t)(eq - argv[i]);
+        const char *v = eq + 1;
+        if (key_is(argv[i], klen, "threads")) {
+            o->threads = atoi(v);
+        } else if (key_is(argv[i], klen, "io_size")) {
+            o->io_size = parse_size(v);
+        } else if (key_is(argv[i], klen, "size")) {
+            o->file_size = parse_size(v);
+        } else if (key_is(argv[i], klen, "ops")) {
+            o->ops = atol(v);
+        } else if (key_is(argv[i], klen, "backend")) {
+            o->backend = strcmp(v, "mmap") == 0 ? DISK_BACKEND_MMAP
+                       : strcmp(v, "uring") == 0 ? DISK_BACKEND_URING : DISK_BACKEND_FILE;
+        } else if (key_is(argv[i], klen, "cache")) {
+            o->cache_blocks = atoi(v);
+        } else if (key_is(argv[i], klen, "read_pct")) {
+            o->read_pct = atoi(v);
+        } else if (key_is(argv[i], klen, "sync")) {
+            o->sync_every = atoi(v);
+        } else if (key_is(argv[i], klen, "seed")) {
+            o->seed = (unsigned)atoi(v);
+        } else if (key_is(argv[i], klen, "volume")) {
+            o->mkfs.volume_size = parse_size(v);
+        } else if (key_is(argv[i], klen, "cluster")) {
+            o->mkfs.cluster_size = (uint32_t)parse_size(v);
+        } else if (key_is(argv[i], klen, "prealloc")) {
+            o->mkfs.preallocate = atoi(v);
+        } else if (key_is(argv[i], klen, "fat")) {
+            o->fat_mode = strcmp(v, "lazy") == 0 ? FAT_LAZY : FAT_EAGER;
+        } else {
+            fprintf(stderr, "%s: unknown option '%.*s'\n", workload, (int)klen, argv[i]);
+            return -1;
+        }
+    }
+    if (o->threads < 1 || o->threads > BENCH_MAX_THREADS || o->io_size == 0 || o->file_size == 0 ||
+        o->ops < 0 || o->read_pct < 0 || o->read_pct > 100) {
+        fprintf(stderr, "%s: threads must be 1-%d, io_size and size positive, read_pct 0-100\n",
+                workload, BENCH_MAX_THREADS);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *workload = (argc > 1) ? argv[1] : "fill";
+
+    // Mount and unmount progress would interleave with the results
+    log_set_level(LOG_WARN);
+
+    if (strcmp(workload, "fill") == 0) {
+        uint32_t run_length = (argc > 2) ? (uint32_t)atoi(argv[2]) : 1;
+        return bench_fill(run_length ? run_length : 1) == 0 ? 0 : 1;
+    }
+
+    if (strcmp(workload, "scale") == 0) {
+        int max_threads = (argc > 2) ? atoi(argv[2]) : 8;
+        size_t io_size = (argc > 3) ? (size_t)atol(argv[3]) : 1024;
+        const char *backend = (argc > 4) ? argv[4] : "file";
+        if (max_threads < 1 || max_threads > 64 || io_size == 0) {
+            fprintf(stderr, "scale: threads must be 1-64 and io_size positive\n");
+            return 1;
+        }
+        int b = strcmp(backend, "mmap") == 0 ? DISK_BACKEND_MMAP
+              : strcmp(backend, "uring") == 0 ? DISK_BACKEND_URING : DISK_BACKEND_FILE;
+        return bench_scale(max_threads, io_size, b) == 0 ? 0 : 1;
+    }
+
+    if (strcmp(workload, "stress") == 0) {
+        int nthreads = (argc > 2) ? atoi(argv[2]) : 8;
+        if (nthreads < 1 || nthreads > 15) {
+            fprintf(stderr, "stress: threads must be 1-15\n");
+            return 1;
+        }
+        return bench_stress(nthreads) == 0 ? 0 : 1;
+    }
+
+    if (strcmp(workload, "format") == 0) {
+        bench_opts_t opts;
+        if (parse_opts(workload, argc - 2, argv + 2, &opts) != 0) {
+            return 1;
+        }
+        return bench_format(&opts) == 0 ? 0 : 1;
+    }
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strcmp(workload, workloads[i].name) == 0) {
+            bench_opts_t opts;
+            if (parse_opts(workload, argc - 2, argv + 2, &opts) != 0) {
+                return 1;
+            }
+            return bench_run(&workloads[i], &opts) == 0 ? 0 : 1;
+        }
+    }
+
+    fprintf(stderr, "usage: %s fill [run_length] | scale [max_threads] [io_size] [file|mmap|uring] | stress [threads]\n"
+                    "       %s seqwrite|seqread|scan|randread|randwrite|mix|create|append|fillfs|clone|copy|format [key=value ...]\n"
+                    "       keys: threads io_size size ops backend=file|mmap|uring cache read_pct sync seed volume cluster prealloc fat=eager|lazy\n",
+            argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "filesystem.h"
+#include "check.h"
+
+// Command-line front end of fs_check: checks a disk image and prints what it
+// found. Exit status 0 means consistent, 1 problems found (or repaired with
+// repair=1), 2 that the volume could not be checked.
+
+static void usage() {
+    fprintf(stderr, "usage: fs_check <disk> [threads=N] [repair=1]\n");
+}
+
+static void print_report(const check_report_t *r, int problems, int repair) {
+    printf("fs_check: %u files, %u directories, %u clusters used, %u free (superblock: %u)\n",
+           r->files, r->directories, r->used_clusters, r->free_clusters, r->free_recorded);
+    if (r->journal_pending) {
+        printf("  journal: commits to replay%s\n", repair ? " (replayed)" : ", checked as on disk");
+    }
+
+    const struct {
+        const char *name;
+        uint32_t count;
+    } lines[] = {
+        { "FAT1/FAT2 mismatches", r->fat_mismatches },
+        { "invalid FAT entries", r->bad_entries },
+        { "invalid directory entries", r->bad_dir_entries },
+        { "cross-linked chains", r->cross_linked },
+        { "chain cycles", r->cycles },
+        { "broken chains", r->bad_chains },
+        { "size mismatches", r->size_mismatches },
+        { "leaked clusters", r->leaked },
+        { "wrong reference counts", r->bad_refs },
+        { "bad inline data slots", r->bad_inline },
+    };
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        if (lines[i].count) {
+            printf("  %s: %u\n", lines[i].name, lines[i].count);
+        }
+    }
+
+    if (problems == 0) {
+        printf("  clean");
+    } else {
+        printf("  %d problems%s", problems, repair ? " repaired" : "");
+    }
+    printf(" (%u blocks written, %.3f s)\n", r->repaired, r->seconds);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 2;
+    }
+
+    check_opts_t opts = { 0 };
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "threads=", 8) == 0) {
+            opts.threads = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "repair=", 7) == 0) {
+            opts.repair = atoi(argv[i] + 7);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    // Only the report, not the replay's mount and umount progress
+    log_set_level(LOG_WARN);
+
+    check_report_t report;
+    int problems = fs_check(argv[1], &opts, &report);
+    if (problems < 0) {
+        fprintf(stderr, "fs_check: %s: %s\n", argv[1], fs_strerror(fs_errno()));
+        return 2;
+    }
+    print_report(&report, problems, opts.repair);
+    return problems ? 1 : 0;
+}
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "filesystem.h"
+#include "directory.h"
+#include "fat.h"
+#include "check.h"
+
+// Tests of behaviour the demo does not show, each on a freshly formatted
+// image: a test mounts it, checks the results of its fs_* calls and leaves
+// it unmounted, and fs_check then has to find the volume consistent. Run as
+// fs_test [name ...] (all tests by default); prints one line per test and
+// exits with 1 if any failed.
+
+#define TEST_DISK "test_disk"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("  %s:%d: %s failed\n", __func__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+// Create `name` with `size` bytes of `fill` and close it
+static int write_file(const char *name, size_t size, char fill) {
+    char buf[BLOCK_SIZE];
+    memset(buf, fill, sizeof(buf));
+    int fd = (fs_create(name) == 0) ? fs_open(name) : -1;
+    CHECK(fd >= 0);
+    for (size_t done = 0; done < size; done += sizeof(buf)) {
+        size_t n = (size - done < sizeof(buf)) ? size - done : sizeof(buf);
+        CHECK(fs_write(fd, buf, n) == (int)n);
+    }
+    CHECK(fs_close(fd) == 0);
+    return 0;
+}
+
+// Write one byte at `offset` of `name` and return the blocks read and written
+// meanwhile, up to the entry being written back by fs_close
+static int poke(const char *name, size_t offset, char value, uint64_t *reads, uint64_t *writes) {
+    fs_reset_stats();
+    int fd = fs_open(name);
+    CHECK(fd >= 0);
+    CHECK(fs_lseek(fd, offset) == 0);
+    CHECK(fs_write(fd, &value, 1) == 1);
+    CHECK(fs_close(fd) == 0);
+    CHECK(fs_sync() == 0);
+
+    fs_stats_t stats;
+    CHECK(fs_get_stats(&stats) == 0);
+    *reads = stats.block_reads;
+    *writes = stats.block_writes;
+    return 0;
+}
+
+// Read `len` bytes at `offset` of `name` and compare them with `expect`
+static int verify(const char *name, size_t offset, size_t len, char expect) {
+    char buf[BLOCK_SIZE];
+    int fd = fs_open(name);
+    CHECK(fd >= 0 && fs_lseek(fd, offset) == 0);
+    while (len > 0) {
+        size_t n = (len < sizeof(buf)) ? len : sizeof(buf);
+        CHECK(fs_read(fd, buf, n) == (int)n);
+        for (size_t i = 0; i < n; i++) {
+            CHECK(buf[i] == expect);
+        }
+        len -= n;
+    }
+    CHECK(fs_close(fd) == 0);
+    return 0;
+}
+
+// Writing a clone copies one cluster when the shared part of its chain
+// starts at the cluster written, and the clusters before a later one only
+// once; the source keeps its bytes throughout
+static int test_clone_write() {
+    const size_t size = 4 << 20;
+    const uint64_t slack = 16;  // journal, FAT, reference count, directory and superblock blocks
+    uint64_t reads, writes;
+
+    CHECK(make_fs(TEST_DISK) == 0 && mount_fs(TEST_DISK) == 0);
+    size_t clusters = size / CLUSTER_SIZE;
+    CHECK(write_file("src", size, 'a') == 0);
+    CHECK(fs_clone("src", "dst") == 0);
+
+    // The first cluster, then the second right after the copied one
+    CHECK(poke("dst", 0, 'b', &reads, &writes) == 0);
+    CHECK(reads <= superblock.cluster_blocks + slack && writes <= superblock.cluster_blocks + slack);
+    CHECK(poke("dst", CLUSTER_SIZE, 'b', &reads, &writes) == 0);
+    CHECK(reads <= superblock.cluster_blocks + slack && writes <= superblock.cluster_blocks + slack);
+
+    // The last byte: the shared clusters before it are copied with it, once
+    CHECK(poke("dst", size - 1, 'b', &reads, &writes) == 0);
+    CHECK(writes >= (clusters - 2) * superblock.cluster_blocks);
+    CHECK(poke("dst", size - 2, 'b', &reads, &writes) == 0);
+    CHECK(reads <= slack && writes <= slack);
+
+    CHECK(verify("src", 0, size, 'a') == 0);
+    CHECK(verify("dst", 1, CLUSTER_SIZE - 1, 'a') == 0);
+    CHECK(verify("dst", size - 2, 2, 'b') == 0);
+    CHECK(umount_fs() == 0);
+    return 0;
+}
+
+// Small files in the root get a cluster each, so all MAX_FILES names fit
+// and listing the root shows each of them once
+static int test_root_capacity() {
+    char name[16];
+    CHECK(make_fs(TEST_DISK) == 0 && mount_fs(TEST_DISK) == 0);
+    uint32_t free_clusters = superblock.free_clusters_count;
+    for (int i = 0; i < MAX_FILES; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        CHECK(write_file(name, 300, (char)('a' + i % 26)) == 0);
+    }
+    CHECK(superblock.free_clusters_count == free_clusters - MAX_FILES);
+    log_set_level(LOG_NONE);
+    int full = fs_create("one_more");
+    log_set_level(LOG_WARN);
+    CHECK(full < 0 && fs_errno() == FS_ENOSPC);
+
+    CHECK(umount_fs() == 0 && mount_fs(TEST_DISK) == 0);
+    int listed = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        const char *entry_name = root_directory.entries[i].filename;
+        listed += (entry_name[0] != '\0' && (uint8_t)entry_name[0] != INLINE_MARK);
+    }
+    CHECK(listed == MAX_FILES);
+    for (int i = 0; i < MAX_FILES; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        CHECK(verify(name, 0, 300, (char)('a' + i % 26)) == 0);
+    }
+    CHECK(umount_fs() == 0);
+    return 0;
+}
+
+// An inline file whose subdirectory has no free slot left for its data is
+// moved to a cluster when it is closed, and reads back after a remount
+static int test_promote_full_dir() {
+    char name[16];
+    CHECK(make_fs(TEST_DISK) == 0 && mount_fs(TEST_DISK) == 0);
+    CHECK(fs_mkdir("d") == 0);
+    int slots = (int)(superblock.cluster_blocks * DIR_ENTRIES_PER_BLOCK);
+    for (int i = 0; i < slots - 1; i++) {
+        snprintf(name, sizeof(name), "d/e%d", i);
+        CHECK(fs_create(name) == 0);
+    }
+
+    // One slot is left, and 300 bytes need five
+    uint32_t free_clusters = superblock.free_clusters_count;
+    CHECK(write_file("d/last", 300, 'p') == 0);
+    CHECK(superblock.free_clusters_count == free_clusters - 1);
+    CHECK(verify("d/last", 0, 300, 'p') == 0);
+
+    CHECK(umount_fs() == 0 && mount_fs(TEST_DISK) == 0);
+    CHECK(verify("d/last", 0, 300, 'p') == 0);
+    CHECK(umount_fs() == 0);
+    return 0;
+}
+
+// Inline files of every slot count keep their bytes across remounts, after
+// being written, overwritten and truncated
+static int test_inline_remount() {
+    const size_t sizes[] = { 0, 1, INLINE_SLOT_BYTES, INLINE_SLOT_BYTES + 1, 200, INLINE_MAX };
+    const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    char name[16];
+    CHECK(make_fs(TEST_DISK) == 0 && mount_fs(TEST_DISK) == 0);
+    CHECK(fs_mkdir("d") == 0);
+    uint32_t free_clusters = superblock.free_clusters_count;
+    for (size_t i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "d/f%zu", i);
+        CHECK(write_file(name, sizes[i], 'i') == 0);
+    }
+    CHECK(superblock.free_clusters_count == free_clusters);
+
+    CHECK(umount_fs() == 0 && mount_fs(TEST_DISK) == 0);
+    for (size_t i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "d/f%zu", i);
+        CHECK(verify(name, 0, sizes[i], 'i') == 0);
+        int fd = fs_open(name);
+        CHECK(fd >= 0 && fs_get_filesize(fd) == (int64_t)sizes[i]);
+        CHECK(fs_write(fd, "jj", 2) == 2);
+        CHECK(fs_trunc(fd, sizes[i] / 2 + 1) == 0);
+        CHECK(fs_close(fd) == 0);
+    }
+
+    CHECK(umount_fs() == 0 && mount_fs(TEST_DISK) == 0);
+    for (size_t i = 0; i < count; i++) {
+        size_t size = sizes[i] / 2 + 1;
+        snprintf(name, sizeof(name), "d/f%zu", i);
+        CHECK(verify(name, 0, size < 2 ? size : 2, 'j') == 0);
+        CHECK(size <= 2 || verify(name, 2, size - 2, 'i') == 0);
+        int fd = fs_open(name);
+        CHECK(fd >= 0 && fs_get_filesize(fd) == (int64_t)size);
+        CHECK(fs_close(fd) == 0);
+    }
+    CHECK(superblock.free_clusters_count == free_clusters);
+    CHECK(umount_fs() == 0);
+    return 0;
+}
+
+// Copy the image file `from` to `to`
+static int copy_image(const char *from, const char *to) {
+    char buf[1 << 16];
+    FILE *in = fopen(from, "rb");
+    FILE *out = in ? fopen(to, "wb") : NULL;
+    size_t n = 0;
+    int result = out ? 0 : -1;
+    while (result == 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        result = (fwrite(buf, 1, n, out) == n) ? 0 : -1;
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (out && fclose(out) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Starting cluster of the root entry `name`, FAT_FREE if there is none
+static uint32_t root_start(const char *name) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (strcmp(root_directory.entries[i].filename, name) == 0) {
+            return root_directory.entries[i].starting_cluster;
+        }
+    }
+    return FAT_FREE;
+}
+
+// Open `name` and make its data and metadata durable
+static int sync_file(const char *name) {
+    int fd = fs_open(name);
+    CHECK(fd >= 0 && fs_fsync(fd) == 0 && fs_close(fd) == 0);
+    return 0;
+}
+
+// The image as a crash after the last commit leaves it, with the changes in
+// the journal and no checkpoint: mount_fs replays the FAT, reference count
+// and directory records, and skips those for a directory block that was
+// revoked and then reused for file data
+static int test_replay() {
+    CHECK(make_fs(TEST_DISK) == 0 && mount_fs(TEST_DISK) == 0);
+    CHECK(fs_mkdir("d") == 0);
+    CHECK(write_file("d/small", 100, 's') == 0);
+    CHECK(write_file("big", 3 * BLOCK_SIZE + 10, 'b') == 0);
+    CHECK(fs_clone("big", "twin") == 0);
+
+    // A directory whose cluster goes to a file's data once it is removed
+    CHECK(fs_mkdir("old") == 0);
+    CHECK(write_file("old/x", 10, 'x') == 0);
+    uint32_t old = root_start("old");
+    CHECK(fs_delete("old/x") == 0 && fs_rmdir("old") == 0);
+    CHECK(write_file("reuse", BLOCK_SIZE, 'r') == 0);
+    CHECK(root_start("reuse") == old);
+    CHECK(sync_file("big") == 0 && sync_file("reuse") == 0);
+
+    // Keep the image as it is before umount_fs checkpoints
+    CHECK(copy_image(TEST_DISK, TEST_DISK ".crash") == 0);
+    CHECK(umount_fs() == 0);
+    CHECK(rename(TEST_DISK ".crash", TEST_DISK) == 0);
+
+    check_opts_t opts = { 0 };
+    check_report_t report;
+    CHECK(fs_check(TEST_DISK, &opts, &report) >= 0 && report.journal_pending);
+
+    CHECK(mount_fs(TEST_DISK) == 0);
+    CHECK(verify("d/small", 0, 100, 's') == 0);
+    CHECK(verify("big", 0, 3 * BLOCK_SIZE + 10, 'b') == 0);
+    CHECK(verify("twin", 0, 3 * BLOCK_SIZE + 10, 'b') == 0);
+    CHECK(verify("reuse", 0, BLOCK_SIZE, 'r') == 0);
+    CHECK(root_start("old") == FAT_FREE);
+    CHECK(umount_fs() == 0);
+    CHECK(fs_check(TEST_DISK, &opts, &report) == 0 && !report.journal_pending);
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    int (*run)();
+} test_t;
+
+static const test_t tests[] = {
+    { "clone_write", test_clone_write },
+    { "root_capacity", test_root_capacity },
+    { "promote_full_dir", test_promote_full_dir },
+    { "inline_remount", test_inline_remount },
+    { "replay", test_replay },
+};
+
+static int run_test(const test_t *t) {
+    int result = t->run();
+    if (result < 0) {
+        umount_fs();  // a failed test may leave the volume mounted
+    }
+
+    check_opts_t opts = { 0 };
+    check_report_t report;
+    int problems = fs_check(TEST_DISK, &opts, &report);
+    if (result == 0 && problems != 0) {
+        printf("  %s: fs_check found %d problems\n", t->name, problems);
+        result = -1;
+    }
+    printf("%s %s\n", result == 0 ? "PASS" : "FAIL", t->name);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    // Only the failures, not the mount and umount progress
+    log_set_level(LOG_WARN);
+
+    int failed = 0;
+    int ran = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int selected = (argc < 2);
+        for (int a = 1; a < argc; a++) {
+            selected = selected || strcmp(argv[a], tests[i].name) == 0;
+        }
+        if (selected) {
+            failed += (run_test(&tests[i]) < 0);
+            ran++;
+        }
+    }
+    remove(TEST_DISK);
+
+    printf("%d of %d tests passed\n", ran - failed, ran);
+    return failed ? 1 : 0;
+}
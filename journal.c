@@ -0,0 +1,649 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "journal.h"
+#include "disk.h"
+#include "cache.h"
+#include "fat.h"
+#include "log.h"
+
+// Write-ahead redo journal for metadata.
+//
+// Every change to the FAT, to a cluster's reference count or to a directory
+// entry goes through this file: the in-memory copy is updated and a compact
+// redo record appended to a pending buffer under one lock, so records are in
+// the order the changes were made. A commit packs the pending records into
+// journal blocks, each with a header carrying the journal sequence, its
+// position and a checksum; the last block of a commit is flagged. Commits
+// are grouped: while one thread writes and syncs a batch, others append and
+// wait, and the next thread to commit writes everything that accumulated
+// in one go.
+//
+// Records are idempotent redo values, so mount_fs replays every complete
+// commit in order. Operations order their changes so that any prefix is
+// consistent: a crash can leak clusters of an operation in flight but never
+// leaves an entry pointing at freed clusters. Directory blocks are dirtied
+// through the cache with the LSN of their last record and the cache will not
+// write them back before that record is on disk.
+//
+// A checkpoint writes the cache, the FAT and the root directory in place and
+// starts a new journal sequence, which invalidates the old blocks. It runs
+// when half the journal is used, from fs_sync, at umount and after replay.
+// Each FAT block has a dirty bit set by every change to it, so a checkpoint
+// writes only the FAT1/FAT2 blocks that changed, and the root directory only
+// if it changed. Volumes made before the journal existed (journal_blocks ==
+// 0) skip the logging but still get the dirty tracking.
+
+// A revoke found by replay: records for `block` before it are skipped
+typedef struct {
+    uint32_t block;
+    uint32_t recno;             // record number of the revoke within the replayed commits
+} revoke_t;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+static int enabled = 0;         // the volume has a journal region
+static int journal_mode = JOURNAL_SYNC;
+static uint32_t sequence = 0;   // current journal generation
+static uint32_t next_block = 1; // next unwritten journal block, relative to its start
+
+static char *pending = NULL;    // records not yet written, packed into blocks
+static char *spare = NULL;      // swapped with pending while a commit writes
+static uint32_t pending_blocks = 0;
+static uint32_t pending_capacity = 0;
+static uint32_t retry_blocks = 0; // blocks of a batch in spare whose write failed
+static uint64_t retry_lsn = 0;    // last record of that batch
+
+static uint64_t appended_lsn = 0; // records appended so far
+static uint64_t durable_lsn = 0;  // records known to be on disk
+static int flushing = 0;          // a commit is writing outside the lock
+
+static int root_dirty = 0;         // root_directory changed since the last checkpoint
+
+static uint32_t checksum(const char *data, size_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static journal_block_t *header_of(char *block) {
+    return (journal_block_t *)block;
+}
+
+static uint32_t block_checksum(char *block) {
+    journal_block_t *header = header_of(block);
+    uint32_t saved = header->checksum;
+    header->checksum = 0;
+    uint32_t sum = checksum(block, sizeof(journal_block_t) + header->used);
+    header->checksum = saved;
+    return sum;
+}
+
+static int write_header() {
+    char buf[BLOCK_SIZE];
+    memset(buf, 0, BLOCK_SIZE);
+    journal_block_t *header = header_of(buf);
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = sequence;
+    header->checksum = block_checksum(buf);
+    return block_write(superblock.journal_start_block, buf);
+}
+
+// Write the initial journal header of a new volume.
+int journal_format() {
+    if (superblock.journal_blocks == 0) {
+        return 0;
+    }
+    sequence = 1;
+    if (write_header() < 0) {
+        log_error(FS_EIO, "journal_format: failed to write journal header");
+        return -1;
+    }
+    return 0;
+}
+
+static size_t record_size(uint8_t type) {
+    return sizeof(journal_rec_t) + (type == JREC_ENTRY ? sizeof(dir_entry_t) : 0);
+}
+
+// Write `count` packed journal blocks at next_block and sync them.
+static int write_blocks(char *buf, uint32_t count) {
+    struct iovec iov = { buf, (size_t)count * BLOCK_SIZE };
+    int result = block_writev(superblock.journal_start_block + next_block, &iov, 1);
+    if (result == 0) {
+        result = sync_disk();
+    }
+    if (result < 0) {
+        log_error(FS_EIO, "journal: failed to write %u blocks at %u", count, next_block);
+    }
+    return result;
+}
+
+// Pack the pending records into journal blocks and write them with one
+// vectored write and a sync. Unless `keep_lock`, the lock is dropped for the
+// I/O so other threads can keep appending. next_block only moves past a
+// batch once it is on disk: a batch whose write failed stays in spare and
+// is written again, to the same blocks, before anything after it, so replay
+// never meets a gap. Called with journal_lock held.
+static int write_pending(int keep_lock) {
+    if (retry_blocks > 0) {
+        if (write_blocks(spare, retry_blocks) < 0) {
+            return -1;
+        }
+        next_block += retry_blocks;
+        retry_blocks = 0;
+        __atomic_store_n(&durable_lsn, retry_lsn, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&journal_cond);
+    }
+    if (pending_blocks == 0) {
+        __atomic_store_n(&durable_lsn, appended_lsn, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    char *buf = pending;
+    uint32_t count = pending_blocks;
+    uint32_t start = next_block;
+    uint64_t target = appended_lsn;
+
+    // Only possible once a checkpoint has failed: commit_locked keeps room for a batch
+    if (start + count > superblock.journal_blocks) {
+        return log_error(FS_ENOSPC, "journal: no room for %u blocks at %u", count, start);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        char *block = buf + (size_t)i * BLOCK_SIZE;
+        journal_block_t *header = header_of(block);
+        header->magic = JOURNAL_MAGIC;
+        header->sequence = sequence;
+        header->index = start + i;
+        header->commit = (i == count - 1);
+        header->checksum = block_checksum(block);
+    }
+
+    flushing = 1;
+    pending = spare;
+    spare = buf;
+    pending_blocks = 0;
+    if (!keep_lock) {
+        pthread_mutex_unlock(&journal_lock);
+    }
+
+    int result = write_blocks(buf, count);
+
+    if (!keep_lock) {
+        pthread_mutex_lock(&journal_lock);
+    }
+    flushing = 0;
+    if (result == 0) {
+        next_block = start + count;
+        __atomic_store_n(&durable_lsn, target, __ATOMIC_RELEASE);
+        log_trace(TRACE_COMMIT, target, count);
+    } else {
+        retry_blocks = count;
+        retry_lsn = target;
+    }
+    pthread_cond_broadcast(&journal_cond);
+    return result;
+}
+
+// Write the cache, the FAT and the root directory in place, then start a new
+// journal sequence. The pending records are committed first so the journal
+// covers everything in memory should the checkpoint itself be interrupted.
+// Called with journal_lock held; the lock is kept throughout.
+static int checkpoint_locked() {
+    while (flushing) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    if (enabled && write_pending(1) < 0) {
+        return -1;
+    }
+
+    if (cache_flush() < 0) {
+        log_error(FS_EIO, "journal_checkpoint: failed to flush block cache");
+        return -1;
+    }
+
+    // Write the changed FAT blocks to FAT 1 and its duplicate FAT 2, then the root directory
+    if (fat_write_dirty() < 0) {
+        return -1;
+    }
+
+    if (root_dirty) {
+        char buf[BLOCK_SIZE];
+        memset(buf, 0, BLOCK_SIZE);
+        memcpy(buf, &root_directory, sizeof(root_directory_t));
+        if (block_write(superblock.root_dir_block, buf) < 0) {
+            log_error(FS_EIO, "journal_checkpoint: failed to write root directory");
+            return -1;
+        }
+        root_dirty = 0;
+    }
+    if (sync_disk() < 0) {
+        return -1;
+    }
+
+    if (enabled) {
+        sequence++;
+        if (write_header() < 0 || sync_disk() < 0) {
+            log_error(FS_EIO, "journal_checkpoint: failed to write journal header");
+            return -1;
+        }
+        next_block = 1;
+    }
+    return 0;
+}
+
+// Make every record up to `target` durable, writing the pending batch or
+// waiting for the thread that is. A batch starts in the first half of the
+// journal, and with at most pending_capacity blocks pending and as many to
+// retry it fits in the rest; past the half a checkpoint, retried here if it
+// failed before, starts a new sequence first. Called with journal_lock held.
+static int commit_locked(uint64_t target) {
+    while (__atomic_load_n(&durable_lsn, __ATOMIC_ACQUIRE) < target) {
+        if (flushing) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+            continue;
+        }
+        if (next_block > superblock.journal_blocks / 2) {
+            if (checkpoint_locked() < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (write_pending(0) < 0) {
+            return -1;
+        }
+        if (next_block > superblock.journal_blocks / 2 && checkpoint_locked() < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Append a record, with `payload` following it for JREC_ENTRY. Returns its
+// LSN, or 0 if the buffer was full and could not be committed, in which case
+// the change must not be made. Called with journal_lock held, before the
+// change is made in memory: committing a full buffer drops the lock, and a
+// checkpoint running then must not write a change whose record is not yet
+// in the journal.
+static uint64_t append(uint8_t type, uint32_t target, uint32_t value, const void *payload) {
+    size_t size = record_size(type);
+    size_t limit = BLOCK_SIZE - sizeof(journal_block_t);
+
+    char *block = pending_blocks ? pending + (size_t)(pending_blocks - 1) * BLOCK_SIZE : NULL;
+    if (!block || header_of(block)->used + size > limit) {
+        // A full buffer is committed before anything else is appended
+        if (pending_blocks == pending_capacity && commit_locked(appended_lsn) < 0) {
+            return 0;
+        }
+        block = pending + (size_t)pending_blocks++ * BLOCK_SIZE;
+        header_of(block)->used = 0;
+    }
+
+    journal_rec_t *rec = (journal_rec_t *)(block + sizeof(journal_block_t) + header_of(block)->used);
+    memset(rec, 0, sizeof(journal_rec_t));
+    rec->type = type;
+    rec->target = target;
+    rec->value = value;
+    if (payload) {
+        memcpy(rec + 1, payload, sizeof(dir_entry_t));
+    }
+    header_of(block)->used += size;
+    return ++appended_lsn;
+}
+
+// Set FAT entry `cluster` to `value` and log the change. The FAT block is
+// pinned first, so once the record is appended the change cannot fail, and
+// because a cache miss may have to commit, which needs journal_lock.
+int journal_fat(uint32_t cluster, uint32_t value) {
+    char *page;
+    if (fat_pin(cluster, &page) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&journal_lock);
+    uint64_t lsn = enabled ? append(JREC_FAT, cluster, value, NULL) : 0;
+    int result = (enabled && !lsn) ? -1 : fat_set(cluster, value, lsn);
+    pthread_mutex_unlock(&journal_lock);
+    fat_unpin(page);
+    return result;
+}
+
+// Set the extra references of `cluster` and log the change, pinning the
+// block of counts first like journal_fat.
+int journal_refs(uint32_t cluster, uint32_t extra) {
+    char *page;
+    if (fat_pin_refs(cluster, &page) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&journal_lock);
+    uint64_t lsn = enabled ? append(JREC_REFS, cluster, extra, NULL) : 0;
+    int result = (enabled && !lsn) ? -1 : fat_set_refs(cluster, extra, lsn);
+    pthread_mutex_unlock(&journal_lock);
+    fat_unpin(page);
+    return result;
+}
+
+// Copy `entry` to byte `offset` of directory block `block` and log it.
+// `page` is the block's pinned cache page, or NULL for the root directory,
+// which is kept in root_directory.
+int journal_entry(int block, uint32_t offset, const dir_entry_t *entry, char *page) {
+    pthread_mutex_lock(&journal_lock);
+    uint64_t lsn = enabled ? append(JREC_ENTRY, block, offset, entry) : 0;
+    if (!enabled || lsn) {
+        char *dest = page ? page : (char *)&root_directory;
+        memcpy(dest + offset, entry, sizeof(dir_entry_t));
+        if (page) {
+            cache_mark_logged(page, lsn);
+        } else {
+            root_dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return (enabled && !lsn) ? -1 : 0;
+}
+
+// Zero the pinned cache page of a new directory block and log it.
+int journal_zero(int block, char *page) {
+    pthread_mutex_lock(&journal_lock);
+    uint64_t lsn = enabled ? append(JREC_ZERO, block, 0, NULL) : 0;
+    if (!enabled || lsn) {
+        memset(page, 0, BLOCK_SIZE);
+        cache_mark_logged(page, lsn);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return (enabled && !lsn) ? -1 : 0;
+}
+
+// Log that a directory block was freed, so replay does not rewrite it after
+// it has been reused for file data.
+int journal_revoke(int block) {
+    pthread_mutex_lock(&journal_lock);
+    uint64_t lsn = enabled ? append(JREC_REVOKE, block, 0, NULL) : 0;
+    pthread_mutex_unlock(&journal_lock);
+    return (enabled && !lsn) ? -1 : 0;
+}
+
+// Make the records of the calling thread's operation durable. In
+// JOURNAL_ASYNC mode this returns at once.
+int journal_commit() {
+    if (!enabled || journal_mode == JOURNAL_ASYNC) {
+        return 0;
+    }
+    return journal_flush();
+}
+
+// Make every record appended so far durable, whatever the mode. Without a
+// journal region the only way to do that is a checkpoint.
+int journal_flush() {
+    if (!enabled) {
+        return journal_checkpoint();
+    }
+    pthread_mutex_lock(&journal_lock);
+    int result = commit_locked(appended_lsn);
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+int journal_checkpoint() {
+    pthread_mutex_lock(&journal_lock);
+    int result = checkpoint_locked();
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+// Check whether the record `lsn` is on disk; used by the cache before it
+// writes back a logged block.
+int journal_durable(uint64_t lsn) {
+    return lsn <= __atomic_load_n(&durable_lsn, __ATOMIC_ACQUIRE);
+}
+
+// Make the records up to `lsn` durable; used by the cache when the only
+// blocks it could evict are waiting for them. Never called with
+// journal_lock held: the FAT and count blocks changed under it are pinned
+// beforehand, and a checkpoint has committed everything before it reads.
+int journal_wait(uint64_t lsn) {
+    pthread_mutex_lock(&journal_lock);
+    int result = commit_locked(lsn);
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+// Check a journal block read from position `index`.
+static int block_valid(char *block, uint32_t index) {
+    journal_block_t *header = header_of(block);
+    return header->magic == JOURNAL_MAGIC && header->sequence == sequence && header->index == index &&
+           header->used <= BLOCK_SIZE - sizeof(journal_block_t) && header->checksum == block_checksum(block);
+}
+
+// Apply one record during replay. Directory blocks are written to disk
+// directly; nothing but FAT and reference count blocks is cached yet.
+static int apply(const journal_rec_t *rec) {
+    char buf[BLOCK_SIZE];
+    uint32_t fat_entries = superblock.fat_blocks_count * (BLOCK_SIZE / sizeof(uint32_t));
+
+    switch (rec->type) {
+    case JREC_FAT:
+        return (rec->target < fat_entries) ? fat_set(rec->target, rec->value, 0) : 0;
+    case JREC_ENTRY:
+        if (rec->target == superblock.root_dir_block) {
+            if (rec->value + sizeof(dir_entry_t) <= sizeof(root_directory_t)) {
+                memcpy((char *)&root_directory + rec->value, rec + 1, sizeof(dir_entry_t));
+                root_dirty = 1;
+            }
+            return 0;
+        }
+        if (rec->target < superblock.data_start_block || rec->target >= superblock.total_blocks ||
+            rec->value + sizeof(dir_entry_t) > BLOCK_SIZE || block_read(rec->target, buf) < 0) {
+            return -1;
+        }
+        memcpy(buf + rec->value, rec + 1, sizeof(dir_entry_t));
+        return block_write(rec->target, buf);
+    case JREC_ZERO:
+        if (rec->target < superblock.data_start_block || rec->target >= superblock.total_blocks) {
+            return -1;
+        }
+        memset(buf, 0, BLOCK_SIZE);
+        return block_write(rec->target, buf);
+    case JREC_REVOKE:
+        return 0;
+    case JREC_REFS:
+        return (rec->target < superblock.data_clusters_count && superblock.ref_blocks) ?
+               fat_set_refs(rec->target, rec->value, 0) : 0;
+    }
+    return -1;
+}
+
+static int compare_revokes(const void *a, const void *b) {
+    const revoke_t *x = (const revoke_t *)a, *y = (const revoke_t *)b;
+    if (x->block != y->block) {
+        return (x->block > y->block) - (x->block < y->block);
+    }
+    return (x->recno > y->recno) - (x->recno < y->recno);
+}
+
+// Record number of the last revoke of `block` in `revoked`, sorted by
+// compare_revokes, or 0 if it was never revoked.
+static uint32_t last_revoke(const revoke_t *revoked, size_t n, uint32_t block) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (revoked[mid].block <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo > 0 && revoked[lo - 1].block == block) ? revoked[lo - 1].recno : 0;
+}
+
+// Replay every complete commit of the current sequence into the FAT, the
+// root directory and the directory blocks. Returns the number of records
+// applied or -1.
+static int replay() {
+    uint32_t nblocks = superblock.journal_blocks;
+    char *log = (char *)malloc((size_t)nblocks * BLOCK_SIZE);
+    if (!log) {
+        log_error(FS_ENOMEM, "journal: failed to allocate replay buffers");
+        return -1;
+    }
+
+    // Find the end of the last complete commit
+    uint32_t end = 1;
+    for (uint32_t i = 1; i < nblocks; i++) {
+        char *block = log + (size_t)i * BLOCK_SIZE;
+        if (block_read(superblock.journal_start_block + i, block) < 0 || !block_valid(block, i)) {
+            break;
+        }
+        if (header_of(block)->commit) {
+            end = i + 1;
+        }
+    }
+    if (end == 1) {
+        free(log);
+        return 0;
+    }
+
+    // Revokes are noted as (block, record number) pairs, at most one per
+    // record the commits hold
+    size_t max_records = (size_t)(end - 1) * ((BLOCK_SIZE - sizeof(journal_block_t)) / sizeof(journal_rec_t));
+    revoke_t *revoked = (revoke_t *)malloc(max_records * sizeof(revoke_t));
+    size_t nrevoked = 0;
+    if (!revoked) {
+        log_error(FS_ENOMEM, "journal: failed to allocate replay buffers");
+        free(log);
+        return -1;
+    }
+
+    // Two passes: note where each block was last revoked, then apply the
+    // records not superseded by a revoke
+    int applied = 0;
+    for (int pass = 0; pass < 2 && applied >= 0; pass++) {
+        uint32_t recno = 0;
+        for (uint32_t i = 1; i < end && applied >= 0; i++) {
+            char *block = log + (size_t)i * BLOCK_SIZE;
+            size_t used = header_of(block)->used;
+            for (size_t pos = 0; pos + sizeof(journal_rec_t) <= used;) {
+                const journal_rec_t *rec = (const journal_rec_t *)(block + sizeof(journal_block_t) + pos);
+                recno++;
+                pos += record_size(rec->type);
+
+                int data_record = rec->type == JREC_ENTRY || rec->type == JREC_ZERO;
+                if (pass == 0) {
+                    if (rec->type == JREC_REVOKE && nrevoked < max_records) {
+                        revoked[nrevoked++] = (revoke_t){ rec->target, recno };
+                    }
+                } else if (!data_record || last_revoke(revoked, nrevoked, rec->target) < recno) {
+                    if (apply(rec) < 0) {
+                        log_error(FS_EIO, "journal: failed to replay record %u", recno);
+                        applied = -1;
+                        break;
+                    }
+                    applied++;
+                }
+            }
+        }
+        if (pass == 0) {
+            qsort(revoked, nrevoked, sizeof(revoke_t), compare_revokes);
+        }
+    }
+
+    free(log);
+    free(revoked);
+    return applied;
+}
+
+// Check whether the journal of the open, unmounted disk holds a complete
+// commit that mount_fs would replay. Used by fs_check, which reads the FAT
+// and directories as they are on disk.
+int journal_pending() {
+    if (superblock.journal_blocks == 0) {
+        return 0;
+    }
+    char buf[BLOCK_SIZE];
+    if (block_read(superblock.journal_start_block, buf) < 0 || header_of(buf)->magic != JOURNAL_MAGIC ||
+        header_of(buf)->checksum != block_checksum(buf)) {
+        return 0;
+    }
+    sequence = header_of(buf)->sequence;
+
+    for (uint32_t i = 1; i < superblock.journal_blocks; i++) {
+        if (block_read(superblock.journal_start_block + i, buf) < 0 || !block_valid(buf, i)) {
+            break;
+        }
+        if (header_of(buf)->commit) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Start journaling for a mounted volume once its FAT is open and its root
+// directory is in memory: replay what the last session committed, checkpoint
+// the result and set up the pending buffers. Called by mount_fs after
+// cache_init and before the cache's WAL hook is installed.
+int journal_open(int mode) {
+    journal_mode = mode;
+    appended_lsn = durable_lsn = 0;
+    next_block = 1;
+    retry_blocks = 0;
+    enabled = 0;
+    root_dirty = 0;
+
+    if (superblock.journal_blocks == 0) {
+        return 0;
+    }
+
+    char buf[BLOCK_SIZE];
+    if (block_read(superblock.journal_start_block, buf) < 0 || header_of(buf)->magic != JOURNAL_MAGIC ||
+        header_of(buf)->checksum != block_checksum(buf)) {
+        log_error(FS_ECORRUPT, "journal_open: invalid journal header");
+        journal_close();
+        return -1;
+    }
+    sequence = header_of(buf)->sequence;
+
+    int replayed = replay();
+    if (replayed < 0) {
+        journal_close();
+        return -1;
+    }
+    if (replayed > 0) {
+        log_info("journal_open: replayed %d records", replayed);
+    }
+
+    pending_capacity = superblock.journal_blocks / 4;
+    pending = (char *)malloc((size_t)pending_capacity * BLOCK_SIZE);
+    spare = (char *)malloc((size_t)pending_capacity * BLOCK_SIZE);
+    if (!pending || !spare) {
+        log_error(FS_ENOMEM, "journal_open: failed to allocate journal buffers");
+        journal_close();
+        return -1;
+    }
+    pending_blocks = 0;
+    enabled = 1;
+
+    // Fold the replayed records into place and start a fresh sequence
+    if (replayed > 0 && journal_checkpoint() < 0) {
+        journal_close();
+        return -1;
+    }
+    return 0;
+}
+
+// Drop the journal buffers at umount, after the final checkpoint.
+void journal_close() {
+    free(pending);
+    free(spare);
+    pending = spare = NULL;
+    pending_blocks = pending_capacity = 0;
+    retry_blocks = 0;
+    enabled = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "filesystem.h"
+
+// Constants
+#define JOURNAL_MAGIC 0x4A524E4C    // "JRNL", marks journal blocks
+#define JOURNAL_BLOCKS 256          // Blocks reserved for the journal by make_fs (1 MB)
+
+#define JOURNAL_SYNC 0              // Metadata operations return once their records are on disk
+#define JOURNAL_ASYNC 1             // Records are written in batches, at checkpoints and at umount
+
+// Record types
+#define JREC_FAT 1                  // set FAT entry `target` to `value`
+#define JREC_ENTRY 2                // write the dir_entry_t that follows at byte `value` of block `target`
+#define JREC_ZERO 3                 // zero block `target` (part of a new directory cluster)
+#define JREC_REVOKE 4               // block `target` was freed; skip its earlier records on replay
+#define JREC_REFS 5                 // set the extra references of cluster `target` to `value`
+
+// Structures
+typedef struct {
+    uint32_t magic;         // JOURNAL_MAGIC
+    uint32_t sequence;      // journal generation, bumped by every checkpoint
+    uint32_t index;         // position in the journal region, 0 for the header block
+    uint16_t used;          // bytes of records after this header
+    uint16_t commit;        // nonzero on the last block of a commit
+    uint32_t checksum;      // over the header (with checksum 0) and the records
+} journal_block_t;
+
+typedef struct {
+    uint8_t type;           // JREC_*
+    uint8_t reserved[3];
+    uint32_t target;        // cluster or block the record applies to
+    uint32_t value;         // new FAT value or byte offset within the block
+} journal_rec_t;
+
+// Function prototypes
+int journal_format();
+int journal_open(int mode);
+void journal_close();
+
+int journal_fat(uint32_t cluster, uint32_t value);
+int journal_entry(int block, uint32_t offset, const dir_entry_t *entry, char *page);
+int journal_zero(int block, char *page);
+int journal_revoke(int block);
+int journal_refs(uint32_t cluster, uint32_t extra);
+
+int journal_commit();
+int journal_flush();
+int journal_checkpoint();
+int journal_durable(uint64_t lsn);
+int journal_wait(uint64_t lsn);
+int journal_pending();
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include "log.h"
+#include "stats.h"
+
+// Logging, error codes and the trace ring.
+//
+// Messages are filtered twice: the log_* macros compare against LOG_LEVEL
+// at compile time, so per-operation messages cost nothing in a default
+// build, and against log_level at run time. Errors always record their code
+// as the thread's last error, even when the message itself is filtered out.
+//
+// The trace ring keeps the last TRACE_ENTRIES events without a lock: a
+// writer claims a position with an atomic increment and publishes the event
+// by storing its sequence number last, and trace_dump skips any entry whose
+// sequence number changed while it was copied.
+
+int log_level = LOG_LEVEL;
+static __thread int last_error = FS_OK;
+
+static const char *error_names[FS_ERRORS] = {
+    "success",
+    "invalid argument",
+    "bad file descriptor",
+    "no such file or directory",
+    "file exists",
+    "is a directory",
+    "not a directory",
+    "directory not empty",
+    "resource busy",
+    "too many open files",
+    "no space left on device",
+    "out of memory",
+    "input/output error",
+    "corrupted file system",
+    "no disk mounted",
+    "unsupported file system version",
+    "too many links"
+};
+
+static trace_event_t ring[TRACE_ENTRIES];
+static uint64_t ring_head = 0;              // events ever recorded
+static uint32_t thread_count = 0;
+static __thread uint32_t thread_id = 0;     // 0 until the thread's first event
+
+void log_set_level(int level) {
+    if (level < LOG_NONE) {
+        level = LOG_NONE;
+    } else if (level > LOG_TRACE) {
+        level = LOG_TRACE;
+    }
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_get_level() {
+    return __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+static void vlog(int level, const char *format, va_list args) {
+    FILE *out = level <= LOG_WARN ? stderr : stdout;
+    if (level == LOG_WARN) {
+        fputs("warning: ", out);
+    }
+    vfprintf(out, format, args);
+    fputc('\n', out);
+}
+
+void log_message(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vlog(level, format, args);
+    va_end(args);
+}
+
+// Record `code` as the calling thread's last error and print the message at
+// LOG_ERROR. Returns -1 so an error path can end with `return log_error(...)`.
+int log_error(int code, const char *format, ...) {
+    last_error = code;
+    if (log_enabled(LOG_ERROR)) {
+        va_list args;
+        va_start(args, format);
+        vlog(LOG_ERROR, format, args);
+        va_end(args);
+    }
+    return -1;
+}
+
+// Code of the last failure in the calling thread; like errno, it is not
+// cleared by calls that succeed.
+int fs_errno() {
+    return last_error;
+}
+
+const char *fs_strerror(int code) {
+    if (code < 0 || code >= FS_ERRORS) {
+        return "unknown error";
+    }
+    return error_names[code];
+}
+
+void trace_record(int event, uint64_t a, uint64_t b) {
+    if (thread_id == 0) {
+        thread_id = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t n = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    trace_event_t *e = &ring[n & (TRACE_ENTRIES - 1)];
+    // Release stores keep the field writes after the seq reset; they are
+    // plain moves on x86
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->time_ns, stats_now(), __ATOMIC_RELEASE);
+    __atomic_store_n(&e->event, (uint32_t)event, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->thread, thread_id, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->a, a, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->b, b, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+// Print the events still in the ring, oldest first, one per line:
+// "<time_ns> <thread> <event> <a> <b>". Events being written or overwritten
+// during the dump are skipped. Returns the number printed.
+int trace_dump(FILE *out) {
+    static const char *names[TRACE_EVENTS] = {
+        "open", "close", "create", "delete", "read", "write", "lseek", "trunc",
+        "alloc", "flush", "commit", "clone", "unshare", "copy", "view", "promote"
+    };
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    uint64_t n = head > TRACE_ENTRIES ? head - TRACE_ENTRIES : 0;
+    int printed = 0;
+
+    for (; n < head; n++) {
+        trace_event_t *e = &ring[n & (TRACE_ENTRIES - 1)];
+        trace_event_t copy;
+        copy.seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        copy.time_ns = __atomic_load_n(&e->time_ns, __ATOMIC_ACQUIRE);
+        copy.event = __atomic_load_n(&e->event, __ATOMIC_ACQUIRE);
+        copy.thread = __atomic_load_n(&e->thread, __ATOMIC_ACQUIRE);
+        copy.a = __atomic_load_n(&e->a, __ATOMIC_ACQUIRE);
+        copy.b = __atomic_load_n(&e->b, __ATOMIC_ACQUIRE);
+        if (copy.seq != n + 1 || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != n + 1) {
+            continue;
+        }
+        fprintf(out, "%llu %u %s %llu %llu\n", (unsigned long long)copy.time_ns, copy.thread,
+                copy.event < TRACE_EVENTS ? names[copy.event] : "?",
+                (unsigned long long)copy.a, (unsigned long long)copy.b);
+        printed++;
+    }
+    return printed;
+}
@@ -0,0 +1,111 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Log levels, most severe first
+#define LOG_NONE  0
+#define LOG_ERROR 1                 // an operation failed (stderr)
+#define LOG_WARN  2                 // something degraded but the operation went on (stderr)
+#define LOG_INFO  3                 // mount, unmount and recovery progress (stdout)
+#define LOG_DEBUG 4                 // one line per file operation (stdout)
+#define LOG_TRACE 5                 // events recorded in the in-memory trace ring
+
+// Messages above LOG_LEVEL are compiled out: build with -DLOG_LEVEL=LOG_DEBUG
+// for per-operation messages or -DLOG_LEVEL=LOG_TRACE for the trace ring.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define TRACE_ENTRIES 4096          // Events kept by the trace ring (a power of two)
+
+// Error codes, returned by fs_errno for the calling thread's last failure
+enum {
+    FS_OK,
+    FS_EINVAL,                      // invalid argument: name, path, buffer, size or offset
+    FS_EBADF,                       // file descriptor not valid or not open
+    FS_ENOENT,                      // no such file or directory
+    FS_EEXIST,                      // name already exists
+    FS_EISDIR,                      // a file operation on a directory
+    FS_ENOTDIR,                     // a directory operation on a file
+    FS_ENOTEMPTY,                   // directory not empty
+    FS_EBUSY,                       // file open, disk already open or cache fully pinned
+    FS_EMFILE,                      // no free file descriptors
+    FS_ENOSPC,                      // no free clusters or directory entries
+    FS_ENOMEM,                      // out of memory
+    FS_EIO,                         // disk read or write failed
+    FS_ECORRUPT,                    // invalid on-disk structure
+    FS_ENODEV,                      // no disk or file system mounted
+    FS_EVERSION,                    // on-disk format version not supported
+    FS_EMLINK,                      // a cluster has too many references to be shared again
+    FS_ERRORS
+};
+
+// Trace events; a and b are event-specific arguments
+enum {
+    TRACE_OPEN,                     // a = descriptor, b = file index
+    TRACE_CLOSE,                    // a = descriptor
+    TRACE_CREATE,                   // a = starting cluster, b = attribute
+    TRACE_DELETE,                   // a = starting cluster, b = size
+    TRACE_READ,                     // a = descriptor, b = bytes read
+    TRACE_WRITE,                    // a = descriptor, b = bytes written
+    TRACE_LSEEK,                    // a = descriptor, b = offset
+    TRACE_TRUNC,                    // a = descriptor, b = new size
+    TRACE_ALLOC,                    // a = first cluster, b = clusters
+    TRACE_FLUSH,                    // a = first buffered byte, b = bytes
+    TRACE_COMMIT,                   // a = journal LSN made durable, b = blocks written
+    TRACE_CLONE,                    // a = starting cluster, b = size
+    TRACE_UNSHARE,                  // a = first cluster copied, b = clusters copied
+    TRACE_COPY,                     // a = destination descriptor, b = bytes copied
+    TRACE_VIEW,                     // a = descriptor, b = bytes covered
+    TRACE_PROMOTE,                  // a = inline bytes moved to clusters, b = data slots held
+    TRACE_EVENTS
+};
+
+// Structures
+typedef struct {
+    uint64_t seq;                   // position in the ring plus one, 0 while being written
+    uint64_t time_ns;
+    uint32_t event;
+    uint32_t thread;
+    uint64_t a;
+    uint64_t b;
+} trace_event_t;
+
+// Function prototypes
+void log_set_level(int level);
+int log_get_level();
+void log_message(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int log_error(int code, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+int fs_errno();
+const char *fs_strerror(int code);
+
+void trace_record(int event, uint64_t a, uint64_t b);
+int trace_dump(FILE *out);
+
+// Runtime level, changed with log_set_level
+extern int log_level;
+
+#define log_enabled(level) \
+    ((level) <= LOG_LEVEL && (level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define log_warn(...)                                                     \
+    do {                                                                  \
+        if (log_enabled(LOG_WARN)) log_message(LOG_WARN, __VA_ARGS__);    \
+    } while (0)
+#define log_info(...)                                                     \
+    do {                                                                  \
+        if (log_enabled(LOG_INFO)) log_message(LOG_INFO, __VA_ARGS__);    \
+    } while (0)
+#define log_debug(...)                                                    \
+    do {                                                                  \
+        if (log_enabled(LOG_DEBUG)) log_message(LOG_DEBUG, __VA_ARGS__);  \
+    } while (0)
+#define log_trace(event, a, b)                                            \
+    do {                                                                  \
+        if (log_enabled(LOG_TRACE)) trace_record(event, a, b);            \
+    } while (0)
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+// Performance counters.
+//
+// Every thread counts into a slot of its own, created on its first event, so
+// counting is a thread-local add with no shared cache line and no lock. Only
+// the owner writes a slot (with relaxed atomic stores, which compile to plain
+// moves), and stats_collect sums the slots of the live threads plus the
+// totals folded in from threads that have exited. stats_reset does not touch
+// the slots: it records the current sums as a baseline that stats_collect
+// subtracts.
+
+typedef struct stats_slot {
+    uint64_t counters[STAT_COUNTERS];
+    fs_op_stats_t ops[FS_OP_COUNT];
+    struct stats_slot *next;
+} stats_slot_t;
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_slot_t *slots = NULL;      // live threads' slots
+static stats_slot_t retired;            // sums of exited threads' slots
+static stats_slot_t baseline;           // sums at the last stats_reset
+static cache_stats_t cache_baseline;    // cache counters at the last stats_reset
+static pthread_key_t slot_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread stats_slot_t *mine = NULL;
+
+static void bump(uint64_t *v, uint64_t n) {
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Add every counter of `from` to `to`, reading `from` atomically.
+static void fold(stats_slot_t *to, stats_slot_t *from) {
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        to->counters[c] += __atomic_load_n(&from->counters[c], __ATOMIC_RELAXED);
+    }
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        fs_op_stats_t *t = &to->ops[op], *f = &from->ops[op];
+        t->calls += __atomic_load_n(&f->calls, __ATOMIC_RELAXED);
+        t->errors += __atomic_load_n(&f->errors, __ATOMIC_RELAXED);
+        t->bytes += __atomic_load_n(&f->bytes, __ATOMIC_RELAXED);
+        t->total_ns += __atomic_load_n(&f->total_ns, __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            t->latency[b] += __atomic_load_n(&f->latency[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Thread exit: keep the slot's counts in the retired totals.
+static void detach(void *arg) {
+    stats_slot_t *slot = (stats_slot_t *)arg;
+    pthread_mutex_lock(&slots_lock);
+    stats_slot_t **link = &slots;
+    while (*link != slot) {
+        link = &(*link)->next;
+    }
+    *link = slot->next;
+    fold(&retired, slot);
+    pthread_mutex_unlock(&slots_lock);
+    free(slot);
+}
+
+static void make_key() {
+    pthread_key_create(&slot_key, detach);
+}
+
+// Return the calling thread's slot, creating it on first use; NULL if out
+// of memory, in which case the thread's events go uncounted.
+static stats_slot_t *self() {
+    if (mine) {
+        return mine;
+    }
+
+    pthread_once(&key_once, make_key);
+    stats_slot_t *slot = (stats_slot_t *)calloc(1, sizeof(stats_slot_t));
+    if (!slot) {
+        return NULL;
+    }
+    pthread_mutex_lock(&slots_lock);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&slots_lock);
+    pthread_setspecific(slot_key, slot);
+    mine = slot;
+    return slot;
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(int counter, uint64_t n) {
+    stats_slot_t *slot = self();
+    if (slot) {
+        bump(&slot->counters[counter], n);
+    }
+}
+
+// Count one call of `op` that started at `start` (from stats_now) and
+// returned `result`, which for FS_OP_READ and FS_OP_WRITE is a byte count.
+// Returns `result` so a call can end with `return stats_op(...)`.
+int stats_op(int op, uint64_t start, int result) {
+    stats_slot_t *slot = self();
+    if (!slot) {
+        return result;
+    }
+
+    uint64_t ns = stats_now() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    fs_op_stats_t *s = &slot->ops[op];
+    bump(&s->calls, 1);
+    bump(&s->total_ns, ns);
+    bump(&s->latency[bucket], 1);
+    if (result < 0) {
+        bump(&s->errors, 1);
+    } else if (op == FS_OP_READ || op == FS_OP_WRITE || op == FS_OP_COPY_RANGE ||
+               op == FS_OP_READ_VIEW) {
+        bump(&s->bytes, (uint64_t)result);
+    }
+    return result;
+}
+
+// Sum every slot since the last reset. Called with slots_lock held.
+static void sum_locked(stats_slot_t *out) {
+    memcpy(out, &retired, sizeof(stats_slot_t));
+    for (stats_slot_t *slot = slots; slot; slot = slot->next) {
+        fold(out, slot);
+    }
+}
+
+void stats_collect(fs_stats_t *out) {
+    stats_slot_t sum;
+    pthread_mutex_lock(&slots_lock);
+    sum_locked(&sum);
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        sum.counters[c] -= baseline.counters[c];
+    }
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        fs_op_stats_t *s = &sum.ops[op], *b = &baseline.ops[op];
+        s->calls -= b->calls;
+        s->errors -= b->errors;
+        s->bytes -= b->bytes;
+        s->total_ns -= b->total_ns;
+        for (int k = 0; k < STATS_BUCKETS; k++) {
+            s->latency[k] -= b->latency[k];
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+
+    memset(out, 0, sizeof(fs_stats_t));
+    memcpy(out->ops, sum.ops, sizeof(out->ops));
+    out->block_reads = sum.counters[STAT_BLOCK_READS];
+    out->block_writes = sum.counters[STAT_BLOCK_WRITES];
+    out->disk_reads = sum.counters[STAT_DISK_READS];
+    out->disk_writes = sum.counters[STAT_DISK_WRITES];
+    out->fat_steps = sum.counters[STAT_FAT_STEPS];
+    out->alloc_calls = sum.counters[STAT_ALLOC_CALLS];
+    out->alloc_scan = sum.counters[STAT_ALLOC_SCAN];
+
+    // The cache starts its counters again at every mount
+    cache_get_stats(&out->cache);
+    pthread_mutex_lock(&slots_lock);
+    if (out->cache.hits >= cache_baseline.hits && out->cache.misses >= cache_baseline.misses) {
+        out->cache.hits -= cache_baseline.hits;
+        out->cache.misses -= cache_baseline.misses;
+        out->cache.evictions -= cache_baseline.evictions;
+        out->cache.writebacks -= cache_baseline.writebacks;
+        out->cache.prefetches -= cache_baseline.prefetches;
+    }
+    pthread_mutex_unlock(&slots_lock);
+    uint64_t lookups = out->cache.hits + out->cache.misses;
+    out->cache_hit_ratio = lookups ? (double)out->cache.hits / lookups : 0.0;
+}
+
+void stats_reset() {
+    cache_stats_t cache;
+    cache_get_stats(&cache);
+    pthread_mutex_lock(&slots_lock);
+    sum_locked(&baseline);
+    cache_baseline = cache;
+    pthread_mutex_unlock(&slots_lock);
+}
@@ -0,0 +1,74 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "cache.h"
+
+// Constants
+#define STATS_BUCKETS 32            // latency bucket i counts calls of [2^i, 2^(i+1)) ns
+
+// Operations with their own counters and latency histogram
+enum {
+    FS_OP_CREATE,
+    FS_OP_DELETE,
+    FS_OP_MKDIR,
+    FS_OP_RMDIR,
+    FS_OP_OPEN,
+    FS_OP_CLOSE,
+    FS_OP_READ,
+    FS_OP_WRITE,
+    FS_OP_LSEEK,
+    FS_OP_TRUNC,
+    FS_OP_FILESIZE,
+    FS_OP_SYNC,
+    FS_OP_FSYNC,
+    FS_OP_CLONE,
+    FS_OP_SNAPSHOT,
+    FS_OP_COPY_RANGE,
+    FS_OP_READ_VIEW,
+    FS_OP_COUNT
+};
+
+// Event counters kept by the layers below the fs_* calls
+enum {
+    STAT_BLOCK_READS,               // blocks read by disk.c
+    STAT_BLOCK_WRITES,              // blocks written by disk.c
+    STAT_DISK_READS,                // read requests issued by disk.c (one per range)
+    STAT_DISK_WRITES,               // write requests issued by disk.c
+    STAT_FAT_STEPS,                 // FAT entries followed while walking chains
+    STAT_ALLOC_CALLS,               // cluster and run allocations
+    STAT_ALLOC_SCAN,                // allocator search steps (bitmap words or clusters)
+    STAT_COUNTERS
+};
+
+// Structures
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;                // calls that returned -1
+    uint64_t bytes;                 // bytes moved by fs_read, fs_write, fs_copy_range and fs_read_view
+    uint64_t total_ns;
+    uint64_t latency[STATS_BUCKETS];
+} fs_op_stats_t;
+
+typedef struct {
+    fs_op_stats_t ops[FS_OP_COUNT];
+    uint64_t block_reads;
+    uint64_t block_writes;
+    uint64_t disk_reads;
+    uint64_t disk_writes;
+    uint64_t fat_steps;
+    uint64_t alloc_calls;
+    uint64_t alloc_scan;
+    cache_stats_t cache;
+    double cache_hit_ratio;         // cache.hits / (hits + misses), 0 without lookups
+} fs_stats_t;
+
+// Function prototypes
+uint64_t stats_now();
+void stats_add(int counter, uint64_t n);
+int stats_op(int op, uint64_t start, int result);
+
+void stats_collect(fs_stats_t *out);
+void stats_reset();
+
+#endif
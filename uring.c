@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE                   // <linux/fs.h> has its own; disk.h's applies here
+#include "uring.h"
+#include "log.h"
+
+// io_uring block I/O for the DISK_BACKEND_URING backend of disk.c.
+//
+// The rings are driven with the raw system calls, so no liburing is needed.
+// Each ring has the disk image registered as fixed file 0 and, once the block
+// cache calls uring_register_buffers, the cache's page pool as fixed buffer
+// 0: pages of the pool are transferred with READ_FIXED / WRITE_FIXED, which
+// skips the per-I/O page pinning, and any other buffer with READV / WRITEV.
+//
+// A caller takes one ring for a whole request list, queues up to
+// URING_ENTRIES operations, submits them with a single io_uring_enter and
+// reaps every completion before queueing the next chunk. A thread first
+// tries its home ring and moves on to any idle one, so up to URING_RINGS
+// threads have requests in flight at once. A short transfer is queued again
+// for the bytes it has left. Entries published in the submission queue are
+// never taken back: when io_uring_enter fails, those the kernel has not
+// consumed become no-ops, which it completes later without touching a
+// buffer.
+//
+// Only the operations of kernel 5.1 are used. uring_open fails when
+// io_uring is not available and disk.c then keeps its synchronous path.
+
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;                         // ring file descriptor
+    int fixed_file;                 // the image is registered as file 0
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+} ring_t;
+
+// One queued transfer
+typedef struct {
+    int write;
+    int block;
+    char *buf;                      // single buffer, or NULL to use iov
+    size_t len;                     // bytes to transfer
+    const struct iovec *iov;
+    int iovcnt;
+    size_t done;                    // bytes already transferred by earlier completions
+} uring_op_t;
+
+#define URING_NOP_DATA UINT64_MAX   // user_data of an entry turned into a no-op
+
+static ring_t rings[URING_RINGS];
+static int nrings = 0;
+static int disk_fd = -1;
+static char *fixed_base = NULL;     // registered buffer, NULL if none
+static size_t fixed_len = 0;
+static int next_home = 0;
+static __thread int home = -1;      // ring the calling thread tries first, modulo nrings
+
+static int ring_setup(ring_t *r, int fd) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_len = r->cq_len = (r->sq_len > r->cq_len) ? r->sq_len : r->cq_len;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->cq_map = r->sq_map;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            munmap(r->sq_map, r->sq_len);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_map != r->sq_map) {
+            munmap(r->cq_map, r->cq_len);
+        }
+        munmap(r->sq_map, r->sq_len);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = (char *)r->sq_map, *cq = (char *)r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Without a registered file every SQE names the descriptor itself
+    r->fixed_file = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, &fd, 1) == 0;
+
+    pthread_mutex_init(&r->lock, NULL);
+    return 0;
+}
+
+static void ring_teardown(ring_t *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_len);
+    }
+    munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+}
+
+// Set up the rings for the disk image `fd`. Returns -1 if io_uring is not
+// available at all; fewer than URING_RINGS rings is not an error.
+int uring_open(int fd) {
+    nrings = 0;
+    while (nrings < URING_RINGS && ring_setup(&rings[nrings], fd) == 0) {
+        nrings++;
+    }
+    if (nrings == 0) {
+        return -1;
+    }
+    disk_fd = fd;
+    fixed_base = NULL;
+    fixed_len = 0;
+    return 0;
+}
+
+void uring_close() {
+    for (int i = 0; i < nrings; i++) {
+        ring_teardown(&rings[i]);
+    }
+    nrings = 0;
+    disk_fd = -1;
+    fixed_base = NULL;
+    fixed_len = 0;
+}
+
+// Register `len` bytes at `base` as fixed buffer 0 of every ring, replacing
+// the previous registration; a NULL base only drops it. Must not overlap
+// other calls. On failure the rings keep working without fixed buffers.
+int uring_register_buffers(char *base, size_t len) {
+    struct iovec iov = { base, len };
+    int result = 0;
+
+    for (int i = 0; i < nrings; i++) {
+        if (fixed_base) {
+            syscall(__NR_io_uring_register, rings[i].fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        }
+    }
+    fixed_base = NULL;
+    fixed_len = 0;
+    if (!base) {
+        return 0;
+    }
+
+    for (int i = 0; i < nrings; i++) {
+        if (syscall(__NR_io_uring_register, rings[i].fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+            log_error(FS_EIO, "uring_register_buffers: cannot register buffers: %s", strerror(errno));
+            for (int j = 0; j < i; j++) {
+                syscall(__NR_io_uring_register, rings[j].fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+            }
+            result = -1;
+            break;
+        }
+    }
+    if (result == 0) {
+        fixed_base = base;
+        fixed_len = len;
+    }
+    return result;
+}
+
+// Take the calling thread's home ring if it is idle, else any idle ring,
+// else wait for the home ring.
+static ring_t *acquire_ring() {
+    if (home == -1) {
+        home = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < nrings; i++) {
+        ring_t *r = &rings[(home + i) % nrings];
+        if (pthread_mutex_trylock(&r->lock) == 0) {
+            return r;
+        }
+    }
+    ring_t *r = &rings[home % nrings];
+    pthread_mutex_lock(&r->lock);
+    return r;
+}
+
+// Fill `sqe` for the bytes of `op` not transferred yet. `one` describes a
+// single buffer, or the rest of a scatter entry partly transferred.
+static void prep(ring_t *r, struct io_uring_sqe *sqe, const uring_op_t *op, struct iovec *one) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->off = (uint64_t)op->block * BLOCK_SIZE + op->done;
+
+    if (op->buf && fixed_base && op->buf >= fixed_base && op->buf + op->len <= fixed_base + fixed_len) {
+        sqe->opcode = op->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)(op->buf + op->done);
+        sqe->len = (uint32_t)(op->len - op->done);
+        sqe->buf_index = 0;
+    } else if (op->buf) {
+        one->iov_base = op->buf + op->done;
+        one->iov_len = op->len - op->done;
+        sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uint64_t)(uintptr_t)one;
+        sqe->len = 1;
+    } else {
+        // Skip the scatter entries already transferred; the rest of one
+        // transferred in part goes on its own
+        int k = 0;
+        size_t skip = op->done;
+        while (skip >= op->iov[k].iov_len) {
+            skip -= op->iov[k].iov_len;
+            k++;
+        }
+        sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        if (skip > 0) {
+            one->iov_base = (char *)op->iov[k].iov_base + skip;
+            one->iov_len = op->iov[k].iov_len - skip;
+            sqe->addr = (uint64_t)(uintptr_t)one;
+            sqe->len = 1;
+        } else {
+            sqe->addr = (uint64_t)(uintptr_t)&op->iov[k];
+            sqe->len = (uint32_t)(op->iovcnt - k);
+        }
+    }
+
+    if (r->fixed_file) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = disk_fd;
+    }
+}
+
+// Publish a submission queue entry for ops[i]. Called with the ring locked.
+static void queue(ring_t *r, const uring_op_t *ops, int i, struct iovec *iovs) {
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    prep(r, &r->sqes[index], &ops[i], &iovs[i]);
+    r->sqes[index].user_data = (uint64_t)i;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Turn the published entries the kernel has not consumed into no-ops, which
+// it completes on a later io_uring_enter. Returns how many there were.
+static int cancel_queued(ring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail;
+    int count = 0;
+    for (; head != tail; head++) {
+        struct io_uring_sqe *sqe = &r->sqes[r->sq_array[head & *r->sq_mask]];
+        if (sqe->user_data != URING_NOP_DATA) {
+            count++;
+        }
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = URING_NOP_DATA;
+    }
+    return count;
+}
+
+// Queue up to URING_ENTRIES operations, submit them together and wait for
+// all of their completions, queueing short transfers again. If submitting
+// fails, the operations not consumed are cancelled and the call fails once
+// those in flight have completed. Called with the ring locked.
+static int run(ring_t *r, uring_op_t *ops, int n) {
+    struct iovec iovs[URING_ENTRIES];
+    int done = 0, result = 0, failures = 0;
+
+    for (int i = 0; i < n; i++) {
+        queue(r, ops, i, iovs);
+    }
+
+    while (done < n) {
+        // Entries left over from a failed call are submitted along with ours
+        unsigned unsubmitted = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            log_error(FS_EIO, "uring: io_uring_enter failed: %s", strerror(errno));
+            result = -1;
+            if (failures++ > 0) {
+                break;  // cannot even wait for the operations in flight
+            }
+            done += cancel_queued(r);
+            continue;
+        }
+
+        // Reap every completion available
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data == URING_NOP_DATA) {
+                continue;
+            }
+            uring_op_t *op = &ops[cqe->user_data];
+            if (cqe->res > 0 && (size_t)cqe->res < op->len - op->done && !failures) {
+                op->done += (size_t)cqe->res;
+                queue(r, ops, (int)cqe->user_data, iovs);
+                continue;
+            }
+            if (cqe->res < 0 || (size_t)cqe->res != op->len - op->done) {
+                log_error(FS_EIO, "uring: %s of block %d failed: %s", op->write ? "write" : "read",
+                        op->block, cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+                result = -1;
+            }
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+// Transfer a list of block ranges, URING_ENTRIES per submission.
+int uring_rw(const disk_io_t *io, int n, int write) {
+    uring_op_t ops[URING_ENTRIES];
+    int result = 0;
+
+    ring_t *r = acquire_ring();
+    for (int start = 0; start < n; start += URING_ENTRIES) {
+        int count = (n - start < URING_ENTRIES) ? n - start : URING_ENTRIES;
+        for (int i = 0; i < count; i++) {
+            const disk_io_t *d = &io[start + i];
+            ops[i] = (uring_op_t){ write, d->block, d->buf, (size_t)d->count * BLOCK_SIZE, NULL, 0, 0 };
+        }
+        if (run(r, ops, count) < 0) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    return result;
+}
+
+// Transfer consecutive blocks from or to a scatter list with one operation.
+int uring_rwv(int block, const struct iovec *iov, int iovcnt, int write) {
+    uring_op_t op = { write, block, NULL, 0, iov, iovcnt, 0 };
+    for (int i = 0; i < iovcnt; i++) {
+        op.len += iov[i].iov_len;
+    }
+
+    ring_t *r = acquire_ring();
+    int result = run(r, &op, 1);
+    pthread_mutex_unlock(&r->lock);
+    return result;
+}
@@ -0,0 +1,20 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "disk.h"
+
+// Constants
+#define URING_RINGS 8          // Rings shared by all threads, each used by one thread at a time
+#define URING_ENTRIES 64       // Submission queue depth of a ring
+
+// Function prototypes
+int uring_open(int fd);
+void uring_close();
+int uring_register_buffers(char *base, size_t len);
+
+int uring_rw(const disk_io_t *io, int n, int write);
+int uring_rwv(int block, const struct iovec *iov, int iovcnt, int write);
+
+#endif